@@ -0,0 +1,191 @@
+#include "dmz-cache.h"
+
+/**
+ * @brief Conventional data zones of devs that can cache small writes, at most max. They only do if enough
+ * sequential zones are left to destage them to (reclaim needs two), otherwise they are plain data zones and 0 is returned.
+ */
+unsigned long dmz_nr_cache_zones(struct dmz_devs *devs, unsigned long max) {
+	unsigned long nr_conv = 0, first = devs->nr_meta_zones;
+
+	for (unsigned long i = first; i < devs->nr_zones; i++) {
+		unsigned long dev_zone;
+		struct block_device *bdev = devs->dev[dmz_zone_dev(devs, i, &dev_zone)].bdev;
+
+		if (!blk_queue_zone_is_seq(bdev_get_queue(bdev), (sector_t)dev_zone << (DMZ_ZONE_NR_BLOCKS_SHIFT + DMZ_BLOCK_SECTORS_SHIFT)))
+			nr_conv++;
+	}
+
+	if (nr_conv + 2 >= devs->nr_zones - first)
+		return 0;
+
+	return min(nr_conv, max);
+}
+
+/**
+ * @brief Turn the conventional data zones into the write cache. The reserved zone must stay sequential.
+ *
+ * @return int (0 is all ok, !0 indicates corresponding errors.)
+ */
+int dmz_cache_init(struct dmz_metadata *zmd) {
+	struct dmz_zone *zone = zmd->zone_start;
+
+	zmd->nr_cache_zones = dmz_nr_cache_zones(zmd->devs, zmd->max_cache_zones);
+	if (!zmd->nr_cache_zones)
+		return 0;
+
+	zmd->cache_zones = kcalloc(zmd->nr_cache_zones, sizeof(int), GFP_KERNEL);
+	if (!zmd->cache_zones)
+		return -ENOMEM;
+
+	int n = 0;
+	for (int i = zmd->nr_meta_zones; i < zmd->nr_zones && n < zmd->nr_cache_zones; i++) {
+		if (DMZ_IS_SEQ(&zone[i]))
+			continue;
+		set_bit(DMZ_ZONE_CACHE, &zone[i].flags);
+		zmd->cache_zones[n++] = i;
+	}
+	zmd->cache_cur = 0;
+
+	if (DMZ_IS_CACHE(&zone[zmd->reserved_zone])) {
+		for (int i = zmd->nr_meta_zones; i < zmd->nr_zones; i++) {
+			if (!DMZ_IS_CACHE(&zone[i])) {
+				zmd->reserved_zone = i;
+				break;
+			}
+		}
+	}
+
+	pr_info("%d conventional zones cache small writes.\n", zmd->nr_cache_zones);
+
+	return 0;
+}
+
+void dmz_cache_exit(struct dmz_metadata *zmd) {
+	kfree(zmd->cache_zones);
+	zmd->cache_zones = NULL;
+}
+
+/* Queue destage of a cache zone, unless it is already queued. Called from write endio too. */
+void dmz_cache_kick(struct dmz_target *dmz, int idx) {
+	struct dmz_metadata *zmd = dmz->zmd;
+	struct dmz_zone *zone = &zmd->zone_start[idx];
+
+	if (!zone->weight || test_and_set_bit(DMZ_ZONE_DESTAGING, &zone->flags))
+		return;
+
+	struct dmz_reclaim_work *rcw = kzalloc(sizeof(struct dmz_reclaim_work), GFP_ATOMIC);
+	if (!rcw) {
+		pr_err("Mem not enough for destage.");
+		clear_bit(DMZ_ZONE_DESTAGING, &zone->flags);
+		return;
+	}
+
+	rcw->bdev = zmd->target_bdev;
+	rcw->zone = idx;
+	rcw->dmz = dmz;
+	INIT_WORK(&rcw->work, dmz_reclaim_work_process);
+	queue_work(zmd->reclaim_wq, &rcw->work);
+}
+
+/**
+ * @brief Move every valid block of cache zone idx to sequential zones, sorted by lba so that they land as long
+ * sequential runs, destage_batch blocks at a time: all reads of a batch in flight, then all its writes, and the
+ * mappings are switched once the whole batch is on disk.
+ * IO is stopped like for reclaim, caller holds the reclaim lock.
+ *
+ * @return int (0 is all ok, !0 indicates corresponding errors.)
+ */
+int dmz_destage_zone(struct dmz_target *dmz, int idx) {
+	struct dmz_metadata *zmd = dmz->zmd;
+	struct dmz_zone *zone = zmd->zone_start;
+	struct dmz_meta_batch batch;
+	struct blk_plug plug;
+	unsigned long nr = 0, nr_batch = READ_ONCE(zmd->tun.destage_batch);
+	int dst = zmd->nr_meta_zones, ret = 0;
+
+	for (int i = zmd->nr_meta_zones; i < zmd->nr_zones; i++)
+		dmz_start_io(zmd, i);
+
+	unsigned long *lbas = kvmalloc_array(zone[idx].weight + 1, sizeof(unsigned long), GFP_KERNEL);
+	unsigned long *pbas = kvmalloc_array(nr_batch, sizeof(unsigned long), GFP_KERNEL);
+	void *buf = kvmalloc(nr_batch << DMZ_BLOCK_SHIFT, GFP_KERNEL);
+	if (!lbas || !pbas || !buf) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	nr = dmz_destage_collect(zmd, idx, lbas);
+
+	for (unsigned long done = 0; done < nr;) {
+		unsigned long n = min_t(unsigned long, nr - done, nr_batch);
+
+		dmz_meta_batch_init(zmd, &batch);
+		batch.bdev = zmd->target_bdev;
+		blk_start_plug(&plug);
+		for (unsigned long i = 0; i < n; i++)
+			dmz_meta_batch_submit(zmd, &batch, REQ_OP_READ, 0, dmz_get_map(zmd, lbas[done + i]), buf + (i << DMZ_BLOCK_SHIFT), 1);
+		blk_finish_plug(&plug);
+		ret = dmz_meta_batch_wait(&batch);
+		if (ret) {
+			pr_err("Destage read of zone %d failed.\n", idx);
+			goto out;
+		}
+
+		// The summary write of a segment follows its runs, writes to a zone are dispatched in submission order.
+		dmz_meta_batch_init(zmd, &batch);
+		batch.bdev = zmd->target_bdev;
+		for (unsigned long i = 0; i < n;) {
+			unsigned long cnt, pba = dmz_destage_place(zmd, &dst, n - i, &cnt);
+			if (dmz_is_default_pba(pba)) {
+				ret = -ENOSPC;
+				break;
+			}
+
+			dmz_meta_batch_submit(zmd, &batch, REQ_OP_WRITE, 0, pba, buf + (i << DMZ_BLOCK_SHIFT), cnt);
+			dmz_stat_add(zmd, destage_blocks, cnt);
+
+			u64 seq = atomic64_inc_return(&zmd->write_seq);
+			for (unsigned long k = 0; k < cnt; k++) {
+				dmz_summary_add(zmd, pba + k, lbas[done + i + k], 1, seq);
+				pbas[i + k] = pba + k;
+			}
+
+			if (!dmz_wp_seg_left(zone[dst].wp) && (ret = dmz_summary_write(zmd, dst)))
+				break;
+
+			i += cnt;
+		}
+
+		// Bios of the batch point into buf, wait for them even if the batch stopped early.
+		if (dmz_meta_batch_wait(&batch) && !ret) {
+			pr_err("Destage write of zone %d failed.\n", idx);
+			ret = -EIO;
+		}
+		if (ret)
+			goto out;
+
+		for (unsigned long i = 0; i < n; i++)
+			dmz_update_map(dmz, lbas[done + i], pbas[i]);
+
+		done += n;
+	}
+
+	// Destaged mappings must be durable before the cached copies get overwritten.
+	ret = dmz_journal_commit(dmz);
+	if (ret) {
+		pr_err("Commit destaged zone %d failed. Errno: %d", idx, ret);
+		goto out;
+	}
+
+	dmz_reset_zone_async(zmd, idx);
+	pr_debug("Destaged %lu blocks of zone %d.\n", nr, idx);
+
+out:
+	kvfree(buf);
+	kvfree(pbas);
+	kvfree(lbas);
+	clear_bit(DMZ_ZONE_DESTAGING, &zone[idx].flags);
+	for (int i = zmd->nr_meta_zones; i < zmd->nr_zones; i++)
+		dmz_complete_io(zmd, i);
+	return ret;
+}
@@ -0,0 +1,13 @@
+#ifndef _DMZ_CACHE_H_
+#define _DMZ_CACHE_H_
+
+#include "dmz.h"
+
+unsigned long dmz_nr_cache_zones(struct dmz_devs *devs, unsigned long max);
+int dmz_cache_init(struct dmz_metadata *zmd);
+void dmz_cache_exit(struct dmz_metadata *zmd);
+
+void dmz_cache_kick(struct dmz_target *dmz, int idx);
+int dmz_destage_zone(struct dmz_target *dmz, int idx);
+
+#endif
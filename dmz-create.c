@@ -1,267 +1,544 @@
 #include "dmz.h"
 
-#define DEVICE_NAME "dm"
-#define DEVICE_PATH "/dev/nullb0"
-
-static unsigned int major = 255;
-
-struct dmz_target *dmz_tgt;
-
-static blk_qc_t dmz_bops_submit_bio(struct bio *bio) {
-	return dmz_map(dmz_tgt, bio);
+/*
+ * Table line:
+ *   <zoned dev> [<zoned dev>...] [<#opt args> [meta_dev <dev>] [cache_zones <n>] [cache_max_blocks <n>] [op_ratio <pct>]
+ *                            [reserved_zones <n>] [poll <0|1>] [destage_batch <n>] [reclaim_invalid_pct <pct>]
+ *                            [ckpt_pct <pct>]]
+ *
+ * Several zoned devices make one volume, their data zones interleaved so writes spread over all of them.
+ *
+ * meta_dev:          regular device for checkpoints and journal, e.g. an SSD. By default they live on the zoned device.
+ * cache_zones:       at most this many conventional zones cache small writes, the others hold data.
+ * cache_max_blocks:  largest write, in blocks, that goes to the cache.
+ * op_ratio:          percentage of the data zones held back from the exported capacity to ease reclaim.
+ * reserved_zones:    zones held back at least, reclaim needs two.
+ * poll:              internal synchronous IO only (reclaim copies, summaries) spins on the zoned devices' poll queues
+ *                    instead of sleeping. User reads and writes are not polled.
+ * destage_batch:     blocks of a cache zone read and written back per batch of destage.
+ * reclaim_invalid_pct: a zone that fills up is reclaimed right away only if this percentage of its data is invalid,
+ *                    the others wait until allocation runs out of zones. 0 reclaims every zone that has invalid data.
+ * ckpt_pct:          journal zone fill, in percent, at which a checkpoint is queued.
+ *
+ * cache_max_blocks and the last three are tunables: "dmsetup message <dev> 0 <name> <value>" changes them under live
+ * IO, "dmsetup status" shows them and "dmsetup table" carries their current values into a reload.
+ * There is no knob for what the target has no policy for: an open zone limit, staging age, write throttling, the
+ * journal group commit size (a commit takes every FLUSH and FUA queued before it) and a reclaim slice (a victim is
+ * copied out whole while IO is stopped).
+ */
+#define DMZ_DEF_RESERVED_ZONES 2
+
+static const struct dmz_tunable_def {
+	const char *name;
+	size_t offset;
+	unsigned int min, max;
+	const char *error;
+} dmz_tunable_defs[] = {
+	{ "cache_max_blocks", offsetof(struct dmz_tunables, cache_max_blocks), 1, DMZ_ZONE_NR_DATA_BLOCKS, "cache_max_blocks must be between 1 and the data blocks of a zone" },
+	// Destage buffers a whole batch, 64MB at most.
+	{ "destage_batch", offsetof(struct dmz_tunables, destage_batch), 1, 1 << 14, "destage_batch must be between 1 and 16384" },
+	{ "reclaim_invalid_pct", offsetof(struct dmz_tunables, reclaim_invalid_pct), 0, 100, "reclaim_invalid_pct must be at most 100" },
+	// Past 95% a burst of journal blocks may fill the zone before the checkpoint runs.
+	{ "ckpt_pct", offsetof(struct dmz_tunables, ckpt_pct), 10, 95, "ckpt_pct must be between 10 and 95" },
+};
+
+static inline unsigned int *dmz_tunable(struct dmz_tunables *t, const struct dmz_tunable_def *def) {
+	return (unsigned int *)((char *)t + def->offset);
 }
 
-static int dmz_open(struct block_device *bdev, fmode_t mode) {
-	refcount_inc(&dmz_tgt->ref);
-	return 0;
-}
+/*
+ * Set tunable name of t to val. Returns -ENOENT if there is no such tunable, -EINVAL with *error set if val is out of
+ * range. Readers may run concurrently, they see either value.
+ */
+static int dmz_tunable_set(struct dmz_tunables *t, const char *name, unsigned int val, char **error) {
+	for (int i = 0; i < ARRAY_SIZE(dmz_tunable_defs); i++) {
+		const struct dmz_tunable_def *def = &dmz_tunable_defs[i];
+
+		if (strcasecmp(name, def->name))
+			continue;
+		if (val < def->min || val > def->max) {
+			*error = (char *)def->error;
+			return -EINVAL;
+		}
+		WRITE_ONCE(*dmz_tunable(t, def), val);
+		return 0;
+	}
 
-static void dmz_close(struct gendisk *disk, fmode_t mode) {
-	refcount_dec(&dmz_tgt->ref);
-	return;
+	return -ENOENT;
 }
 
-static const struct block_device_operations dmz_blk_dops = { .submit_bio = dmz_bops_submit_bio, .open = dmz_open, .release = dmz_close, .owner = THIS_MODULE };
+/* Open meta_dev and check it can hold both checkpoint slots and the journal of the target. */
+static int dmz_get_meta_dev(struct dm_target *ti, struct dmz_target *dmz, const char *path) {
+	unsigned long nr_zones = 0, nr_blocks;
+	int ret;
 
-static int queue_rw_rq(struct dmz_target *dmz, struct request *req) {
-	struct bio *next = req->bio;
+	for (unsigned int d = 0; d < dmz->devs.nr; d++)
+		nr_zones += dmz->devs.dev[d].nr_zones;
+	nr_blocks = dmz_nr_meta_zones(nr_zones) << DMZ_ZONE_NR_BLOCKS_SHIFT;
 
-	int ret = 0;
+	ret = dm_get_device(ti, path, dm_table_get_mode(ti->table), &dmz->meta_ddev);
+	if (ret) {
+		ti->error = "Metadata device lookup failed";
+		return ret;
+	}
 
-	while (next) {
-		if (dmz_map(dmz, next))
-			ret = -1;
-		next = next->bi_next;
+	// Metadata is overwritten in place there, a zoned device would need resets again.
+	if (bdev_is_zoned(dmz->meta_ddev->bdev) || (i_size_read(dmz->meta_ddev->bdev->bd_inode) >> DMZ_BLOCK_SHIFT) < nr_blocks) {
+		pr_err("Metadata device %s must be a regular device of at least %lu blocks.\n", path, nr_blocks);
+		ti->error = "Invalid metadata device";
+		dm_put_device(ti, dmz->meta_ddev);
+		dmz->meta_ddev = NULL;
+		return -EINVAL;
 	}
 
-	return ret;
+	dmz->meta_bdev = dmz->meta_ddev->bdev;
+	pr_info("Metadata on %s.\n", path);
+
+	return 0;
 }
 
-static blk_status_t dmz_queue_rq(struct blk_mq_hw_ctx *hctx, const struct blk_mq_queue_data *bd) {
-	struct dmz_target *dmz = hctx->queue->queuedata;
-	struct request *req = bd->rq;
-	int ret = BLK_STS_OK;
+/* Open the zoned devices listed before the optional arguments, they all need 256MB zones. */
+static int dmz_get_zoned_devs(struct dm_target *ti, struct dmz_target *dmz, struct dm_arg_set *as) {
+	unsigned int val;
+	int ret;
 
-	blk_mq_start_request(req);
+	// The optional argument count is the first plain number.
+	while (as->argc && kstrtouint(as->argv[0], 10, &val)) {
+		struct dmz_zdev *zdev = &dmz->devs.dev[dmz->devs.nr];
+
+		if (dmz->devs.nr == DMZ_MAX_DEVS) {
+			ti->error = "Too many zoned devices";
+			return -EINVAL;
+		}
+
+		ret = dm_get_device(ti, dm_shift_arg(as), dm_table_get_mode(ti->table), &zdev->ddev);
+		if (ret) {
+			ti->error = "Device lookup failed";
+			return ret;
+		}
+		dmz->devs.nr++;
+
+		zdev->bdev = zdev->ddev->bdev;
+		if (!bdev_is_zoned(zdev->bdev) || blk_queue_zone_sectors(bdev_get_queue(zdev->bdev)) != (1 << (DMZ_ZONE_NR_BLOCKS_SHIFT + DMZ_BLOCK_SECTORS_SHIFT))) {
+			ti->error = "Not a zoned device with 256MB zones";
+			return -EINVAL;
+		}
+		zdev->nr_zones = blkdev_nr_zones(zdev->bdev->bd_disk);
+	}
 
-	switch (req_op(req)) {
-	/* operations with no lentgth/offset arguments */
-	case REQ_OP_FLUSH:
-		pr_err("NOT NOW FLUSH.\n");
-		break;
-	case REQ_OP_READ:
-	case REQ_OP_WRITE:
-		ret = queue_rw_rq(dmz, req);
-		break;
-	case REQ_OP_DISCARD:
-	case REQ_OP_WRITE_ZEROES:
-		ret = queue_rw_rq(dmz, req);
-		break;
-	default:
-		ret = BLK_STS_NOTSUPP;
+	if (!dmz->devs.nr) {
+		ti->error = "No zoned device";
+		return -EINVAL;
 	}
 
-	blk_mq_end_request(req, ret);
+	return 0;
+}
 
-	return ret;
+static void dmz_put_devices(struct dm_target *ti, struct dmz_target *dmz) {
+	if (dmz->meta_ddev)
+		dm_put_device(ti, dmz->meta_ddev);
+
+	for (unsigned int d = 0; d < dmz->devs.nr; d++)
+		dm_put_device(ti, dmz->devs.dev[d].ddev);
 }
 
-static const struct blk_mq_ops dmz_mq_ops = { .queue_rq = dmz_queue_rq };
+/* Parse the optional arguments, the zoned devices are already open. */
+static int dmz_parse_args(struct dm_target *ti, struct dmz_target *dmz, struct dm_arg_set *as) {
+	static const struct dm_arg _args[] = {
+		{ 0, 18, "Invalid number of optional arguments" },
+	};
+	unsigned int argc;
+	const char *name;
+	int ret;
+
+	if (!as->argc)
+		return 0;
+
+	ret = dm_read_arg_group(_args, as, &argc, &ti->error);
+	if (ret)
+		return ret;
+
+	while (argc) {
+		unsigned int val;
+
+		name = dm_shift_arg(as);
+		argc--;
+		if (!argc) {
+			ti->error = "Missing value of optional argument";
+			return -EINVAL;
+		}
+
+		const char *arg = dm_shift_arg(as);
+		argc--;
+
+		if (!strcasecmp(name, "meta_dev")) {
+			if (dmz->meta_ddev) {
+				ti->error = "Duplicate metadata device";
+				return -EINVAL;
+			}
+			ret = dmz_get_meta_dev(ti, dmz, arg);
+			if (ret)
+				return ret;
+			continue;
+		}
+
+		if (kstrtouint(arg, 10, &val)) {
+			ti->error = "Invalid optional argument value";
+			return -EINVAL;
+		}
+
+		ret = dmz_tunable_set(&dmz->tun, name, val, &ti->error);
+		if (ret != -ENOENT) {
+			if (ret)
+				return ret;
+			continue;
+		}
+
+		if (!strcasecmp(name, "cache_zones")) {
+			dmz->max_cache_zones = val;
+		} else if (!strcasecmp(name, "op_ratio")) {
+			if (val >= 100) {
+				ti->error = "op_ratio must be below 100";
+				return -EINVAL;
+			}
+			dmz->op_ratio = val;
+		} else if (!strcasecmp(name, "reserved_zones")) {
+			if (val < DMZ_DEF_RESERVED_ZONES) {
+				ti->error = "reserved_zones must be at least 2";
+				return -EINVAL;
+			}
+			dmz->nr_reserved_zones = val;
+		} else if (!strcasecmp(name, "poll")) {
+			dmz->poll = !!val;
+		} else {
+			ti->error = "Unknown optional argument";
+			return -EINVAL;
+		}
+	}
 
-int next_free_minor(void) {
 	return 0;
 }
 
-struct dmz_dev *dev_create(struct dmz_target *dmz) {
+/*
+ * Exported capacity, in sectors. Metadata and cache zones hold no user data, and of the sequential data zones
+ * the larger of reserved_zones and op_ratio percent is kept free for reclaim.
+ */
+static sector_t dmz_capacity(struct dmz_target *dmz) {
+	unsigned long nr_cache_zones = dmz_nr_cache_zones(&dmz->devs, dmz->max_cache_zones);
+	unsigned long nr_data_zones = dmz->devs.nr_zones - dmz->devs.nr_meta_zones - nr_cache_zones;
+	unsigned long nr_spare_zones = max_t(unsigned long, dmz->nr_reserved_zones, nr_data_zones * dmz->op_ratio / 100);
+
+	if (nr_data_zones <= nr_spare_zones)
+		return 0;
+
+	return ((sector_t)(nr_data_zones - nr_spare_zones) * DMZ_ZONE_NR_DATA_BLOCKS) << DMZ_BLOCK_SECTORS_SHIFT;
+}
+
+static struct dmz_dev *dmz_dev_create(struct dm_target *ti, struct dmz_target *dmz) {
+	struct block_device *bdev = dmz->target_bdev;
 	struct dmz_dev *dev = kzalloc(sizeof(struct dmz_dev), GFP_KERNEL);
-	if (!dev) {
-		goto dev;
+	if (!dev)
+		return NULL;
+
+	dev->bdev = bdev;
+	dev->nr_zones = dmz->devs.nr_zones;
+	dev->capacity = (unsigned long)dev->nr_zones << (DMZ_ZONE_NR_BLOCKS_SHIFT + DMZ_BLOCK_SECTORS_SHIFT);
+	dev->nr_zone_sectors = blk_queue_zone_sectors(bdev_get_queue(bdev));
+	bdevname(bdev, dev->name);
+	format_dev_t(dev->major_minor_id, bdev->bd_dev);
+
+	return dev;
+}
+
+/* Initilize device mapper */
+static int dmz_ctr(struct dm_target *ti, unsigned int argc, char **argv) {
+	struct dm_arg_set as = { .argc = argc, .argv = argv };
+	struct dmz_target *dmz;
+	int ret;
+
+	if (argc < 1) {
+		ti->error = "Invalid argument count";
+		return -EINVAL;
 	}
 
-	int r = 0, minor = 0;
+	dmz = kzalloc(sizeof(struct dmz_target), GFP_KERNEL);
+	if (!dmz) {
+		ti->error = "Unable to allocate the zoned target descriptor";
+		return -ENOMEM;
+	}
 
-	if (minor < 0) {
-		goto dev;
+	dmz->ti = ti;
+	dmz->max_cache_zones = UINT_MAX;
+	dmz->tun.cache_max_blocks = DMZ_CACHE_MAX_BLOCKS;
+	dmz->tun.destage_batch = DMZ_DESTAGE_BATCH;
+	dmz->tun.ckpt_pct = DMZ_JOURNAL_CKPT_PCT;
+	dmz->nr_reserved_zones = DMZ_DEF_RESERVED_ZONES;
+
+	ret = dmz_get_zoned_devs(ti, dmz, &as);
+	if (ret)
+		goto parse;
+	dmz->target_bdev = dmz->devs.dev[0].bdev;
+
+	ret = dmz_parse_args(ti, dmz, &as);
+	if (ret)
+		goto parse;
+
+	if (dmz_devs_layout(&dmz->devs, dmz->meta_bdev)) {
+		ti->error = "No room for metadata";
+		ret = -EINVAL;
+		goto parse;
 	}
 
-	struct blk_mq_tag_set *set = &dev->set;
-	set->ops = &dmz_mq_ops;
-	set->nr_hw_queues = 1;
-	set->cmd_size = 64;
-	set->flags = BLK_MQ_F_SHOULD_MERGE;
-	set->queue_depth = 64;
-	set->nr_maps = 1;
-	set->numa_node = NUMA_NO_NODE;
-
-	r = blk_mq_alloc_tag_set(set);
-	if (r) {
-		goto dev;
+	dmz->dev = dmz_dev_create(ti, dmz);
+	if (!dmz->dev) {
+		ti->error = "Unable to allocate the device descriptor";
+		ret = -ENOMEM;
+		goto parse;
 	}
 
-	dev->queue = blk_mq_init_queue_data(set, dmz);
+	ti->len = dmz_capacity(dmz);
+	if (!ti->len) {
+		ti->error = "No room left for data";
+		ret = -EINVAL;
+		goto bioset;
+	}
 
-	if (IS_ERR(dev->queue)) {
-		goto set;
+	ret = bioset_init(&dmz->bio_set, DMZ_MIN_BIOS, 0, 0);
+	if (ret) {
+		ti->error = "Create BIO set failed";
+		goto bioset;
 	}
 
-	blk_queue_max_hw_sectors(dev->queue, BLK_DEF_MAX_SECTORS);
+	// Metadata is loaded at the first resume, see dmz_preresume.
+	ti->private = dmz;
+	ti->per_io_data_size = sizeof(struct dmz_bioctx);
+	ti->num_flush_bios = 1;
+	ti->num_discard_bios = 1;
+	// No WRITE_ZEROES: discard keeps the mapping, a read after it would not return zeroes. Zeroout writes zero pages.
+	ti->flush_supported = true;
+	ti->discards_supported = true;
 
-	dev->disk = alloc_disk(1);
-	if (!dev->disk)
-		goto allocdisk;
+	pr_info("%s: %llu sectors exported.\n", dmz->dev->name, (unsigned long long)ti->len);
 
-	dev->disk->major = major;
-	dev->disk->first_minor = minor;
-	dev->disk->fops = &dmz_blk_dops;
-	dev->disk->queue = dev->queue;
-	dev->disk->private_data = dev;
-	sprintf(dev->disk->disk_name, "dm-%d", minor);
+	return 0;
 
-	// We need to reserve 2 zones. One for reclaim, one is to avoid dead lock.
-	unsigned long capacity_nr_zones = (i_size_read(dmz->target_bdev->bd_inode) >> DMZ_BLOCK_SHIFT >> DMZ_ZONE_NR_BLOCKS_SHIFT) - 2;
+bioset:
+	kfree(dmz->dev);
+parse:
+	dmz_put_devices(ti, dmz);
+	kfree(dmz);
+	return ret;
+}
 
-	set_capacity(dev->disk, capacity_nr_zones << DMZ_ZONE_NR_BLOCKS_SHIFT << DMZ_BLOCK_SECTORS_SHIFT);
+/*
+ * dm suspends a target before it destroys it, and the checkpoint was taken in dmz_postsuspend then. After a table
+ * reload the new instance may already run on the devices, so nothing is written here.
+ */
+static void dmz_dtr(struct dm_target *ti) {
+	struct dmz_target *dmz = ti->private;
 
-	add_disk(dev->disk);
-	format_dev_t(dev->major_minor_id, MKDEV(major, minor));
+	dmz_dtr_metadata(dmz->zmd);
 
-	dev->bdev = bdget_disk(dev->disk, 0);
-	bdput(dev->bdev);
+	bioset_exit(&dmz->bio_set);
 
-	dev->capacity = i_size_read(dmz->target_bdev->bd_inode) >> SECTOR_SHIFT;
-	sprintf(dev->name, "dm-%d", minor);
-	// bdevname(dev->bdev, dev->name);
+	kfree(dmz->dev);
 
-	dev->nr_zones = blkdev_nr_zones(dmz->target_bdev->bd_disk);
-	dev->nr_zone_sectors = blk_queue_zone_sectors(dmz->target_bdev->bd_disk->queue);
+	dmz_put_devices(ti, dmz);
 
-	return dev;
+	kfree(dmz);
+}
 
-allocdisk:
-	if (dev->queue) {
-		blk_cleanup_queue(dev->queue);
-		dev->queue = NULL;
-	}
+static int dmz_dm_map(struct dm_target *ti, struct bio *bio) {
+	return dmz_map(ti->private, bio);
+}
 
-	if (dev->disk)
-		put_disk(dev->disk);
+/* Let queued reclaim and destage finish while in-flight IO drains, no new IO is mapped after this. */
+static void dmz_presuspend(struct dm_target *ti) {
+	struct dmz_target *dmz = ti->private;
 
-set:
-	blk_mq_free_tag_set(set);
-dev:
-	if (dev)
-		kfree(dev);
-	return NULL;
+	if (dmz->zmd)
+		flush_workqueue(dmz->zmd->reclaim_wq);
 }
 
-void dev_destroy(struct dmz_target *dmz) {
-	struct dmz_dev *dev = dmz->dev;
-	if (!dev)
-		return;
+/*
+ * No IO is in flight any more. Finish the background work it queued and checkpoint, so that a reloaded table,
+ * whose instance loads the metadata in its preresume, starts from the current state. The debugfs directory goes
+ * too, the new instance registers the same dm name.
+ */
+static void dmz_postsuspend(struct dm_target *ti) {
+	struct dmz_target *dmz = ti->private;
+	struct dmz_metadata *zmd = dmz->zmd;
 
-	if (dev->queue)
-		blk_cleanup_queue(dev->queue);
+	if (!zmd)
+		return;
 
-	if (dev->disk)
-		put_disk(dev->disk);
+	drain_workqueue(zmd->reclaim_wq);
+	for (int i = 0; i < zmd->nr_zones; i++)
+		flush_workqueue(zmd->zone_start[i].write_wq);
+	flush_workqueue(zmd->journal.wq);
 
-	blk_mq_free_tag_set(&dev->set);
+	if (dmz_flush(dmz))
+		pr_err("Checkpoint at suspend failed.\n");
 
-	kfree(dev);
+	dmz_stats_unregister(zmd);
 }
 
-/* Initilize device mapper */
-int dmz_ctr(struct dmz_target *dmz) {
-	int ret;
+/*
+ * Load the metadata at the first resume rather than in ctr. On a table reload ctr runs while the old instance
+ * still serves IO, it is only suspended, and checkpointed, right before this.
+ */
+static int dmz_preresume(struct dm_target *ti) {
+	struct dmz_target *dmz = ti->private;
+
+	if (dmz->zmd)
+		return 0;
 
-	dmz->target_bdev = blkdev_get_by_path(DEVICE_PATH, FMODE_READ | FMODE_WRITE, "dm-zoned-haltz");
-	if (IS_ERR(dmz->target_bdev)) {
-		goto target_bdev;
+	if (dmz_ctr_metadata(dmz)) {
+		pr_err("%s: metadata initialization failed.\n", dmz->dev->name);
+		return -EIO;
 	}
 
-	dmz->dev = dev_create(dmz);
-	if (!dmz->dev) {
-		goto dev_create;
+	return 0;
+}
+
+static void dmz_resume(struct dm_target *ti) {
+	struct dmz_target *dmz = ti->private;
+
+	// Named after the disk (dm-N), what /dev/mapper/<name> links to, not the "major:minor" dm_device_name.
+	dmz_stats_register(dmz->zmd, dm_disk(dm_table_get_md(ti->table))->disk_name);
+}
+
+/*
+ * INFO: the tunables as "<name> <value>" pairs.
+ * TABLE: the table line with the tunables as they are now, so that a reload keeps what was set by message.
+ */
+static void dmz_status(struct dm_target *ti, status_type_t type, unsigned int status_flags, char *result, unsigned int maxlen) {
+	struct dmz_target *dmz = ti->private;
+	// Before the first resume only the table options exist.
+	struct dmz_tunables *t = dmz->zmd ? &dmz->zmd->tun : &dmz->tun;
+	unsigned int sz = 0;
+
+	switch (type) {
+	case STATUSTYPE_INFO:
+		for (int i = 0; i < ARRAY_SIZE(dmz_tunable_defs); i++)
+			DMEMIT("%s%s %u", i ? " " : "", dmz_tunable_defs[i].name, READ_ONCE(*dmz_tunable(t, &dmz_tunable_defs[i])));
+		break;
+
+	case STATUSTYPE_TABLE:
+		for (unsigned int d = 0; d < dmz->devs.nr; d++)
+			DMEMIT("%s ", dmz->devs.dev[d].ddev->name);
+
+		// op_ratio, reserved_zones, poll and the tunables always, meta_dev and cache_zones if set.
+		DMEMIT("%u", 2 * (3 + ARRAY_SIZE(dmz_tunable_defs) + !!dmz->meta_ddev + (dmz->max_cache_zones != UINT_MAX)));
+		if (dmz->meta_ddev)
+			DMEMIT(" meta_dev %s", dmz->meta_ddev->name);
+		if (dmz->max_cache_zones != UINT_MAX)
+			DMEMIT(" cache_zones %u", dmz->max_cache_zones);
+		DMEMIT(" op_ratio %u reserved_zones %u poll %d", dmz->op_ratio, dmz->nr_reserved_zones, dmz->poll);
+		for (int i = 0; i < ARRAY_SIZE(dmz_tunable_defs); i++)
+			DMEMIT(" %s %u", dmz_tunable_defs[i].name, READ_ONCE(*dmz_tunable(t, &dmz_tunable_defs[i])));
+		break;
 	}
+}
 
-	ret = bioset_init(&dmz->bio_set, DMZ_MIN_BIOS, 0, 0);
-	if (ret) {
-		goto bioset;
+/* "<tunable> <value>": change a policy knob of the loaded target, see the table line at the top. */
+static int dmz_message(struct dm_target *ti, unsigned int argc, char **argv, char *result, unsigned int maxlen) {
+	struct dmz_target *dmz = ti->private;
+	char *error = NULL;
+	unsigned int val;
+	int ret;
+
+	if (argc != 2 || kstrtouint(argv[1], 10, &val)) {
+		pr_err("%s: message must be <tunable> <value>.\n", dmz->dev->name);
+		return -EINVAL;
 	}
 
-	ret = dmz_ctr_metadata(dmz);
+	ret = dmz_tunable_set(dmz->zmd ? &dmz->zmd->tun : &dmz->tun, argv[0], val, &error);
+	if (ret == -ENOENT) {
+		pr_err("%s: unknown tunable %s.\n", dmz->dev->name, argv[0]);
+		return -EINVAL;
+	}
 	if (ret) {
-		goto ctr_meta;
+		pr_err("%s: %s.\n", dmz->dev->name, error);
+		return ret;
 	}
 
+	pr_debug("%s: %s set to %u.\n", dmz->dev->name, argv[0], val);
 	return 0;
-
-ctr_meta:
-	bioset_exit(&dmz->bio_set);
-bioset:
-	dev_destroy(dmz);
-dev_create:
-	blkdev_put(dmz->target_bdev, FMODE_READ | FMODE_WRITE);
-target_bdev:
-	return -1;
 }
 
-void dmz_dtr(struct dmz_target *dmz) {
-	if (!dmz) {
-		return;
-	}
-
-	dmz_dtr_metadata(dmz->zmd);
-
-	bioset_exit(&dmz->bio_set);
+static int dmz_iterate_devices(struct dm_target *ti, iterate_devices_callout_fn fn, void *data) {
+	struct dmz_target *dmz = ti->private;
+	int ret = 0;
 
-	dev_destroy(dmz);
+	for (unsigned int d = 0; d < dmz->devs.nr && !ret; d++)
+		ret = fn(ti, dmz->devs.dev[d].ddev, 0, (sector_t)dmz->devs.dev[d].nr_zones << (DMZ_ZONE_NR_BLOCKS_SHIFT + DMZ_BLOCK_SECTORS_SHIFT), data);
+	if (ret || !dmz->meta_ddev)
+		return ret;
 
-	blkdev_put(dmz->target_bdev, FMODE_READ | FMODE_WRITE);
+	return fn(ti, dmz->meta_ddev, 0, i_size_read(dmz->meta_bdev->bd_inode) >> SECTOR_SHIFT, data);
 }
 
-static int __init dmz_init(void) {
-	int r;
-
-	dmz_tgt = kzalloc(sizeof(struct dmz_target), GFP_KERNEL);
-	if (!dmz_tgt) {
-		goto dmz_alloc;
-	}
+/*
+ * Bios are mapped in whole blocks. io_opt is only a throughput hint: the allocator places blocks wherever the zone
+ * write pointer is, whatever the lba alignment, and a segment (1M) is large enough to amortize its summary.
+ * Discards only clear bitmap bits, one zone of data at a time keeps each one short.
+ * The volume is a regular device, the zoned model and zone boundaries of the devices below do not show through.
+ */
+static void dmz_io_hints(struct dm_target *ti, struct queue_limits *limits) {
+	unsigned int zone_data_sectors = DMZ_ZONE_NR_DATA_BLOCKS << DMZ_BLOCK_SECTORS_SHIFT;
+
+	limits->logical_block_size = DMZ_BLOCK_SIZE;
+	limits->physical_block_size = DMZ_BLOCK_SIZE;
+	blk_limits_io_min(limits, DMZ_BLOCK_SIZE);
+	blk_limits_io_opt(limits, DMZ_SEG_NR_BLOCKS << DMZ_BLOCK_SHIFT);
+
+	limits->discard_granularity = DMZ_BLOCK_SIZE;
+	limits->discard_alignment = 0;
+	limits->max_discard_sectors = zone_data_sectors;
+	limits->max_hw_discard_sectors = zone_data_sectors;
+	limits->max_write_zeroes_sectors = 0;
+
+	limits->zoned = BLK_ZONED_NONE;
+	limits->chunk_sectors = 0;
+}
 
-	refcount_set(&dmz_tgt->ref, 1);
+static struct target_type dmz_type = {
+	.name = "dmzoned",
+	.version = { 1, 1, 0 },
+	.module = THIS_MODULE,
+	.ctr = dmz_ctr,
+	.dtr = dmz_dtr,
+	.map = dmz_dm_map,
+	.presuspend = dmz_presuspend,
+	.postsuspend = dmz_postsuspend,
+	.preresume = dmz_preresume,
+	.resume = dmz_resume,
+	.io_hints = dmz_io_hints,
+	.status = dmz_status,
+	.message = dmz_message,
+	.iterate_devices = dmz_iterate_devices,
+};
 
-	r = dmz_ctr(dmz_tgt);
-	if (r) {
-		goto dmz_ctr;
-	}
+static int __init dmz_init(void) {
+	int ret;
 
-	r = register_blkdev(major, DEVICE_NAME);
-	if (r < 0)
-		goto dmz_register;
+	dmz_stats_module_init();
 
-	return 0;
+	ret = dm_register_target(&dmz_type);
+	if (ret)
+		dmz_stats_module_exit();
 
-dmz_register:
-	dmz_dtr(dmz_tgt);
-dmz_ctr:
-	kfree(dmz_tgt);
-dmz_alloc:
-	return r;
+	return ret;
 }
 
 static void __exit dmz_exit(void) {
-	if (dmz_tgt)
-		return;
-
-	dmz_dtr(dmz_tgt);
-
-	kfree(dmz_tgt);
-
-	unregister_blkdev(major, DEVICE_NAME);
+	dm_unregister_target(&dmz_type);
+	dmz_stats_module_exit();
 }
 
 module_init(dmz_init);
 module_exit(dmz_exit);
 
 MODULE_DESCRIPTION("DM-ZONED Device Driver.");
-MODULE_LICENSE("GPL");
\ No newline at end of file
+MODULE_LICENSE("GPL");
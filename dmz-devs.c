@@ -0,0 +1,141 @@
+#include "dmz-devs.h"
+
+/**
+ * @brief Size the zone layout across devs. Checkpoint slots and journal need room on the first device unless they
+ * live on a metadata device. Every device then gives the same number of data zones, so the interleave has no holes.
+ *
+ * @return int (0 is all ok, !0 indicates corresponding errors.)
+ */
+int dmz_devs_layout(struct dmz_devs *devs, bool meta_dev) {
+	unsigned long sum = 0, per = ULONG_MAX;
+
+	for (unsigned int d = 0; d < devs->nr; d++)
+		sum += devs->dev[d].nr_zones;
+
+	// Sized for all zones reported, the layout may use a few less, the spare metadata zones stay unused.
+	devs->nr_meta_zones = meta_dev ? 0 : dmz_nr_meta_zones(sum);
+
+	for (unsigned int d = 0; d < devs->nr; d++) {
+		unsigned long nr = devs->dev[d].nr_zones;
+
+		if (!d) {
+			if (nr <= devs->nr_meta_zones)
+				return -EINVAL;
+			nr -= devs->nr_meta_zones;
+		}
+		per = min(per, nr);
+	}
+
+	devs->nr_dev_zones = per;
+	devs->nr_zones = devs->nr_meta_zones + devs->nr * per;
+
+	return 0;
+}
+
+/* Device of global zone, and the zone index on that device. */
+unsigned int dmz_zone_dev(struct dmz_devs *devs, unsigned long zone, unsigned long *dev_zone) {
+	unsigned int d;
+
+	if (zone < devs->nr_meta_zones) {
+		*dev_zone = zone;
+		return 0;
+	}
+
+	zone -= devs->nr_meta_zones;
+	d = zone % devs->nr;
+	*dev_zone = zone / devs->nr + (d ? 0 : devs->nr_meta_zones);
+
+	return d;
+}
+
+/* Global zone of zone dev_zone on device d, -1 if the layout leaves it unused. */
+long dmz_dev_zone(struct dmz_devs *devs, unsigned int d, unsigned long dev_zone) {
+	if (!d && dev_zone < devs->nr_meta_zones)
+		return dev_zone;
+
+	if (!d)
+		dev_zone -= devs->nr_meta_zones;
+	if (dev_zone >= devs->nr_dev_zones)
+		return -1;
+
+	return devs->nr_meta_zones + dev_zone * devs->nr + d;
+}
+
+/* Device holding zone, sector gets the start of the zone on it. */
+struct block_device *dmz_zone_bdev(struct dmz_metadata *zmd, unsigned long zone, sector_t *sector) {
+	unsigned long dev_zone;
+	unsigned int d = dmz_zone_dev(zmd->devs, zone, &dev_zone);
+
+	*sector = (sector_t)dev_zone << (DMZ_ZONE_NR_BLOCKS_SHIFT + DMZ_BLOCK_SECTORS_SHIFT);
+	return zmd->devs->dev[d].bdev;
+}
+
+/* Point bio at pba, on whichever device holds its zone. The bio must not cross a zone boundary. */
+void dmz_bio_set_pba(struct dmz_metadata *zmd, struct bio *bio, unsigned long pba) {
+	sector_t sector;
+
+	bio_set_dev(bio, dmz_zone_bdev(zmd, pba >> DMZ_ZONE_NR_BLOCKS_SHIFT, &sector));
+	bio->bi_iter.bi_sector = sector + dmz_blk2sect(pba & DMZ_ZONE_NR_BLOCKS_MASK);
+}
+
+bool dmz_same_dev(struct dmz_metadata *zmd, unsigned long a, unsigned long b) {
+	unsigned long dev_zone;
+
+	return dmz_zone_dev(zmd->devs, a, &dev_zone) == dmz_zone_dev(zmd->devs, b, &dev_zone);
+}
+
+struct dmz_report_ctx {
+	struct dmz_devs *devs;
+	unsigned int d;
+	unsigned int nr;
+	report_zones_cb cb;
+	void *data;
+};
+
+static int dmz_devs_report_cb(struct blk_zone *blkz, unsigned int num, void *data) {
+	struct dmz_report_ctx *ctx = data;
+	long zone = dmz_dev_zone(ctx->devs, ctx->d, num);
+
+	if (zone < 0)
+		return 0;
+
+	ctx->nr++;
+	return ctx->cb(blkz, zone, ctx->data);
+}
+
+/**
+ * @brief Report zones of every device, cb gets global zone indexes. Zones the layout leaves unused are skipped.
+ *
+ * @return int number of zones reported, or a negative error.
+ */
+int dmz_devs_report_zones(struct dmz_metadata *zmd, report_zones_cb cb, void *data) {
+	struct dmz_report_ctx ctx = { .devs = zmd->devs, .cb = cb, .data = data };
+
+	for (ctx.d = 0; ctx.d < zmd->devs->nr; ctx.d++) {
+		int ret = blkdev_report_zones(zmd->devs->dev[ctx.d].bdev, 0, BLK_ALL_ZONES, dmz_devs_report_cb, &ctx);
+		if (ret < 0)
+			return ret;
+	}
+
+	return ctx.nr;
+}
+
+/**
+ * @brief Flush the volatile cache of every zoned device not flushed as the metadata device.
+ *
+ * @return int (0 is all ok, !0 indicates corresponding errors.)
+ */
+int dmz_devs_flush(struct dmz_metadata *zmd) {
+	int ret = 0;
+
+	for (unsigned int d = 0; d < zmd->devs->nr; d++) {
+		if (zmd->devs->dev[d].bdev == zmd->meta_bdev)
+			continue;
+
+		int err = blkdev_issue_flush(zmd->devs->dev[d].bdev, GFP_NOIO);
+		if (err)
+			ret = err;
+	}
+
+	return ret;
+}
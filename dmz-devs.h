@@ -0,0 +1,17 @@
+#ifndef _DMZ_DEVS_H_
+#define _DMZ_DEVS_H_
+
+#include "dmz.h"
+
+int dmz_devs_layout(struct dmz_devs *devs, bool meta_dev);
+unsigned int dmz_zone_dev(struct dmz_devs *devs, unsigned long zone, unsigned long *dev_zone);
+long dmz_dev_zone(struct dmz_devs *devs, unsigned int d, unsigned long dev_zone);
+
+struct block_device *dmz_zone_bdev(struct dmz_metadata *zmd, unsigned long zone, sector_t *sector);
+void dmz_bio_set_pba(struct dmz_metadata *zmd, struct bio *bio, unsigned long pba);
+bool dmz_same_dev(struct dmz_metadata *zmd, unsigned long a, unsigned long b);
+
+int dmz_devs_report_zones(struct dmz_metadata *zmd, report_zones_cb cb, void *data);
+int dmz_devs_flush(struct dmz_metadata *zmd);
+
+#endif
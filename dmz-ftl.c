@@ -0,0 +1,180 @@
+#include "dmz.h"
+
+/*
+ * FTL core: mapping, validity bitmap, write zone selection and reclaim victim checks. Only plain memory is touched
+ * here, no bio, lock or workqueue, so this file also builds in userspace against sim/dmz-compat.h.
+ */
+
+unsigned long dmz_get_map(struct dmz_metadata *zmd, unsigned long lba) {
+	unsigned long index = lba >> DMZ_ZONE_NR_BLOCKS_SHIFT;
+	unsigned long offset = lba & DMZ_ZONE_NR_BLOCKS_MASK;
+
+	struct dmz_zone *cur_zone = zmd->zone_start + index;
+
+	return cur_zone->mt[offset].block_id;
+}
+
+/**
+ * @brief Point lba at pba, invalidating the old pba if any. Not logged, see dmz_update_map.
+ * 
+ * @return{unsigned long} old pba of lba.
+ */
+unsigned long dmz_set_map(struct dmz_metadata *zmd, unsigned long lba, unsigned long pba) {
+	struct dmz_zone *z = zmd->zone_start;
+	int index = lba >> DMZ_ZONE_NR_BLOCKS_SHIFT;
+	int offset = lba & DMZ_ZONE_NR_BLOCKS_MASK;
+
+	struct dmz_zone *cur_zone = &zmd->zone_start[index];
+	unsigned long old_pba = cur_zone->mt[offset].block_id;
+	if (old_pba == pba)
+		return old_pba;
+	dmz_map_change_begin(zmd);
+	cur_zone->mt[offset].block_id = pba;
+	dmz_dirty_mt(zmd, lba);
+
+	int p_index = pba >> DMZ_ZONE_NR_BLOCKS_SHIFT;
+	int p_offset = pba & DMZ_ZONE_NR_BLOCKS_MASK;
+	struct dmz_zone *p_zone = &zmd->zone_start[p_index];
+	p_zone->reverse_mt[p_offset].block_id = lba;
+	dmz_dirty_rmt(zmd, pba);
+
+	if (!dmz_is_default_pba(old_pba)) {
+		int old_p_index = old_pba >> DMZ_ZONE_NR_BLOCKS_SHIFT;
+		int old_p_offset = old_pba & DMZ_ZONE_NR_BLOCKS_MASK;
+		struct dmz_zone *old_p_zone = &zmd->zone_start[old_p_index];
+		old_p_zone->reverse_mt[old_p_offset].block_id = ~0;
+		dmz_dirty_rmt(zmd, old_pba);
+	}
+
+	// update bitmap
+
+	if (!dmz_is_default_pba(old_pba)) {
+		dmz_clear_bit(zmd, old_pba);
+
+		int old_p_index = old_pba >> DMZ_ZONE_NR_BLOCKS_SHIFT;
+		z[old_p_index].weight--;
+	}
+
+	dmz_set_bit(zmd, pba);
+	z[p_index].weight++;
+	dmz_map_change_end(zmd);
+
+	return old_pba;
+}
+
+/**
+ * @brief When GC has been started, valid blocks should be move to another zone. I need to update mapping, therefore ph
+ * 
+ * @param{unsigned long} pba 
+ * @return{unsigned long} unsigned long 
+ */
+unsigned long dmz_p2l(struct dmz_metadata *zmd, unsigned long pba) {
+	int index = pba >> DMZ_ZONE_NR_BLOCKS_SHIFT;
+	int offset = pba & DMZ_ZONE_NR_BLOCKS_MASK;
+
+	struct dmz_zone *zone = &zmd->zone_start[index];
+	return (unsigned long)zone->reverse_mt[offset].block_id;
+}
+
+int dmz_next_tgt_zone(struct dmz_metadata *zmd) {
+	unsigned int nr = (unsigned int)zmd->nr_zones;
+	zmd->tgt_zone++;
+	zmd->tgt_zone %= nr;
+	if (zmd->tgt_zone == zmd->reserved_zone)
+		zmd->tgt_zone++;
+	zmd->tgt_zone %= nr;
+	return zmd->tgt_zone;
+}
+
+/* Whether sequential writes may be allocated in zone idx. */
+bool dmz_zone_writable(struct dmz_metadata *zmd, int idx) {
+	struct dmz_zone *zone = &zmd->zone_start[idx];
+
+	return idx >= zmd->nr_meta_zones && zone->wp != zmd->zone_nr_blocks && idx != zmd->reserved_zone && !DMZ_IS_CACHE(zone) && !dmz_is_resetting(zmd, idx);
+}
+
+/* Whether reclaiming zone idx frees anything: it holds invalid blocks and is neither metadata nor the reserved zone. */
+bool dmz_reclaim_needed(struct dmz_metadata *zmd, int idx) {
+	struct dmz_zone *zone = &zmd->zone_start[idx];
+
+	if (idx == zmd->reserved_zone || idx < zmd->nr_meta_zones)
+		return false;
+
+	// Cache zones are not compacted in place, destage empties them.
+	if (DMZ_IS_CACHE(zone))
+		return zone->weight;
+
+	return zone->weight != dmz_wp_nr_data(zone->wp);
+}
+
+/* Whether zone idx, just filled, is worth reclaiming right away: at least reclaim_invalid_pct of its data is invalid. */
+bool dmz_reclaim_eager(struct dmz_metadata *zmd, int idx) {
+	unsigned long nr_data = dmz_wp_nr_data(zmd->zone_start[idx].wp);
+
+	return (nr_data - zmd->zone_start[idx].weight) * 100 >= nr_data * READ_ONCE(zmd->tun.reclaim_invalid_pct);
+}
+
+/* Reserved zone must hold no valid block, pick the first empty zone if it does. */
+void dmz_reclaim_pick_reserved(struct dmz_metadata *zmd) {
+	struct dmz_zone *zone = zmd->zone_start;
+
+	if (!zone[zmd->reserved_zone].weight)
+		return;
+
+	for (int i = zmd->nr_meta_zones; i < zmd->nr_zones; i++) {
+		if (!zone[i].weight && !DMZ_IS_CACHE(&zone[i])) {
+			zmd->reserved_zone = i;
+			return;
+		}
+	}
+}
+
+bool dmz_is_resetting(struct dmz_metadata *zmd, int idx) {
+	struct dmz_zone *zone = zmd->zone_start;
+
+	return test_bit(DMZ_ZONE_RESETTING, &zone[idx].flags);
+}
+
+bool dmz_is_full(struct dmz_metadata *zmd) {
+	struct dmz_zone *zone = zmd->zone_start;
+	bool full = true;
+	for (int i = zmd->nr_meta_zones; i < zmd->nr_zones; i++) {
+		// Cache zones are emptied by destage, only sequential zones count.
+		if (!DMZ_IS_CACHE(&zone[i]) && DMZ_ZONE_NR_DATA_BLOCKS != zone[i].weight) {
+			full = false;
+		}
+	}
+
+	return full;
+}
+
+void dmz_set_bit(struct dmz_metadata *zmd, unsigned long pos) {
+	unsigned long bitmap = (unsigned long)zmd->bitmap_start;
+	unsigned long index = pos >> 3, offset = pos & ((0x1 << 3) - 1); // a byte can contain 8 bit (8 blocks's validity)
+	bitmap += index;
+	char v = *((char *)bitmap);
+	v = v | (0x1 << offset);
+	*((char *)bitmap) = v;
+
+	dmz_dirty_bitmap(zmd, pos);
+}
+
+void dmz_clear_bit(struct dmz_metadata *zmd, unsigned long pos) {
+	unsigned long bitmap = (unsigned long)zmd->bitmap_start;
+	unsigned long index = pos >> 3, offset = pos & ((0x1 << 3) - 1); // a byte can contain 8 bit (8 blocks's validity)
+	bitmap += index;
+	char v = *((char *)bitmap);
+	v = v & (~(0x1 << offset));
+	*((char *)bitmap) = v;
+
+	dmz_dirty_bitmap(zmd, pos);
+}
+
+bool dmz_test_bit(struct dmz_metadata *zmd, unsigned long pos) {
+	unsigned long bitmap = (unsigned long)zmd->bitmap_start;
+	unsigned long index = pos >> 3, offset = pos & ((0x1 << 3) - 1); // a byte can contain 8 bit (8 blocks's validity)
+	bitmap += index;
+	char v = *((char *)bitmap);
+	v = v & (0x1 << offset);
+	return !!v;
+}
@@ -0,0 +1,46 @@
+#ifndef _DMZ_FTL_H_
+#define _DMZ_FTL_H_
+
+#include "dmz.h"
+
+unsigned long dmz_get_map(struct dmz_metadata *zmd, unsigned long lba);
+unsigned long dmz_set_map(struct dmz_metadata *zmd, unsigned long lba, unsigned long pba);
+unsigned long dmz_p2l(struct dmz_metadata *zmd, unsigned long pba);
+
+int dmz_next_tgt_zone(struct dmz_metadata *zmd);
+bool dmz_zone_writable(struct dmz_metadata *zmd, int zone);
+bool dmz_reclaim_needed(struct dmz_metadata *zmd, int zone);
+bool dmz_reclaim_eager(struct dmz_metadata *zmd, int zone);
+void dmz_reclaim_pick_reserved(struct dmz_metadata *zmd);
+
+bool dmz_is_resetting(struct dmz_metadata *zmd, int zone);
+bool dmz_is_full(struct dmz_metadata *zmd);
+
+void dmz_set_bit(struct dmz_metadata *zmd, unsigned long pos);
+void dmz_clear_bit(struct dmz_metadata *zmd, unsigned long pos);
+bool dmz_test_bit(struct dmz_metadata *zmd, unsigned long pos);
+
+/*
+ * Every change of the mapping, the validity bitmap or a zone write pointer sits between these two, so that a
+ * reader without locks (the map dump) can tell whether one happened or was under way meanwhile.
+ */
+static inline void dmz_map_change_begin(struct dmz_metadata *zmd) {
+	atomic64_inc(&zmd->map_gen_begin);
+	smp_mb__after_atomic();
+}
+
+static inline void dmz_map_change_end(struct dmz_metadata *zmd) {
+	smp_mb__before_atomic();
+	atomic64_inc(&zmd->map_gen_end);
+}
+
+/* Like a seqcount: odd while a change is under way, two equal even values mean nothing changed in between. */
+static inline u64 dmz_map_gen(struct dmz_metadata *zmd) {
+	u64 end = atomic64_read(&zmd->map_gen_end);
+
+	smp_rmb();
+	u64 begin = atomic64_read(&zmd->map_gen_begin);
+	return begin == end ? begin << 1 : (end << 1) | 1;
+}
+
+#endif
@@ -0,0 +1,414 @@
+#include "dmz-journal.h"
+#include "dmz-trace.h"
+#include <linux/crc32.h>
+
+static u32 dmz_journal_crc(struct dmz_journal_block *blk) {
+	u32 saved = blk->crc, crc;
+
+	blk->crc = 0;
+	crc = crc32_le(~0, (unsigned char *)blk, DMZ_BLOCK_SIZE);
+	blk->crc = saved;
+
+	return crc;
+}
+
+static inline struct dmz_journal_block *dmz_journal_blk(struct dmz_journal *j, unsigned long pos) {
+	return &j->blocks[pos % DMZ_JOURNAL_NR_BUFS];
+}
+
+/*
+ * Close the block being filled and move head to a fresh one. Fails if the ring is full,
+ * i.e. the journal work did not keep up. Caller holds j->lock.
+ */
+static bool dmz_journal_seal(struct dmz_journal *j) {
+	struct dmz_journal_block *blk = dmz_journal_blk(j, j->head);
+
+	if (j->head + 1 - j->tail >= DMZ_JOURNAL_NR_BUFS)
+		return false;
+
+	blk->magic = DMZ_JOURNAL_MAGIC;
+	blk->gen = j->gen;
+	blk->seq = j->seq++;
+	blk->crc = dmz_journal_crc(blk);
+
+	j->head++;
+	memset(dmz_journal_blk(j, j->head), 0, DMZ_BLOCK_SIZE);
+
+	return true;
+}
+
+/* Caller holds j->lock. */
+static void dmz_journal_add(struct dmz_journal *j, unsigned long lba, unsigned long old_pba, unsigned long new_pba) {
+	struct dmz_journal_block *blk = dmz_journal_blk(j, j->head);
+	struct dmz_journal_entry *e;
+
+	// Dropped entries are only persisted by the checkpoint, which is already queued.
+	if (j->overflow)
+		return;
+
+	e = &blk->entries[blk->nr_entries++];
+	e->lba = lba;
+	e->old_pba = old_pba;
+	e->new_pba = new_pba;
+
+	if (blk->nr_entries < DMZ_JOURNAL_NR_ENTRIES)
+		return;
+
+	if (dmz_journal_seal(j)) {
+		queue_work(j->wq, &j->write_work);
+	} else {
+		j->overflow = true;
+		queue_work(j->wq, &j->ckpt_work);
+	}
+}
+
+/**
+ * @brief Update mapping of lba and log the change. Mapping and journal are updated under the same lock,
+ * so journal order is mapping order and replay can never resurrect a stale mapping. Safe in endio context.
+ *
+ * @return{unsigned long} previous pba of lba.
+ */
+unsigned long dmz_journal_update_map(struct dmz_metadata *zmd, unsigned long lba, unsigned long pba) {
+	struct dmz_journal *j = &zmd->journal;
+	unsigned long flags, old_pba;
+
+	spin_lock_irqsave(&j->lock, flags);
+	old_pba = dmz_set_map(zmd, lba, pba);
+	dmz_journal_add(j, lba, old_pba, pba);
+	spin_unlock_irqrestore(&j->lock, flags);
+
+	return old_pba;
+}
+
+/**
+ * @brief Append sealed blocks to the journal zone. With sync, the block being filled is sealed too and
+ * written with FUA. PREFLUSH orders the journal after the data writes its entries describe.
+ * Caller holds j->write_lock.
+ *
+ * @return int (0 is all ok, -ENOSPC if only a checkpoint can persist the mappings now.)
+ */
+static int dmz_journal_write(struct dmz_journal *j, bool sync) {
+	struct dmz_metadata *zmd = container_of(j, struct dmz_metadata, journal);
+	struct dmz_meta_batch batch;
+	unsigned long flags, tail, nr;
+	int ret = 0;
+
+	spin_lock_irqsave(&j->lock, flags);
+	if (sync && dmz_journal_blk(j, j->head)->nr_entries && !j->overflow && !dmz_journal_seal(j))
+		j->overflow = true;
+	tail = j->tail;
+	nr = j->head - j->tail;
+	if (j->overflow)
+		ret = -ENOSPC;
+	spin_unlock_irqrestore(&j->lock, flags);
+
+	if (ret)
+		return ret;
+
+	if (!nr) {
+		// Nothing new to log, but logged blocks or in-place cache overwrites may still sit in a device cache.
+		if (sync && (atomic_xchg(&j->nr_inplace, 0) || j->unflushed)) {
+			ret = dmz_flush_data_dev(zmd);
+			if (!ret)
+				ret = blkdev_issue_flush(zmd->meta_bdev, GFP_NOIO);
+			j->unflushed = !!ret;
+		}
+		return ret;
+	}
+
+	if (j->wp + nr > zmd->zone_nr_blocks)
+		return -ENOSPC;
+
+	unsigned long pba = ((unsigned long)j->zone << DMZ_ZONE_NR_BLOCKS_SHIFT) + j->wp;
+	unsigned int op_flags = REQ_PREFLUSH | (sync ? REQ_FUA : 0);
+
+	// PREFLUSH below covers every in-place overwrite completed so far.
+	atomic_set(&j->nr_inplace, 0);
+	ret = dmz_flush_data_dev(zmd);
+	if (ret) {
+		pr_err("Data device flush failed.\n");
+		return ret;
+	}
+
+	dmz_meta_batch_init(zmd, &batch);
+	for (unsigned long done = 0; done < nr;) {
+		unsigned long idx = (tail + done) % DMZ_JOURNAL_NR_BUFS;
+		unsigned long cnt = min(nr - done, DMZ_JOURNAL_NR_BUFS - idx);
+
+		dmz_meta_batch_submit(zmd, &batch, REQ_OP_WRITE, op_flags, pba + done, &j->blocks[idx], cnt);
+		done += cnt;
+	}
+	ret = dmz_meta_batch_wait(&batch);
+	if (ret) {
+		// Journal zone wp is unknown now, stop appending until the next checkpoint resets it.
+		pr_err("Journal write failed.\n");
+		spin_lock_irqsave(&j->lock, flags);
+		j->overflow = true;
+		spin_unlock_irqrestore(&j->lock, flags);
+		return -ENOSPC;
+	}
+
+	j->wp += nr;
+	j->unflushed = !sync;
+
+	spin_lock_irqsave(&j->lock, flags);
+	j->tail += nr;
+	spin_unlock_irqrestore(&j->lock, flags);
+
+	// Checkpoint well before the journal zone fills up, replay time stays bounded too.
+	if (j->wp * 100 > (unsigned long)zmd->zone_nr_blocks * READ_ONCE(zmd->tun.ckpt_pct))
+		queue_work(j->wq, &j->ckpt_work);
+
+	return 0;
+}
+
+static void dmz_journal_write_work(struct work_struct *work) {
+	struct dmz_journal *j = container_of(work, struct dmz_journal, write_work);
+	struct dmz_metadata *zmd = container_of(j, struct dmz_metadata, journal);
+
+	dmz_lock_journal(zmd);
+	if (dmz_journal_write(j, false))
+		queue_work(j->wq, &j->ckpt_work);
+	dmz_unlock_journal(zmd);
+}
+
+static void dmz_journal_ckpt_work(struct work_struct *work) {
+	struct dmz_journal *j = container_of(work, struct dmz_journal, ckpt_work);
+
+	if (dmz_flush(j->dmz))
+		pr_err("Journal checkpoint failed.\n");
+}
+
+/**
+ * @brief Make every mapping logged so far durable.
+ *
+ * @return int (0 is all ok, -ENOSPC if a checkpoint is needed instead.)
+ */
+int dmz_journal_sync(struct dmz_metadata *zmd) {
+	struct dmz_journal *j = &zmd->journal;
+	int ret;
+
+	dmz_lock_journal(zmd);
+	ret = dmz_journal_write(j, true);
+	dmz_unlock_journal(zmd);
+
+	return ret;
+}
+
+/**
+ * @brief Handle a FLUSH: usually a single journal append, a full checkpoint if the journal can't take it.
+ *
+ * @return int (0 is all ok, !0 indicates corresponding errors.)
+ */
+int dmz_journal_flush(struct dmz_target *dmz) {
+	int ret = dmz_journal_sync(dmz->zmd);
+
+	if (ret)
+		ret = dmz_flush(dmz);
+
+	return ret;
+}
+
+static void dmz_journal_flush_work(struct work_struct *work) {
+	struct dmz_journal *j = container_of(work, struct dmz_journal, flush_work);
+	struct dmz_bioctx *bioctx, *next;
+	unsigned long flags;
+	LIST_HEAD(bios);
+
+	// Everything deferred up to now rides on this commit, later arrivals wait for the next one.
+	spin_lock_irqsave(&j->lock, flags);
+	list_splice_init(&j->flush_bios, &bios);
+	spin_unlock_irqrestore(&j->lock, flags);
+
+	if (list_empty(&bios))
+		return;
+
+	u64 start = ktime_get_ns();
+	int ret = dmz_journal_flush(j->dmz), nr = 0;
+	blk_status_t status = ret ? BLK_STS_IOERR : BLK_STS_OK;
+
+	list_for_each_entry_safe (bioctx, next, &bios, flush_entry) {
+		list_del_init(&bioctx->flush_entry);
+		dmz_bioctx_endio(bioctx, status);
+		nr++;
+	}
+
+	trace_dmz_group_commit(nr, ret, ktime_get_ns() - start);
+}
+
+/**
+ * @brief Complete bio after the next journal commit: a FLUSH, or a FUA write whose data is done.
+ * Concurrent callers share a single commit and device cache flush. Safe in endio context.
+ */
+void dmz_journal_defer_bio(struct dmz_metadata *zmd, struct bio *bio) {
+	struct dmz_journal *j = &zmd->journal;
+	struct dmz_bioctx *bioctx = dm_per_bio_data(bio, sizeof(struct dmz_bioctx));
+	unsigned long flags;
+
+	spin_lock_irqsave(&j->lock, flags);
+	list_add_tail(&bioctx->flush_entry, &j->flush_bios);
+	spin_unlock_irqrestore(&j->lock, flags);
+
+	queue_work(j->wq, &j->flush_work);
+}
+
+/**
+ * @brief Same as dmz_journal_flush, for callers that already stopped IO.
+ *
+ * @return int (0 is all ok, !0 indicates corresponding errors.)
+ */
+int dmz_journal_commit(struct dmz_target *dmz) {
+	struct dmz_journal *j = &dmz->zmd->journal;
+	int ret;
+
+	dmz_lock_journal(dmz->zmd);
+	ret = dmz_journal_write(j, true);
+	if (ret)
+		ret = dmz_flush_do(dmz);
+	dmz_unlock_journal(dmz->zmd);
+
+	return ret;
+}
+
+/**
+ * @brief Empty the journal after checkpoint gen committed. Caller holds j->write_lock or IO has not started yet.
+ *
+ * @return int (0 is all ok, !0 indicates corresponding errors.)
+ */
+int dmz_journal_reset(struct dmz_metadata *zmd, unsigned long gen) {
+	struct dmz_journal *j = &zmd->journal;
+	unsigned long flags;
+	int ret;
+
+	// Old entries on a metadata device are overwritten in place, replay rejects them by generation.
+	ret = DMZ_HAS_META_DEV(zmd) ? 0 : dmz_reset_zone(zmd, j->zone);
+
+	spin_lock_irqsave(&j->lock, flags);
+	j->gen = gen;
+	j->seq = 0;
+	j->head = 0;
+	j->tail = 0;
+	memset(dmz_journal_blk(j, 0), 0, DMZ_BLOCK_SIZE);
+	// A journal zone that failed to reset can't be appended, flushes fall back to checkpoints.
+	j->overflow = !!ret;
+	spin_unlock_irqrestore(&j->lock, flags);
+
+	j->wp = 0;
+
+	return ret;
+}
+
+static bool dmz_journal_blk_valid(struct dmz_metadata *zmd, struct dmz_journal_block *blk, unsigned long seq) {
+	if (blk->magic != DMZ_JOURNAL_MAGIC || blk->gen != zmd->ckpt_gen || blk->seq != seq)
+		return false;
+
+	if (blk->nr_entries > DMZ_JOURNAL_NR_ENTRIES || blk->crc != dmz_journal_crc(blk))
+		return false;
+
+	return true;
+}
+
+static void dmz_journal_apply(struct dmz_metadata *zmd, struct dmz_journal_block *blk) {
+	struct dmz_zone *zone = zmd->zone_start;
+
+	for (int i = 0; i < blk->nr_entries; i++) {
+		struct dmz_journal_entry *e = &blk->entries[i];
+		unsigned long p_index = e->new_pba >> DMZ_ZONE_NR_BLOCKS_SHIFT;
+		unsigned long p_offset = e->new_pba & DMZ_ZONE_NR_BLOCKS_MASK;
+
+		if (e->lba >= zmd->nr_blocks || p_index >= zmd->nr_zones) {
+			pr_err("Journal entry out of range, lba 0x%llx pba 0x%llx.\n", e->lba, e->new_pba);
+			continue;
+		}
+
+		dmz_set_map(zmd, e->lba, e->new_pba);
+		if (zone[p_index].wp < p_offset + 1)
+			zone[p_index].wp = p_offset + 1;
+		// The segment was completed, its summary follows the data.
+		if (!dmz_wp_seg_left(zone[p_index].wp))
+			zone[p_index].wp++;
+	}
+}
+
+/**
+ * @brief Apply the journal tail on top of the loaded checkpoint. Replay stops at the first block that is torn,
+ * out of sequence or left over from an older checkpoint.
+ *
+ * @return int (number of blocks replayed, <0 on read errors.)
+ */
+int dmz_journal_replay(struct dmz_metadata *zmd) {
+	struct dmz_journal *j = &zmd->journal;
+	unsigned long base = (unsigned long)j->zone << DMZ_ZONE_NR_BLOCKS_SHIFT;
+	unsigned long nr = 0;
+
+	for (unsigned long loc = 0; loc < zmd->zone_nr_blocks; loc += MAX_NR_BLOCKS_ONCE_READ) {
+		struct dmz_journal_block *blks = (struct dmz_journal_block *)dmz_read_mblk(zmd, base + loc, MAX_NR_BLOCKS_ONCE_READ);
+		if (!blks) {
+			pr_err("Journal read failed.\n");
+			return -EIO;
+		}
+
+		for (int i = 0; i < MAX_NR_BLOCKS_ONCE_READ; i++) {
+			if (!dmz_journal_blk_valid(zmd, &blks[i], nr)) {
+				kfree(blks);
+				goto done;
+			}
+
+			dmz_journal_apply(zmd, &blks[i]);
+			nr++;
+		}
+		kfree(blks);
+	}
+
+done:
+	j->wp = nr;
+	j->seq = nr;
+
+	// Reclaim may have moved blocks into the reserved zone after the checkpoint, pick an empty one instead.
+	dmz_reclaim_pick_reserved(zmd);
+
+	pr_info("Journal replayed %lu blocks.\n", nr);
+
+	return nr;
+}
+
+int dmz_journal_init(struct dmz_target *dmz, struct dmz_metadata *zmd) {
+	struct dmz_journal *j = &zmd->journal;
+
+	j->dmz = dmz;
+	j->zone = DMZ_NR_CKPT_SLOTS * zmd->nr_slot_zones;
+	j->gen = zmd->ckpt_gen;
+
+	spin_lock_init(&j->lock);
+	mutex_init(&j->write_lock);
+	INIT_WORK(&j->write_work, dmz_journal_write_work);
+	INIT_WORK(&j->ckpt_work, dmz_journal_ckpt_work);
+	INIT_WORK(&j->flush_work, dmz_journal_flush_work);
+	INIT_LIST_HEAD(&j->flush_bios);
+	atomic_set(&j->nr_inplace, 0);
+
+	j->blocks = kvzalloc(DMZ_JOURNAL_NR_BUFS * DMZ_BLOCK_SIZE, GFP_KERNEL);
+	if (!j->blocks)
+		goto blocks;
+
+	j->wq = alloc_ordered_workqueue("dmz-journal-wq", WQ_MEM_RECLAIM);
+	if (!j->wq)
+		goto wq;
+
+	return 0;
+
+wq:
+	kvfree(j->blocks);
+	j->blocks = NULL;
+blocks:
+	return -ENOMEM;
+}
+
+void dmz_journal_exit(struct dmz_metadata *zmd) {
+	struct dmz_journal *j = &zmd->journal;
+
+	if (j->wq)
+		destroy_workqueue(j->wq);
+
+	kvfree(j->blocks);
+}
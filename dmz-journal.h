@@ -0,0 +1,20 @@
+#ifndef _DMZ_JOURNAL_H_
+#define _DMZ_JOURNAL_H_
+
+#include "dmz.h"
+
+#define DMZ_JOURNAL_MAGIC ((__u64)0x4c4a5a44)
+
+int dmz_journal_init(struct dmz_target *dmz, struct dmz_metadata *zmd);
+void dmz_journal_exit(struct dmz_metadata *zmd);
+
+unsigned long dmz_journal_update_map(struct dmz_metadata *zmd, unsigned long lba, unsigned long pba);
+
+int dmz_journal_sync(struct dmz_metadata *zmd);
+int dmz_journal_flush(struct dmz_target *dmz);
+void dmz_journal_defer_bio(struct dmz_metadata *zmd, struct bio *bio);
+int dmz_journal_commit(struct dmz_target *dmz);
+int dmz_journal_reset(struct dmz_metadata *zmd, unsigned long gen);
+int dmz_journal_replay(struct dmz_metadata *zmd);
+
+#endif
@@ -1,4 +1,5 @@
 #include "dmz-metadata.h"
+#include <linux/crc32.h>
 
 /*
  * Metadata block state flags.
@@ -20,7 +21,7 @@ unsigned long *dmz_read_mblk(struct dmz_metadata *zmd, unsigned long pba, int nu
 	for (int i = 0; i < num; i++) {
 		bio_add_page(bio, virt_to_page(buffer + (i << 9)), DMZ_BLOCK_SIZE, 0);
 	}
-	bio_set_dev(bio, zmd->target_bdev);
+	bio_set_dev(bio, zmd->meta_bdev);
 	bio_set_op_attrs(bio, REQ_OP_READ, 0);
 	bio->bi_iter.bi_sector = pba << 3;
 	submit_bio_wait(bio);
@@ -42,7 +43,178 @@ struct dmz_map *dmz_load_map(struct dmz_metadata *zmd) {
 	return NULL;
 }
 
-static int dmz_init_zones_type(struct blk_zone *blkz, unsigned int num, void *data) {
+/**
+ * @brief Checkpoint slot layout: zone descriptors, mapping tables, reverse mapping tables and bitmap of all zones,
+ * back to back. The superblock follows them.
+ * 
+ * @param{struct dmz_super*} super, if not NULL, gets the offsets of each part.
+ * @return{unsigned long} number of blocks before the superblock.
+ */
+unsigned long dmz_ckpt_layout(unsigned long nr_zones, struct dmz_super *super) {
+	unsigned long zones_info = 0;
+	unsigned long mt_info = zones_info + DIV_ROUND_UP(nr_zones * sizeof(struct dmz_zone_desc), DMZ_BLOCK_SIZE);
+	unsigned long rmt_info = mt_info + nr_zones * DMZ_ZONE_MT_BLOCKS;
+	unsigned long bitmap_info = rmt_info + nr_zones * DMZ_ZONE_MT_BLOCKS;
+
+	if (super) {
+		super->zones_info = zones_info;
+		super->mt_info = mt_info;
+		super->rmt_info = rmt_info;
+		super->bitmap_info = bitmap_info;
+	}
+
+	return bitmap_info + nr_zones * DMZ_ZONE_BITMAP_BLOCKS;
+}
+
+/* Zones taken by one checkpoint slot, including its superblock. */
+unsigned long dmz_nr_slot_zones(unsigned long nr_zones) {
+	unsigned long slot_blocks = dmz_ckpt_layout(nr_zones, NULL) + 1;
+
+	return DIV_ROUND_UP(slot_blocks, 1 << DMZ_ZONE_NR_BLOCKS_SHIFT);
+}
+
+/* Zones at the start of the device reserved for checkpoint slots and the journal. */
+unsigned long dmz_nr_meta_zones(unsigned long nr_zones) {
+	return dmz_nr_slot_zones(nr_zones) * DMZ_NR_CKPT_SLOTS + DMZ_NR_JOURNAL_ZONES;
+}
+
+u32 dmz_super_crc(struct dmz_super *super) {
+	u32 saved = super->crc, crc;
+
+	super->crc = 0;
+	crc = crc32_le(~0, (unsigned char *)super, sizeof(struct dmz_super));
+	super->crc = saved;
+
+	return crc;
+}
+
+u32 dmz_delta_crc(struct dmz_delta *delta) {
+	u32 saved = delta->crc, crc;
+
+	delta->crc = 0;
+	crc = crc32_le(~0, (unsigned char *)delta, DMZ_BLOCK_SIZE);
+	delta->crc = saved;
+
+	return crc;
+}
+
+/**
+ * @brief In-memory copy of checkpoint block idx, see dmz_ckpt_layout. Zone descriptors live in desc.
+ */
+void *dmz_ckpt_block_addr(struct dmz_metadata *zmd, void *desc, unsigned long idx) {
+	struct dmz_zone *zone = zmd->zone_start;
+	unsigned long mt_blocks = zmd->nr_zone_mt_need_blocks;
+	unsigned long mt_info = zmd->nr_zone_struct_need_blocks;
+	unsigned long rmt_info = mt_info + zmd->nr_zones * mt_blocks;
+	unsigned long bitmap_info = rmt_info + zmd->nr_zones * mt_blocks;
+
+	if (idx < mt_info)
+		return desc + (idx << DMZ_BLOCK_SHIFT);
+
+	if (idx < rmt_info) {
+		idx -= mt_info;
+		return (void *)zone[idx / mt_blocks].mt + ((idx % mt_blocks) << DMZ_BLOCK_SHIFT);
+	}
+
+	if (idx < bitmap_info) {
+		idx -= rmt_info;
+		return (void *)zone[idx / mt_blocks].reverse_mt + ((idx % mt_blocks) << DMZ_BLOCK_SHIFT);
+	}
+
+	return (void *)zmd->bitmap_start + ((idx - bitmap_info) << DMZ_BLOCK_SHIFT);
+}
+
+/* Length of the run of checkpoint blocks idx[0..nr) starting at idx[0] that is consecutive both on disk and in memory. */
+unsigned long dmz_ckpt_run(struct dmz_metadata *zmd, void *desc, __u32 *idx, unsigned long nr) {
+	void *addr = dmz_ckpt_block_addr(zmd, desc, idx[0]);
+	unsigned long run;
+
+	for (run = 1; run < nr && idx[run] == idx[0] + run; run++) {
+		if (dmz_ckpt_block_addr(zmd, desc, idx[run]) != addr + (run << DMZ_BLOCK_SHIFT))
+			break;
+	}
+
+	return run;
+}
+
+/*
+ * A checkpoint of another device set must not load, nor be skipped: without a checkpoint the volume would be
+ * scanned and possibly formatted.
+ */
+static int dmz_super_check_devs(struct dmz_metadata *zmd, struct dmz_super *super) {
+	struct dmz_devs *devs = zmd->devs;
+
+	if (super->nr_devs != devs->nr && (super->nr_devs || devs->nr != 1)) {
+		pr_err("Checkpoint gen %llu is of %u zoned devices, the table lists %u.\n", super->gen, super->nr_devs, devs->nr);
+		return -EINVAL;
+	}
+
+	for (unsigned int d = 0; d < super->nr_devs; d++) {
+		if (super->dev_nr_zones[d] != devs->dev[d].nr_zones) {
+			pr_err("Zoned device %u of the table has %u zones, checkpoint gen %llu expects %u there.\n", d, devs->dev[d].nr_zones,
+			       super->gen, super->dev_nr_zones[d]);
+			return -EINVAL;
+		}
+	}
+
+	if (super->nr_zones != zmd->nr_zones || super->nr_meta_zones != zmd->nr_meta_zones) {
+		pr_err("Checkpoint gen %llu has %llu zones, %llu for metadata, the table %d and %d.\n", super->gen, super->nr_zones, super->nr_meta_zones,
+		       zmd->nr_zones, zmd->nr_meta_zones);
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
+/**
+ * @brief Read the full checkpoint superblock of every slot and keep the valid one with the highest generation.
+ * Deltas appended after it are loaded by dmz_load_deltas.
+ * A zeroed superblock is kept if there is no checkpoint on the device.
+ * 
+ * @return int (0 is all ok, !0 indicates corresponding errors.)
+ */
+static int dmz_load_super(struct dmz_metadata *zmd) {
+	struct dmz_super *best = NULL;
+
+	for (int slot = 0; slot < DMZ_NR_CKPT_SLOTS; slot++) {
+		unsigned long pba = ((unsigned long)slot * zmd->nr_slot_zones << DMZ_ZONE_NR_BLOCKS_SHIFT) + zmd->nr_ckpt_blocks;
+		struct dmz_super *super = (struct dmz_super *)dmz_read_mblk(zmd, pba, 1);
+		if (!super)
+			continue;
+
+		if (super->magic != DMZ_MAGIC || super->crc != dmz_super_crc(super) || (best && best->gen >= super->gen)) {
+			kfree(super);
+			continue;
+		}
+
+		if (dmz_super_check_devs(zmd, super)) {
+			kfree(super);
+			kfree(best);
+			return -EINVAL;
+		}
+
+		kfree(best);
+		best = super;
+		zmd->ckpt_slot = slot;
+	}
+
+	if (!best) {
+		best = kzalloc(DMZ_BLOCK_SIZE, GFP_KERNEL);
+		if (!best)
+			return -ENOMEM;
+		// First checkpoint goes to slot 0.
+		zmd->ckpt_slot = DMZ_NR_CKPT_SLOTS - 1;
+	}
+
+	zmd->sblk = best;
+	zmd->ckpt_gen = best->gen;
+	zmd->ckpt_wp = zmd->nr_ckpt_blocks + 1;
+
+	return 0;
+}
+
+/* Record type, condition and write pointer of every zone, so load needs a single zone report. */
+static int dmz_init_zones_report(struct blk_zone *blkz, unsigned int num, void *data) {
 	struct dmz_zone *zone = (struct dmz_zone *)data;
 	struct dmz_zone *cur_zone = &zone[num];
 
@@ -58,6 +230,12 @@ static int dmz_init_zones_type(struct blk_zone *blkz, unsigned int num, void *da
 		cur_zone->type = DMZ_ZONE_NONE;
 	}
 
+	cur_zone->cond = blkz->cond;
+	if (blkz->type == BLK_ZONE_TYPE_CONVENTIONAL || blkz->cond == BLK_ZONE_COND_FULL)
+		cur_zone->dev_wp = 1 << DMZ_ZONE_NR_BLOCKS_SHIFT;
+	else
+		cur_zone->dev_wp = dmz_sect2blk(blkz->wp - blkz->start);
+
 	return 0;
 }
 
@@ -90,11 +268,17 @@ struct dmz_zone *dmz_load_zones(struct dmz_metadata *zmd, unsigned long *bitmap)
 		cur_zone->write_wq = alloc_workqueue("dmz-zone%d-wq", WQ_MEM_RECLAIM | WQ_UNBOUND, 0, i);
 		if (!cur_zone->write_wq)
 			goto alloc;
+
+		cur_zone->summary = (struct dmz_summary *)__get_free_page(GFP_KERNEL);
+		if (!cur_zone->summary)
+			goto alloc;
+		dmz_summary_init_zone(zmd, cur_zone);
 	}
 
-	int ret = blkdev_report_zones(zmd->target_bdev, 0, BLK_ALL_ZONES, dmz_init_zones_type, zone_start);
-	if (ret) {
-		// FIXME
+	int ret = dmz_devs_report_zones(zmd, dmz_init_zones_report, zone_start);
+	if (ret != zmd->nr_zones) {
+		pr_err("Report zones failed. Ret: %d\n", ret);
+		goto alloc;
 	}
 
 	return zone_start;
@@ -128,6 +312,9 @@ void dmz_unload_zones(struct dmz_metadata *zmd) {
 
 		if (cur->write_wq)
 			destroy_workqueue(cur->write_wq);
+
+		if (cur->summary)
+			free_page((unsigned long)cur->summary);
 	}
 
 	kfree(zone);
@@ -153,88 +340,295 @@ void dmz_unload_bitmap(struct dmz_metadata *zmd) {
 	dmz_bitmap_free(zmd->bitmap_start);
 }
 
+/*
+ * Read one delta at slot offset ckpt_wp, if a committed one is there, straight into the in-memory tables.
+ * Returns 1 if a delta was applied, 0 at the end of the slot, <0 on read errors.
+ */
+static int dmz_load_delta(struct dmz_metadata *zmd, void *desc, unsigned long base) {
+	struct dmz_meta_batch batch;
+	struct dmz_super *super = NULL;
+	unsigned long limit = (unsigned long)zmd->nr_slot_zones << DMZ_ZONE_NR_BLOCKS_SHIFT;
+	__u32 *idx = NULL;
+	int ret = 0;
+
+	if (zmd->ckpt_wp + 2 > limit)
+		return 0;
+
+	struct dmz_delta *hdr = (struct dmz_delta *)dmz_read_mblk(zmd, base + zmd->ckpt_wp, 1);
+	if (!hdr)
+		return 0;
+	if (hdr->magic != DMZ_DELTA_MAGIC || hdr->gen != zmd->ckpt_gen + 1 || hdr->crc != dmz_delta_crc(hdr) || hdr->nr_blocks > zmd->nr_ckpt_blocks)
+		goto out;
+
+	unsigned long nr = hdr->nr_blocks;
+	unsigned long nr_idx_blocks = DIV_ROUND_UP(nr, DMZ_DELTA_IDX_PER_BLOCK);
+	unsigned long data = zmd->ckpt_wp + 1 + nr_idx_blocks;
+	if (data + nr >= limit)
+		goto out;
+
+	// Only a delta committed by its superblock counts, a torn one ends the slot.
+	super = (struct dmz_super *)dmz_read_mblk(zmd, base + data + nr, 1);
+	if (!super || super->magic != DMZ_MAGIC || super->crc != dmz_super_crc(super) || super->gen != hdr->gen || super->nr_zones != zmd->nr_zones ||
+	    super->nr_meta_zones != zmd->nr_meta_zones)
+		goto out;
+
+	idx = kvmalloc(nr_idx_blocks << DMZ_BLOCK_SHIFT, GFP_KERNEL);
+	if (!idx) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	dmz_meta_batch_init(zmd, &batch);
+	dmz_meta_batch_submit(zmd, &batch, REQ_OP_READ, 0, base + zmd->ckpt_wp + 1, idx, nr_idx_blocks);
+	ret = dmz_meta_batch_wait(&batch);
+	if (ret)
+		goto out;
+
+	for (unsigned long i = 0; i < nr; i++) {
+		if (idx[i] >= zmd->nr_ckpt_blocks) {
+			pr_err("Delta gen %llu corrupted.\n", hdr->gen);
+			ret = -EIO;
+			goto out;
+		}
+	}
+
+	dmz_meta_batch_init(zmd, &batch);
+	for (unsigned long i = 0, run; i < nr; i += run) {
+		run = dmz_ckpt_run(zmd, desc, &idx[i], nr - i);
+		dmz_meta_batch_submit(zmd, &batch, REQ_OP_READ, 0, base + data + i, dmz_ckpt_block_addr(zmd, desc, idx[i]), run);
+	}
+	ret = dmz_meta_batch_wait(&batch);
+	if (ret)
+		goto out;
+
+	memcpy(zmd->sblk, super, sizeof(struct dmz_super));
+	zmd->ckpt_gen = super->gen;
+	zmd->ckpt_wp = data + nr + 1;
+	ret = 1;
+
+out:
+	kvfree(idx);
+	kfree(super);
+	kfree(hdr);
+	return ret;
+}
+
+/*
+ * Reload work: submit mapping and reverse mapping reads of zones [start, end) of a checkpoint slot,
+ * straight into the in-memory tables.
+ */
+struct dmz_reload_work {
+	struct work_struct work;
+	struct dmz_metadata *zmd;
+	struct dmz_meta_batch *batch;
+	unsigned long base;
+	int start;
+	int end;
+};
+
+static void dmz_reload_work_process(struct work_struct *work) {
+	struct dmz_reload_work *rlw = container_of(work, struct dmz_reload_work, work);
+	struct dmz_metadata *zmd = rlw->zmd;
+	struct dmz_zone *zone = zmd->zone_start;
+	struct dmz_super *super = zmd->sblk;
+	struct blk_plug plug;
+
+	blk_start_plug(&plug);
+	for (int i = rlw->start; i < rlw->end; i++) {
+		dmz_meta_batch_submit(zmd, rlw->batch, REQ_OP_READ, 0, rlw->base + super->mt_info + i * zmd->nr_zone_mt_need_blocks, zone[i].mt, zmd->nr_zone_mt_need_blocks);
+		dmz_meta_batch_submit(zmd, rlw->batch, REQ_OP_READ, 0, rlw->base + super->rmt_info + i * zmd->nr_zone_mt_need_blocks, zone[i].reverse_mt, zmd->nr_zone_mt_need_blocks);
+	}
+	blk_finish_plug(&plug);
+}
+
+/**
+ * @brief Load the checkpoint of generation ckpt_gen. Zones are split between one worker per online cpu,
+ * all reads of all workers are in flight at once and land directly in the final tables and bitmap.
+ * 
+ * @return int (0 is all ok, !0 indicates corresponding errors.)
+ */
 int dmz_reload_metadata(struct dmz_metadata *zmd) {
 	struct dmz_zone *zone = zmd->zone_start;
 	struct dmz_super *super = zmd->sblk;
+	unsigned long base = (unsigned long)zmd->ckpt_slot * zmd->nr_slot_zones << DMZ_ZONE_NR_BLOCKS_SHIFT;
+	struct dmz_meta_batch batch;
+	int ret = 0;
 
-	pr_info("Reload Read.\n");
-	unsigned long *zones_info = dmz_read_mblk(zmd, super->zones_info, zmd->nr_zone_struct_need_blocks);
-	if (!zones_info) {
-		pr_err("zones_info read failed.\n");
-		goto err;
+	pr_info("Reload Read gen %lu.\n", zmd->ckpt_gen);
+
+	int nr_workers = min_t(int, num_online_cpus(), zmd->nr_zones);
+	int zones_per_worker = DIV_ROUND_UP(zmd->nr_zones, nr_workers);
+	struct dmz_reload_work *rlw = kcalloc(nr_workers, sizeof(struct dmz_reload_work), GFP_KERNEL);
+	struct dmz_zone_desc *desc = kvmalloc((unsigned long)zmd->nr_zone_struct_need_blocks << DMZ_BLOCK_SHIFT, GFP_KERNEL);
+	if (!rlw || !desc) {
+		ret = -ENOMEM;
+		goto alloc;
 	}
-	memcpy(zmd->zone_start, zones_info, zmd->nr_zones * sizeof(struct dmz_zone));
-	kfree(zones_info);
 
-	int stepsize = min(MAX_NR_BLOCKS_ONCE_READ, zmd->nr_zone_mt_need_blocks);
+	dmz_meta_batch_init(zmd, &batch);
+	for (int w = 0; w < nr_workers; w++) {
+		rlw[w].zmd = zmd;
+		rlw[w].batch = &batch;
+		rlw[w].base = base;
+		rlw[w].start = w * zones_per_worker;
+		rlw[w].end = min_t(int, rlw[w].start + zones_per_worker, zmd->nr_zones);
+		INIT_WORK(&rlw[w].work, dmz_reload_work_process);
+		queue_work(system_unbound_wq, &rlw[w].work);
+	}
+
+	dmz_meta_batch_submit(zmd, &batch, REQ_OP_READ, 0, base + super->zones_info, desc, zmd->nr_zone_struct_need_blocks);
+	dmz_meta_batch_submit(zmd, &batch, REQ_OP_READ, 0, base + super->bitmap_info, zmd->bitmap_start, zmd->nr_zones * zmd->nr_zone_bitmap_need_blocks);
+
+	// Workers only submit, the batch reference held here keeps it open until all of them are done.
+	for (int w = 0; w < nr_workers; w++)
+		flush_work(&rlw[w].work);
+
+	ret = dmz_meta_batch_wait(&batch);
+	if (ret) {
+		pr_err("Checkpoint read failed.\n");
+		goto alloc;
+	}
+
+	int nr_deltas = 0;
+	while ((ret = dmz_load_delta(zmd, desc, base)) > 0)
+		nr_deltas++;
+	if (ret) {
+		pr_err("Delta read failed.\n");
+		goto alloc;
+	}
+	super = zmd->sblk;
+	pr_info("Reload %d deltas, gen %lu.\n", nr_deltas, zmd->ckpt_gen);
+
 	for (int i = 0; i < zmd->nr_zones; i++) {
-		pr_info("id: %d, m: %lx, rm: %lx, bm: %lx\n", i, zone[i].mt_blk_n, zone[i].rmt_blk_n, zone[i].bitmap_blk_n);
-		// reload mappings
-		unsigned long readsize = 0;
-		for (int loc = 0; loc < zmd->nr_zone_mt_need_blocks; loc += stepsize) {
-			unsigned long mt = (unsigned long)dmz_read_mblk(zmd, zone[i].mt_blk_n, min(stepsize, zmd->nr_zone_mt_need_blocks - loc));
-			if (!mt) {
-				goto err;
-			}
-			unsigned long next_readsize = readsize + (min(stepsize, zmd->nr_zone_mt_need_blocks - loc) << DMZ_BLOCK_SHIFT) / sizeof(struct dmz_map);
-			next_readsize = min(next_readsize, zmd->nr_blocks);
+		zone[i].wp = desc[i].wp;
+		zone[i].weight = desc[i].weight;
+	}
 
-			memcpy(&zone[i].mt[readsize], (void *)mt, next_readsize - readsize);
-			readsize = next_readsize;
+	zmd->reserved_zone = super->reserved_zone;
+	atomic64_set(&zmd->write_seq, super->write_seq + DMZ_SEQ_MOUNT_GAP);
 
-			kfree((void *)mt);
-		}
+	pr_info("Reload Good.\n");
 
-		readsize = 0;
-		// reload reverse_mappings
-		for (int loc = 0; loc < zmd->nr_zone_mt_need_blocks; loc += stepsize) {
-			unsigned long rmt = (unsigned long)dmz_read_mblk(zmd, zone[i].mt_blk_n, min(stepsize, zmd->nr_zone_mt_need_blocks - loc));
-			if (!rmt) {
-				goto err;
-			}
+alloc:
+	kvfree(desc);
+	kfree(rlw);
+	return ret;
+}
 
-			unsigned long next_readsize = readsize + (min(stepsize, zmd->nr_zone_mt_need_blocks - loc) << DMZ_BLOCK_SHIFT) / sizeof(struct dmz_map);
-			next_readsize = min(next_readsize, zmd->nr_blocks);
+/**
+ * @brief Let zone idx go back to its device wp if the blocks between device and metadata wp are all invalid, e.g. a
+ * zone reset after its blocks were moved out. Mappings still pointing at those blocks (discarded ones) are dropped.
+ *
+ * @return int (0 is all ok, -EIO if a valid block sits above the device wp.)
+ */
+static int dmz_rollback_wp(struct dmz_metadata *zmd, int idx) {
+	struct dmz_zone *zone = &zmd->zone_start[idx];
+	unsigned long start = (unsigned long)idx << DMZ_ZONE_NR_BLOCKS_SHIFT;
 
-			memcpy(&zone[i].reverse_mt[readsize], (void *)rmt, next_readsize - readsize);
-			readsize = next_readsize;
+	for (unsigned long pba = start + zone->dev_wp; pba < start + zone->wp; pba++) {
+		if (dmz_test_bit(zmd, pba))
+			return -EIO;
+	}
 
-			kfree((void *)rmt);
+	for (unsigned long pba = start + zone->dev_wp; pba < start + zone->wp; pba++) {
+		unsigned long lba = dmz_p2l(zmd, pba);
+
+		if (dmz_is_default_pba(lba))
+			continue;
+		if (dmz_get_map(zmd, lba) == pba) {
+			zmd->zone_start[lba >> DMZ_ZONE_NR_BLOCKS_SHIFT].mt[lba & DMZ_ZONE_NR_BLOCKS_MASK].block_id = ~0;
+			dmz_dirty_mt(zmd, lba);
 		}
-		pr_info("Zone %d Good.\n", i);
+		zone->reverse_mt[pba & DMZ_ZONE_NR_BLOCKS_MASK].block_id = ~0;
+		dmz_dirty_rmt(zmd, pba);
 	}
 
-	for (int i = 0; i < zmd->nr_zones; i++) {
-		unsigned long *bmp = dmz_read_mblk(zmd, zone[i].bitmap_blk_n, zmd->nr_zone_bitmap_need_blocks);
-		if (!bmp) {
-			goto err;
+	return 0;
+}
+
+/**
+ * @brief Check the persisted write pointers against the ones the device reported at load, instead of resetting zones.
+ * The device may be ahead (writes whose mapping was never persisted): those blocks are garbage and wp follows the device,
+ * moving to the end of the zone when it stopped inside a segment, as a scan would. The device may also be behind: zone
+ * resets after reclaim or destage are not journaled. That is fine as long as no valid block sits above the device wp,
+ * see dmz_rollback_wp, otherwise persisted mappings point at data the device does not have.
+ *
+ * @return int (number of write pointers moved, <0 indicates corresponding errors.)
+ */
+static int dmz_check_wp(struct dmz_metadata *zmd) {
+	struct dmz_zone *zone = zmd->zone_start;
+	int nr_fixed = 0;
+
+	for (int i = zmd->nr_meta_zones; i < zmd->nr_zones; i++) {
+		if (!DMZ_IS_SEQ(&zone[i]))
+			continue;
+
+		if (zone[i].cond == BLK_ZONE_COND_OFFLINE || zone[i].cond == BLK_ZONE_COND_READONLY) {
+			if (zone[i].cond == BLK_ZONE_COND_OFFLINE && zone[i].weight) {
+				pr_err("Zone %d is offline with %u valid blocks.\n", i, zone[i].weight);
+				return -EIO;
+			}
+			// Never allocate from it again.
+			zone[i].wp = zmd->zone_nr_blocks;
+			continue;
+		}
+
+		if (zone[i].dev_wp < zone[i].wp && dmz_rollback_wp(zmd, i)) {
+			pr_err("Zone %d wp %u is behind metadata wp %u with valid blocks past it.\n", i, zone[i].dev_wp, zone[i].wp);
+			return -EIO;
 		}
-		memcpy(&zmd->bitmap_start[i * (zmd->zone_nr_blocks >> 3)], bmp, zmd->zone_nr_blocks >> 3);
-		memcpy(zone[i].bitmap, bmp, zmd->zone_nr_blocks >> 3);
-		kfree(bmp);
+
+		if (zone[i].dev_wp == zone[i].wp)
+			continue;
+
+		zone[i].wp = zone[i].dev_wp & DMZ_SEG_NR_BLOCKS_MASK ? zmd->zone_nr_blocks : zone[i].dev_wp;
+		nr_fixed++;
 	}
 
-	pr_info("Bitmap Good.\n");
+	if (nr_fixed)
+		pr_info("Moved %d write pointers to the device ones.\n", nr_fixed);
 
-	return 0;
+	return nr_fixed;
+}
 
-err:
-	return -1;
+/**
+ * @brief Bring a device without any dmz metadata to empty. Only zones the report shows written are reset.
+ *
+ * @return int (0 is all ok, !0 indicates corresponding errors.)
+ */
+static int dmz_format_zones(struct dmz_metadata *zmd) {
+	struct dmz_zone *zone = zmd->zone_start;
+	struct blk_plug plug;
+	int nr_reset = 0, ret = 0;
+
+	blk_start_plug(&plug);
+	for (int i = 0; i < zmd->nr_zones; i++) {
+		if (DMZ_IS_SEQ(&zone[i]) && zone[i].cond == BLK_ZONE_COND_EMPTY)
+			continue;
+
+		int err = dmz_reset_zone_async(zmd, i);
+		if (err)
+			ret = err;
+		nr_reset++;
+	}
+	blk_finish_plug(&plug);
+
+	pr_info("Format reset %d zones.\n", nr_reset);
+
+	return ret;
 }
 
 int dmz_load_metadata(struct dmz_metadata *zmd) {
 	int ret = 0;
 
-	unsigned long *sblk = dmz_read_mblk(zmd, 0, 1);
-	zmd->sblk = (struct dmz_super *)sblk;
-
 	zmd->nr_blocks = zmd->capacity >> 3; // the unit of capacity is sectors
 
 	// one mapping occpuy 8 bytes, 4KB block can contain 4K/8=512 mappings. bits to right shift is ilog2(512)=9
 	zmd->nr_map_blocks = zmd->nr_blocks >> 9;
 	zmd->nr_bitmap_blocks = zmd->nr_blocks >> 15;
 
-	zmd->useable_start = 0;
+	zmd->useable_start = zmd->nr_meta_zones << DMZ_ZONE_NR_BLOCKS_SHIFT;
+	zmd->reserved_zone = zmd->nr_meta_zones;
 
 	unsigned long *bitmap_ptr = dmz_load_bitmap(zmd);
 	if (!bitmap_ptr) {
@@ -249,26 +643,43 @@ int dmz_load_metadata(struct dmz_metadata *zmd) {
 		goto zones;
 	}
 	zmd->zone_start = zone_start;
-	zone_start->wp = zmd->useable_start;
 
 	if (dmz_locks_init(zmd))
 		goto locks;
 
-	/** There is no need to support flush right now. **/
-	// if (!(~zmd->sblk->magic)) {
-	// 	pr_info("Start Initlization.\n");
-	// 	ret = dmz_reload_metadata(zmd);
-	// 	if (ret) {
-	// 		pr_err("Reload Failed.\n");
-	// 		ret = -1;
-	// 		goto reload;
-	// 	}
-	// }
+	ret = dmz_cache_init(zmd);
+	if (ret)
+		goto cache;
+
+	// Zone counts match whatever order equal devices are listed in, their summaries tell them apart.
+	ret = dmz_summary_check_devs(zmd);
+	if (ret)
+		goto super;
+
+	ret = dmz_load_super(zmd);
+	if (ret)
+		goto super;
+
+	if (zmd->sblk->magic == DMZ_MAGIC) {
+		ret = dmz_reload_metadata(zmd);
+		if (ret) {
+			pr_err("Reload Failed.\n");
+			ret = -EIO;
+			goto reload;
+		}
+	}
 
 	// Allocating large continuous memory for mapping table tends to fail.
 	// In such case, I allocate small memory for each zone to split mapping table, which reduce pressure for memory and still easy to update mapping table.
 	return ret;
 
+reload:
+	kfree(zmd->sblk);
+	zmd->sblk = NULL;
+super:
+	dmz_cache_exit(zmd);
+cache:
+	dmz_locks_cleanup(zmd);
 locks:
 	dmz_unload_zones(zmd);
 zones:
@@ -279,6 +690,8 @@ bitmap:
 }
 
 void dmz_unload_metadata(struct dmz_metadata *zmd) {
+	dmz_cache_exit(zmd);
+
 	dmz_unload_bitmap(zmd);
 
 	dmz_unload_zones(zmd);
@@ -301,10 +714,18 @@ int dmz_ctr_metadata(struct dmz_target *dmz) {
 		goto alloc;
 	}
 
+	if (dmz_stats_init(zmd))
+		goto stats;
+
 	zmd->capacity = dev->capacity;
 	zmd->dev = dev;
+	zmd->devs = &dmz->devs;
 	zmd->target_bdev = dmz->target_bdev;
+	zmd->meta_bdev = dmz->meta_bdev ? dmz->meta_bdev : dmz->target_bdev;
 	strcpy(zmd->name, dev->name);
+	zmd->max_cache_zones = dmz->max_cache_zones;
+	zmd->tun = dmz->tun;
+	zmd->poll = dmz->poll;
 
 	zmd->zone_nr_sectors = dev->nr_zone_sectors;
 	zmd->zone_nr_blocks = 1 << DMZ_ZONE_NR_BLOCKS_SHIFT;
@@ -313,13 +734,23 @@ int dmz_ctr_metadata(struct dmz_target *dmz) {
 	zmd->nr_zones = dev->nr_zones;
 
 	// how many blocks mappings of each zone needs. For example, 256MB zone need 128 Blocks to store mappings.
-	zmd->nr_zone_mt_need_blocks = ((zmd->zone_nr_blocks * sizeof(struct dmz_map)) / DMZ_BLOCK_SIZE) + 1;
+	zmd->nr_zone_mt_need_blocks = DMZ_ZONE_MT_BLOCKS;
 
 	// how many blocks bitmap need. For example, 256MB zone need 2 Blocks to store bitmaps.
-	zmd->nr_zone_bitmap_need_blocks = ((zmd->zone_nr_blocks >> 3) / DMZ_BLOCK_SIZE) + 1;
+	zmd->nr_zone_bitmap_need_blocks = DMZ_ZONE_BITMAP_BLOCKS;
+
+	// how many blocks zone descriptors need.
+	zmd->nr_zone_struct_need_blocks = DIV_ROUND_UP(zmd->nr_zones * sizeof(struct dmz_zone_desc), DMZ_BLOCK_SIZE);
+
+	// checkpoint slots and the journal take the first zones of the device.
+	zmd->nr_ckpt_blocks = dmz_ckpt_layout(zmd->nr_zones, NULL);
+	// With a metadata device the same layout lives there, and every target zone holds data. Sized at ctr, see dmz_devs_layout.
+	zmd->nr_meta_zones = zmd->devs->nr_meta_zones;
+	zmd->nr_slot_zones = dmz_nr_slot_zones(zmd->nr_zones);
 
-	// how many blocks zone structs need.
-	zmd->nr_zone_struct_need_blocks = ((zmd->nr_zones * sizeof(struct dmz_zone)) / DMZ_BLOCK_SIZE) + 1;
+	zmd->ckpt_dirty = dmz_bitmap_alloc(BITS_TO_LONGS(zmd->nr_ckpt_blocks) * sizeof(unsigned long));
+	if (!zmd->ckpt_dirty)
+		goto ckpt_dirty;
 
 	ret = dmz_load_metadata(zmd);
 	if (ret) {
@@ -330,18 +761,63 @@ int dmz_ctr_metadata(struct dmz_target *dmz) {
 	if (!zmd->reclaim_wq)
 		goto reclaim_init;
 
-	// Reset Zones.
-	for (int i = 0; i < zmd->nr_zones; i++) {
-		dmz_reset_zone(zmd, i);
+	ret = dmz_journal_init(dmz, zmd);
+	if (ret)
+		goto journal_init;
+
+	// Without a checkpoint, rebuild from segment summaries. Zones are reset only if there are none, i.e. a new device.
+	// Resets complete in the background, allocation skips zones until theirs is done.
+	// Otherwise zones keep their data, their write pointers come from the zone report taken at load.
+	int replayed = 0, fixed = 0;
+	if (zmd->sblk->magic != DMZ_MAGIC) {
+		int scanned = dmz_scan_metadata(zmd);
+		if (scanned < 0)
+			goto replay;
+
+		if (!scanned) {
+			ret = dmz_format_zones(zmd);
+			if (ret)
+				pr_err("Reset zones failed.\n");
+		}
+	} else {
+		replayed = dmz_journal_replay(zmd);
+		if (replayed < 0)
+			goto replay;
+
+		fixed = dmz_check_wp(zmd);
+		if (fixed < 0)
+			goto replay;
 	}
 
 	dmz->zmd = zmd;
 
+	// A fresh or scanned device gets its first checkpoint, a replayed journal or moved write pointers are folded into a
+	// new one so appends start clean.
+	if (zmd->sblk->magic != DMZ_MAGIC || replayed || fixed)
+		ret = dmz_flush(dmz);
+	else
+		ret = dmz_journal_reset(zmd, zmd->ckpt_gen);
+	if (ret) {
+		pr_err("Initial checkpoint failed.\n");
+		dmz->zmd = NULL;
+		goto replay;
+	}
+
 	return 0;
 
+replay:
+	dmz_wait_resets(zmd);
+	dmz_journal_exit(zmd);
+journal_init:
+	destroy_workqueue(zmd->reclaim_wq);
 reclaim_init:
+	kfree(zmd->sblk);
 	dmz_unload_metadata(zmd);
 load_meta:
+	dmz_bitmap_free(zmd->ckpt_dirty);
+ckpt_dirty:
+	dmz_stats_exit(zmd);
+stats:
 	kfree(zmd);
 alloc:
 	return -1;
@@ -351,9 +827,19 @@ void dmz_dtr_metadata(struct dmz_metadata *zmd) {
 	if (!zmd)
 		return;
 
+	dmz_wait_resets(zmd);
+
+	dmz_journal_exit(zmd);
+
+	destroy_workqueue(zmd->reclaim_wq);
+
 	kfree(zmd->sblk);
 
+	dmz_bitmap_free(zmd->ckpt_dirty);
+
 	dmz_unload_metadata(zmd);
 
+	dmz_stats_exit(zmd);
+
 	kfree(zmd);
 }
\ No newline at end of file
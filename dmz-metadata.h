@@ -3,6 +3,15 @@
 
 #include "dmz.h"
 
+unsigned long dmz_ckpt_layout(unsigned long nr_zones, struct dmz_super *super);
+unsigned long dmz_nr_slot_zones(unsigned long nr_zones);
+unsigned long dmz_nr_meta_zones(unsigned long nr_zones);
+u32 dmz_super_crc(struct dmz_super *super);
+u32 dmz_delta_crc(struct dmz_delta *delta);
+void *dmz_ckpt_block_addr(struct dmz_metadata *zmd, void *desc, unsigned long idx);
+unsigned long dmz_ckpt_run(struct dmz_metadata *zmd, void *desc, __u32 *idx, unsigned long nr);
+unsigned long *dmz_read_mblk(struct dmz_metadata *zmd, unsigned long pba, int num);
+
 int dmz_ctr_metadata(struct dmz_target *);
 void dmz_dtr_metadata(struct dmz_metadata *);
 
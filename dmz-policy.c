@@ -0,0 +1,325 @@
+#include "dmz.h"
+
+/*
+ * Placement policies: where writes go, zone allocation, reclaim and eager reclaim, the write cache and where destage
+ * puts blocks. They work on the structures of dmz-ftl.c and reach the device only through functions of the other
+ * files (dmz_start_io, dmz_reclaim_move, dmz_summary_write...), which sim/dmz-sim.c implements on its mock device.
+ * The simulator builds this file as it is, against sim/dmz-compat.h.
+ */
+
+/**
+ * @brief Pick the sequential zone the next write appends to and lock it for io. tgt_zone moves round robin over the
+ * zones, a whole round without a writable zone is a stall, dmz_alloc_stall frees zones or gives up.
+ *
+ * @return int (zone index, ~0 if the volume is full.)
+ */
+int dmz_alloc_zone(struct dmz_target *dmz) {
+	struct dmz_metadata *zmd = dmz->zmd;
+	int cnt = 1;
+
+	dmz_lock_reclaim(zmd);
+
+	int ret = zmd->tgt_zone;
+	// This process probablly result in reclaim process blocked.
+	dmz_start_io(zmd, zmd->tgt_zone);
+
+	while (!dmz_zone_writable(zmd, zmd->tgt_zone)) {
+		dmz_complete_io(zmd, zmd->tgt_zone);
+
+		if (cnt == zmd->nr_zones) {
+			dmz_stat_inc(zmd, alloc_stalls);
+			if (dmz_alloc_stall(dmz)) {
+				ret = ~0;
+				goto out;
+			}
+			cnt = 0;
+		}
+
+		ret = dmz_next_tgt_zone(zmd); // function will inc tgt_zone too.
+		cnt++;
+		dmz_start_io(zmd, zmd->tgt_zone);
+	}
+
+	dmz_next_tgt_zone(zmd);
+
+out:
+	dmz_unlock_reclaim(zmd);
+	return ret;
+}
+
+/* Whether a write of nr_blocks goes to the conventional zone cache. */
+bool dmz_cache_write(struct dmz_metadata *zmd, int nr_blocks) {
+	return zmd->nr_cache_zones && nr_blocks <= READ_ONCE(zmd->tun.cache_max_blocks);
+}
+
+/**
+ * @brief Pick the cache zone a small write appends to and lock it for io, like dmz_alloc_zone does for sequential zones.
+ *
+ * @return int (zone index, ~0 if every cache zone is full.)
+ */
+int dmz_cache_alloc(struct dmz_target *dmz) {
+	struct dmz_metadata *zmd = dmz->zmd;
+	struct dmz_zone *zone = zmd->zone_start;
+
+	dmz_lock_reclaim(zmd);
+
+	for (int n = 0; n < zmd->nr_cache_zones; n++) {
+		int idx = zmd->cache_zones[(zmd->cache_cur + n) % zmd->nr_cache_zones];
+		if (dmz_is_resetting(zmd, idx))
+			continue;
+
+		dmz_start_io(zmd, idx);
+		if (zone[idx].wp < zmd->zone_nr_blocks) {
+			zmd->cache_cur = (zmd->cache_cur + n) % zmd->nr_cache_zones;
+			dmz_unlock_reclaim(zmd);
+			return idx;
+		}
+		dmz_complete_io(zmd, idx);
+	}
+
+	dmz_unlock_reclaim(zmd);
+
+	// Destage runs in the reclaim work, the write goes to a sequential zone meanwhile.
+	for (int n = 0; n < zmd->nr_cache_zones; n++)
+		dmz_cache_kick(dmz, zmd->cache_zones[n]);
+
+	return ~0;
+}
+
+/**
+ * @brief If lba is cached, lock its cache zone for io and return through pba where it lives. Destage holds the
+ * reclaim lock while it moves blocks, so the mapping read here stays valid until the overwrite completes. Discarded
+ * blocks are not valid and would not be destaged, a write to them takes the normal path and maps a new block.
+ *
+ * @return int (number of blocks from lba cached back to back at pba, 0 if lba is not cached.)
+ */
+int dmz_cache_inplace(struct dmz_metadata *zmd, unsigned long lba, int nr_blocks, unsigned long *pba) {
+	struct dmz_zone *zone = zmd->zone_start;
+	int n = 0;
+
+	dmz_lock_reclaim(zmd);
+
+	*pba = dmz_get_map(zmd, lba);
+	if (dmz_is_default_pba(*pba) || !DMZ_IS_CACHE(&zone[*pba >> DMZ_ZONE_NR_BLOCKS_SHIFT]) || !dmz_test_bit(zmd, *pba))
+		goto out;
+
+	dmz_start_io(zmd, *pba >> DMZ_ZONE_NR_BLOCKS_SHIFT);
+	for (n = 1; n < nr_blocks; n++) {
+		unsigned long next = *pba + n;
+		if (!(next & DMZ_ZONE_NR_BLOCKS_MASK) || dmz_get_map(zmd, lba + n) != next || !dmz_test_bit(zmd, next))
+			break;
+	}
+
+out:
+	dmz_unlock_reclaim(zmd);
+	return n;
+}
+
+/**
+ * @brief Place the next run of a write of nr_blocks at lba and lock its zone for io. Cached blocks are overwritten
+ * where they are. Otherwise the run appends to a cache zone if cache is set and one has room, else to a sequential
+ * zone, and never crosses a segment: the segment summary sits between runs.
+ *
+ * @return int (zone of the run, ~0 if no zone has room. pba, blk_num and inplace describe the run.)
+ */
+int dmz_write_place(struct dmz_target *dmz, unsigned long lba, int nr_blocks, bool cache, unsigned long *pba, int *blk_num, int *inplace) {
+	struct dmz_metadata *zmd = dmz->zmd;
+	struct dmz_zone *zone = zmd->zone_start;
+	int rzone = ~0;
+
+	*inplace = 0;
+	if (cache) {
+		// Cached blocks are overwritten where they are, there is nothing to remap or invalidate.
+		*blk_num = dmz_cache_inplace(zmd, lba, nr_blocks, pba);
+		if (*blk_num) {
+			*inplace = 1;
+			return *pba >> DMZ_ZONE_NR_BLOCKS_SHIFT;
+		}
+		rzone = dmz_cache_alloc(dmz);
+	}
+
+	if (dmz_is_default_pba(rzone))
+		rzone = dmz_pba_alloc_n(dmz, nr_blocks);
+	if (dmz_is_default_pba(rzone))
+		return ~0;
+
+	*blk_num = min_t(int, dmz_wp_seg_left(zone[rzone].wp), nr_blocks);
+	*pba = zone[rzone].wp + ((unsigned long)rzone << DMZ_ZONE_NR_BLOCKS_SHIFT);
+	dmz_map_change_begin(zmd);
+	zone[rzone].wp += *blk_num;
+	dmz_map_change_end(zmd);
+
+	return rzone;
+}
+
+/* Zone idx just got its last data block: destage it if it caches writes, else reclaim it if dmz_reclaim_eager says so. */
+void dmz_zone_filled(struct dmz_target *dmz, int idx) {
+	struct dmz_metadata *zmd = dmz->zmd;
+
+	if (DMZ_IS_CACHE(&zmd->zone_start[idx]))
+		dmz_cache_kick(dmz, idx);
+	else if (dmz_reclaim_eager(zmd, idx))
+		// Zones below the reclaim_invalid_pct watermark wait until allocation runs out of zones.
+		dmz_reclaim_queue(dmz, idx);
+}
+
+/*
+ * With several devices, move the reserved role to an empty zone on the device of the victim if there is one,
+ * so the copies of a reclaim read and write the same device. IO must be stopped, reclaim still runs one zone at a time.
+ */
+static void dmz_reclaim_pick_local(struct dmz_metadata *zmd, int victim) {
+	struct dmz_zone *zone = zmd->zone_start;
+
+	if (zmd->devs->nr == 1 || dmz_same_dev(zmd, zmd->reserved_zone, victim))
+		return;
+
+	for (int i = zmd->nr_meta_zones; i < zmd->nr_zones; i++) {
+		if (i == victim || zone[i].wp || zone[i].weight || DMZ_IS_CACHE(&zone[i]) || dmz_is_resetting(zmd, i) || !dmz_same_dev(zmd, i, victim))
+			continue;
+		zmd->reserved_zone = i;
+		return;
+	}
+}
+
+/**
+ * @brief Reclaim zone idx. A cache zone is destaged. The valid blocks of a sequential zone are copied to the
+ * reserved zone by dmz_reclaim_move, the reserved zone takes the place of idx and idx is reset to become the next
+ * reserved zone. IO is stopped on every zone meanwhile. Blocks copied are counted in cnt.
+ *
+ * @return int (0 is all ok, !0 indicates corresponding errors.)
+ */
+int dmz_reclaim_victim(struct dmz_target *dmz, int idx, int *cnt) {
+	struct dmz_metadata *zmd = dmz->zmd;
+	struct dmz_zone *z = zmd->zone_start;
+	int ret = 0, err;
+
+	dmz_lock_reclaim(zmd);
+
+	if (!dmz_reclaim_needed(zmd, idx))
+		goto end;
+
+	// Cache zones are not compacted in place, their blocks go to sequential zones.
+	if (DMZ_IS_CACHE(&z[idx])) {
+		ret = dmz_destage_zone(dmz, idx);
+		goto end;
+	}
+
+	for (int i = 0; i < zmd->nr_zones; i++)
+		dmz_start_io(zmd, i);
+
+	dmz_reclaim_pick_local(zmd, idx);
+
+	// Reserved zone still holds the only copy of blocks if the previous reclaim failed to commit them.
+	if (z[zmd->reserved_zone].weight) {
+		pr_err("Reserved zone %d holds valid blocks.\n", zmd->reserved_zone);
+		ret = -EIO;
+		goto out;
+	}
+
+	// Reserved zone was reset asynchronously at the end of the previous reclaim, only wait for it here.
+	dmz_wait_zone_reset(zmd, zmd->reserved_zone);
+	if (z[zmd->reserved_zone].wp && (ret = dmz_reset_zone(zmd, zmd->reserved_zone)))
+		goto out;
+
+	for (unsigned long offset = 0; offset < (unsigned long)z[idx].wp; offset++) {
+		unsigned long pba = ((unsigned long)idx << DMZ_ZONE_NR_BLOCKS_SHIFT) + offset;
+
+		if (!dmz_test_bit(zmd, pba))
+			continue;
+		unsigned long lba = dmz_p2l(zmd, pba);
+		if (dmz_is_default_pba(lba))
+			continue;
+
+		(*cnt)++;
+		ret = dmz_reclaim_move(dmz, lba, pba);
+		if (!dmz_wp_seg_left(z[zmd->reserved_zone].wp) && dmz_summary_write(zmd, zmd->reserved_zone))
+			ret = -EIO;
+		if (ret)
+			goto out;
+	}
+
+	// Moved mappings must be durable before the old copies go away. IO is stopped, so a checkpoint can be taken right here.
+	if ((ret = dmz_journal_commit(dmz))) {
+		pr_err("Commit reclaimed zone %d failed. Errno: %d", idx, ret);
+		goto out;
+	}
+
+	// Zone stays out of the free pool until its reset completes.
+	if ((err = dmz_reset_zone_async(zmd, idx)))
+		pr_err("Reset Current Zone %d Failed. Errno: %d", idx, err);
+
+	zmd->reserved_zone = idx;
+	dmz_stat_inc(zmd, reclaims);
+
+out:
+	for (int i = 0; i < zmd->nr_zones; i++)
+		dmz_complete_io(zmd, i);
+
+end:
+	dmz_unlock_reclaim(zmd);
+	return ret;
+}
+
+static int dmz_cmp_lba(const void *a, const void *b) {
+	unsigned long x = *(const unsigned long *)a, y = *(const unsigned long *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/**
+ * @brief Gather the lbas of the valid blocks of cache zone idx into lbas, which holds weight + 1 entries, sorted so
+ * that destage writes them as long sequential runs.
+ *
+ * @return unsigned long (number of lbas.)
+ */
+unsigned long dmz_destage_collect(struct dmz_metadata *zmd, int idx, unsigned long *lbas) {
+	struct dmz_zone *zone = zmd->zone_start;
+	unsigned long base = (unsigned long)idx << DMZ_ZONE_NR_BLOCKS_SHIFT, nr = 0;
+
+	for (unsigned long offset = 0; offset < zone[idx].wp && nr < zone[idx].weight; offset++) {
+		if (!dmz_test_bit(zmd, base + offset))
+			continue;
+		unsigned long lba = dmz_p2l(zmd, base + offset);
+		if (!dmz_is_default_pba(lba))
+			lbas[nr++] = lba;
+	}
+	sort(lbas, nr, sizeof(unsigned long), dmz_cmp_lba, NULL);
+
+	return nr;
+}
+
+/* Sequential zone with room for destaged blocks, starting the search at dst. */
+static int dmz_destage_pick(struct dmz_metadata *zmd, int dst) {
+	struct dmz_zone *zone = zmd->zone_start;
+
+	for (int n = 0; n < zmd->nr_zones; n++) {
+		int i = (dst + n) % zmd->nr_zones;
+		if (i < zmd->nr_meta_zones || i == zmd->reserved_zone || DMZ_IS_CACHE(&zone[i]) || zone[i].wp >= zmd->zone_nr_blocks || dmz_is_resetting(zmd, i))
+			continue;
+		return i;
+	}
+
+	return ~0;
+}
+
+/**
+ * @brief Place the next run of at most n destaged blocks at the write pointer of a sequential zone, searching from
+ * zone *dst on. Runs never cross a segment, the segment summary sits between them.
+ *
+ * @return unsigned long (pba of the run, of cnt blocks in zone *dst, ~0 if no sequential zone has room.)
+ */
+unsigned long dmz_destage_place(struct dmz_metadata *zmd, int *dst, unsigned long n, unsigned long *cnt) {
+	struct dmz_zone *zone = zmd->zone_start;
+
+	*dst = dmz_destage_pick(zmd, *dst);
+	if (dmz_is_default_pba(*dst))
+		return ~0UL;
+
+	unsigned long pba = ((unsigned long)*dst << DMZ_ZONE_NR_BLOCKS_SHIFT) + zone[*dst].wp;
+	*cnt = min_t(unsigned long, n, dmz_wp_seg_left(zone[*dst].wp));
+	dmz_map_change_begin(zmd);
+	zone[*dst].wp += *cnt;
+	dmz_map_change_end(zmd);
+
+	return pba;
+}
@@ -0,0 +1,17 @@
+#ifndef _DMZ_POLICY_H_
+#define _DMZ_POLICY_H_
+
+#include "dmz.h"
+
+int dmz_alloc_zone(struct dmz_target *dmz);
+int dmz_write_place(struct dmz_target *dmz, unsigned long lba, int nr_blocks, bool cache, unsigned long *pba, int *blk_num, int *inplace);
+void dmz_zone_filled(struct dmz_target *dmz, int idx);
+int dmz_reclaim_victim(struct dmz_target *dmz, int idx, int *cnt);
+
+bool dmz_cache_write(struct dmz_metadata *zmd, int nr_blocks);
+int dmz_cache_alloc(struct dmz_target *dmz);
+int dmz_cache_inplace(struct dmz_metadata *zmd, unsigned long lba, int nr_blocks, unsigned long *pba);
+unsigned long dmz_destage_collect(struct dmz_metadata *zmd, int idx, unsigned long *lbas);
+unsigned long dmz_destage_place(struct dmz_metadata *zmd, int *dst, unsigned long n, unsigned long *cnt);
+
+#endif
@@ -1,43 +1,9 @@
 #include "dmz.h"
-
-int RESERVED_ZONE_ID = 0;
+#include "dmz-trace.h"
 
 static unsigned long dmz_reserved_zone_pba_alloc(struct dmz_metadata *zmd) {
 	struct dmz_zone *zone = zmd->zone_start;
-	return ((RESERVED_ZONE_ID << DMZ_ZONE_NR_BLOCKS_SHIFT) + zone[RESERVED_ZONE_ID].wp);
-}
-
-/**
- * @brief When GC has been started, valid blocks should be move to another zone. I need to update mapping, therefore ph
- * 
- * @param{unsigned long} pba 
- * @return{unsigned long} unsigned long 
- */
-unsigned long dmz_p2l(struct dmz_metadata *zmd, unsigned long pba) {
-	int index = pba >> DMZ_ZONE_NR_BLOCKS_SHIFT;
-	int offset = pba & DMZ_ZONE_NR_BLOCKS_MASK;
-
-	struct dmz_zone *zone = &zmd->zone_start[index];
-	return (unsigned long)zone->reverse_mt[offset].block_id;
-}
-
-void dmz_reclaim_read_bio_endio(struct bio *bio) {
-	struct bio_vec *bv = bio->bi_io_vec;
-	struct page *page = bv->bv_page;
-	struct page *private = bio->bi_private;
-
-	// read failed.
-	if (bio->bi_status) {
-		ClearPageUptodate(private);
-		SetPageError(private);
-	} else {
-		SetPageUptodate(private);
-	}
-	if (PageLocked(page)) {
-		unlock_page(page);
-	}
-
-	bio_put(bio);
+	return ((zmd->reserved_zone << DMZ_ZONE_NR_BLOCKS_SHIFT) + zone[zmd->reserved_zone].wp);
 }
 
 void *dmz_reclaim_read_block(struct dmz_target *dmz, unsigned long pba) {
@@ -50,30 +16,19 @@ void *dmz_reclaim_read_block(struct dmz_target *dmz, unsigned long pba) {
 	struct bio *rbio = bio_alloc(GFP_KERNEL, 1);
 	if (!rbio)
 		goto bio_alloc;
-	bio_set_dev(rbio, zmd->target_bdev);
-	rbio->bi_iter.bi_sector = pba << 3;
-	rbio->bi_private = page;
+	dmz_bio_set_pba(zmd, rbio, pba);
 	bio_add_page(rbio, page, PAGE_SIZE, 0);
 	bio_set_op_attrs(rbio, REQ_OP_READ, 0);
-	lock_page(page);
-
-	ClearPageUptodate(page);
-	rbio->bi_end_io = dmz_reclaim_read_bio_endio;
-
-	submit_bio(rbio);
 
-	lock_page(page);
-
-	if (!PageUptodate(page)) {
+	int ret = dmz_submit_bio_sync(zmd, rbio);
+	bio_put(rbio);
+	if (ret) {
 		pr_err("Read page err.\n");
-		goto read_err;
+		goto bio_alloc;
 	}
-	unlock_page(page);
 
 	return (void *)buffer;
 
-read_err:
-	unlock_page(page);
 bio_alloc:
 	free_page(buffer);
 buffer_alloc:
@@ -90,12 +45,13 @@ int dmz_reclaim_write_block(struct dmz_target *dmz, unsigned long pba, unsigned
 	struct bio *wbio = bio_alloc(GFP_KERNEL, 1);
 	if (!wbio)
 		goto bio_alloc;
-	bio_set_dev(wbio, zmd->target_bdev);
-	wbio->bi_iter.bi_sector = pba << 3;
+	dmz_bio_set_pba(zmd, wbio, pba);
 	bio_add_page(wbio, page, PAGE_SIZE, 0);
 	bio_set_op_attrs(wbio, REQ_OP_WRITE, 0);
 
-	int status = submit_bio_wait(wbio);
+	dmz_stat_inc(zmd, dev_write_blocks);
+	dmz_stat_inc(zmd, reclaim_blocks);
+	int status = dmz_submit_bio_sync(zmd, wbio);
 	bio_put(wbio);
 
 	if (status) {
@@ -112,24 +68,16 @@ invalid_kaddr:
 }
 
 /**
- * @brief Reclaim a zone need to put all valid blocks in other one or several zones which has enough free space.
- * I need to make a bio to do this job.
- * 1. Read block in device into memory.
- * 2. Write memory to device.
- * 
- * @param{struct dm_taregt*} dmz
- * @param{unsigned long} lba 
- * @param{unsigned long} pba 
- * @param{void *func(struct bio*)} endio 
- * @return{struct bio*} a bio waiting to be submitted
+ * @brief Copy lba from pba to the write pointer of the reserved zone, moving it, and remap lba there. Called by
+ * dmz_reclaim_victim for every valid block of the victim, which seals the segments. A failed copy queues the
+ * victim for another try once this reclaim has given up.
+ *
+ * @return int (0 is all ok, !0 indicates corresponding errors.)
  */
-int dmz_make_reclaim_bio(struct dmz_target *dmz, unsigned long lba) {
+int dmz_reclaim_move(struct dmz_target *dmz, unsigned long lba, unsigned long pba) {
 	struct dmz_metadata *zmd = dmz->zmd;
 	int ret = 0;
 
-	int index = lba >> DMZ_ZONE_NR_BLOCKS_SHIFT, offset = lba & DMZ_ZONE_NR_BLOCKS_MASK;
-	unsigned long pba = zmd->zone_start[index].mt[offset].block_id;
-
 	unsigned long buffer = (unsigned long)dmz_reclaim_read_block(dmz, pba);
 	if (!buffer) {
 		goto read_err;
@@ -142,12 +90,17 @@ int dmz_make_reclaim_bio(struct dmz_target *dmz, unsigned long lba) {
 	}
 
 	ret = dmz_reclaim_write_block(dmz, new_pba, buffer);
-	zmd->zone_start[RESERVED_ZONE_ID].wp += 1;
+	dmz_map_change_begin(zmd);
+	zmd->zone_start[zmd->reserved_zone].wp += 1;
+	dmz_map_change_end(zmd);
 
 	if (!ret) {
+		// A copy is a new write of lba, its sequence wins over the original in a scan.
+		dmz_summary_add(zmd, new_pba, lba, 1, atomic64_inc_return(&zmd->write_seq));
 		dmz_update_map(dmz, lba, new_pba);
 	} else {
 		pr_err("WRITE ERR P MEM.");
+		dmz_reclaim_queue(dmz, pba >> DMZ_ZONE_NR_BLOCKS_SHIFT);
 	}
 
 	free_page(buffer);
@@ -155,83 +108,44 @@ int dmz_make_reclaim_bio(struct dmz_target *dmz, unsigned long lba) {
 	return ret;
 
 alloc_err:
+	free_page(buffer);
 read_err:
 	pr_err("DMZ_MAKE_RECLAIM_BIO\n");
+	dmz_reclaim_queue(dmz, pba >> DMZ_ZONE_NR_BLOCKS_SHIFT);
 	return -1;
 }
 
-/*
-* Reclaim specified zone.
-*/
-// TODO support flush (seems no need, because all metadata is in memory)
-int dmz_reclaim_zone(struct dmz_target *dmz, int zone) {
+/* Queue reclaim of zone idx in the reclaim work. */
+void dmz_reclaim_queue(struct dmz_target *dmz, int idx) {
 	struct dmz_metadata *zmd = dmz->zmd;
-	struct dmz_zone *cur_zone = &zmd->zone_start[zone];
-	struct dmz_zone *z = zmd->zone_start;
-	int ret = 0, errno = 0;
-	int cnt = 0, origin_zone = RESERVED_ZONE_ID;
-
-	dmz_lock_reclaim(zmd);
+	struct dmz_reclaim_work *rcw = kzalloc(sizeof(struct dmz_reclaim_work), GFP_KERNEL);
 
-	if (zone == RESERVED_ZONE_ID) {
-		goto end;
+	if (!rcw) {
+		pr_err("Mem not enough for reclaim.");
+		return;
 	}
 
-	if (z[zone].weight == z[zone].wp) {
-		goto end;
-	}
-
-	dmz_print_zones(zmd, "start");
-	for (int i = 0; i < zmd->nr_zones; i++)
-		dmz_start_io(zmd, i);
-
-	// Reset reserved zone for reclaim.
-	// FIXME RESET didn't excute.
-	if (z[RESERVED_ZONE_ID].wp)
-		errno = dmz_reset_zone(zmd, RESERVED_ZONE_ID);
-	if (errno) {
-		ret = errno;
-		goto reclaim_bio_err;
-	}
-
-	for (unsigned long offset = 0; offset < (unsigned long)cur_zone->wp; offset++) {
-		if (dmz_test_bit(zmd, (zone << DMZ_ZONE_NR_BLOCKS_SHIFT) + offset)) {
-			unsigned long lba = dmz_p2l(zmd, (zone << DMZ_ZONE_NR_BLOCKS_SHIFT) + offset);
-			if (dmz_is_default_pba(lba)) {
-				continue;
-			}
-
-			cnt++;
-			int ret = dmz_make_reclaim_bio(dmz, lba);
-			if (ret) {
-				struct dmz_reclaim_work *rcw = kzalloc(sizeof(struct dmz_reclaim_work), GFP_KERNEL);
-				if (rcw) {
-					rcw->bdev = zmd->target_bdev;
-					rcw->zone = zone;
-					rcw->dmz = dmz;
-					INIT_WORK(&rcw->work, dmz_reclaim_work_process);
-					queue_work(zmd->reclaim_wq, &rcw->work);
-				} else {
-					pr_err("Mem not enough for reclaim.");
-				}
-				goto reclaim_bio_err;
-			}
-		}
-	}
-
-	if ((errno = dmz_reset_zone(zmd, zone))) {
-		pr_err("Reset Current Zone %d Failed. Errno: %d", zone, errno);
-	}
+	rcw->bdev = zmd->target_bdev;
+	rcw->zone = idx;
+	rcw->dmz = dmz;
+	INIT_WORK(&rcw->work, dmz_reclaim_work_process);
+	queue_work(zmd->reclaim_wq, &rcw->work);
+}
 
-	RESERVED_ZONE_ID = zone;
+/*
+ * Reclaim specified zone, see dmz_reclaim_victim.
+ */
+// TODO support flush (seems no need, because all metadata is in memory)
+int dmz_reclaim_zone(struct dmz_target *dmz, int zone) {
+	struct dmz_metadata *zmd = dmz->zmd;
+	int cnt = 0;
+	u64 start = ktime_get_ns();
 
-	dmz_print_zones(zmd, "end");
+	int ret = dmz_reclaim_victim(dmz, zone, &cnt);
 
-reclaim_bio_err:
-	for (int i = 0; i < zmd->nr_zones; i++)
-		dmz_complete_io(zmd, i);
+	u64 lat = ktime_get_ns() - start;
+	dmz_stat_lat(zmd, DMZ_LAT_RECLAIM, lat);
+	trace_dmz_reclaim_zone(zone, cnt, ret, lat);
 
-end:
-	dmz_unlock_reclaim(zmd);
 	return ret;
-}
\ No newline at end of file
+}
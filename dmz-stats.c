@@ -0,0 +1,377 @@
+#define CREATE_TRACE_POINTS
+#include "dmz-trace.h"
+
+#include "dmz-stats.h"
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+
+// /sys/kernel/debug/dmzoned, one directory per target below it.
+static struct dentry *dmz_debugfs_root;
+
+void dmz_stats_module_init(void) {
+	dmz_debugfs_root = debugfs_create_dir("dmzoned", NULL);
+}
+
+void dmz_stats_module_exit(void) {
+	debugfs_remove_recursive(dmz_debugfs_root);
+}
+
+int dmz_stats_init(struct dmz_metadata *zmd) {
+	zmd->stats = alloc_percpu(struct dmz_stats);
+	if (!zmd->stats)
+		return -ENOMEM;
+
+	zmd->heat = alloc_percpu(struct dmz_heat);
+	if (!zmd->heat) {
+		free_percpu(zmd->stats);
+		return -ENOMEM;
+	}
+
+	return 0;
+}
+
+void dmz_stats_unregister(struct dmz_metadata *zmd) {
+	debugfs_remove_recursive(zmd->debugfs_dir);
+	zmd->debugfs_dir = NULL;
+}
+
+void dmz_stats_exit(struct dmz_metadata *zmd) {
+	dmz_stats_unregister(zmd);
+	free_percpu(zmd->heat);
+	free_percpu(zmd->stats);
+}
+
+void dmz_stats_sum(struct dmz_metadata *zmd, struct dmz_stats *sum) {
+	int cpu;
+
+	memset(sum, 0, sizeof(struct dmz_stats));
+	for_each_possible_cpu (cpu) {
+		struct dmz_stats *s = per_cpu_ptr(zmd->stats, cpu);
+
+		sum->host_read_blocks += s->host_read_blocks;
+		sum->host_write_blocks += s->host_write_blocks;
+		sum->dev_write_blocks += s->dev_write_blocks;
+		sum->reclaim_blocks += s->reclaim_blocks;
+		sum->destage_blocks += s->destage_blocks;
+		sum->reclaims += s->reclaims;
+		sum->alloc_stalls += s->alloc_stalls;
+		for (int t = 0; t < DMZ_LAT_NR; t++)
+			for (int b = 0; b < DMZ_LAT_BUCKETS; b++)
+				sum->lat[t][b] += s->lat[t][b];
+		for (int l = 0; l < DMZ_LOCK_NR; l++) {
+			sum->locks[l].acquired += s->locks[l].acquired;
+			sum->locks[l].contended += s->locks[l].contended;
+			sum->locks[l].wait_ns += s->locks[l].wait_ns;
+		}
+	}
+}
+
+enum { DMZ_ZS_META, DMZ_ZS_CACHE, DMZ_ZS_RESETTING, DMZ_ZS_RESERVED, DMZ_ZS_FREE, DMZ_ZS_OPEN, DMZ_ZS_FULL, DMZ_ZS_NR };
+
+static const char *const dmz_zone_state_names[DMZ_ZS_NR] = { "meta", "cache", "resetting", "reserved", "free", "open", "full" };
+
+/* Zone state as the allocator sees it. Read without locks, a snapshot may be slightly off while IO runs. */
+static int dmz_zone_state(struct dmz_metadata *zmd, int i) {
+	struct dmz_zone *zone = &zmd->zone_start[i];
+	unsigned int wp = READ_ONCE(zone->wp);
+
+	if (i < zmd->nr_meta_zones)
+		return DMZ_ZS_META;
+	if (DMZ_IS_CACHE(zone))
+		return DMZ_ZS_CACHE;
+	if (dmz_is_resetting(zmd, i))
+		return DMZ_ZS_RESETTING;
+	if (i == zmd->reserved_zone)
+		return DMZ_ZS_RESERVED;
+	if (!wp)
+		return DMZ_ZS_FREE;
+	if (wp >= zmd->zone_nr_blocks)
+		return DMZ_ZS_FULL;
+	return DMZ_ZS_OPEN;
+}
+
+static int dmz_stats_show(struct seq_file *s, void *data) {
+	struct dmz_metadata *zmd = s->private;
+	unsigned long nr[DMZ_ZS_NR] = { 0 };
+	struct dmz_stats *stats = kmalloc(sizeof(struct dmz_stats), GFP_KERNEL);
+
+	if (!stats)
+		return -ENOMEM;
+
+	for (int i = 0; i < zmd->nr_zones; i++)
+		nr[dmz_zone_state(zmd, i)]++;
+
+	dmz_stats_sum(zmd, stats);
+
+	seq_printf(s, "zones: %lu\n", zmd->nr_zones);
+	for (int i = 0; i < DMZ_ZS_NR; i++)
+		seq_printf(s, "%s_zones: %lu\n", dmz_zone_state_names[i], nr[i]);
+	seq_printf(s, "host_read_bytes: %llu\nhost_write_bytes: %llu\ndev_write_bytes: %llu\n", stats->host_read_blocks << DMZ_BLOCK_SHIFT,
+		   stats->host_write_blocks << DMZ_BLOCK_SHIFT, stats->dev_write_blocks << DMZ_BLOCK_SHIFT);
+	seq_printf(s, "reclaim_copy_bytes: %llu\ndestage_bytes: %llu\nreclaims: %llu\nalloc_stalls: %llu\n", stats->reclaim_blocks << DMZ_BLOCK_SHIFT,
+		   stats->destage_blocks << DMZ_BLOCK_SHIFT, stats->reclaims, stats->alloc_stalls);
+
+	// Write amplification in thousandths, device writes over host writes since the target was created.
+	if (stats->host_write_blocks)
+		seq_printf(s, "waf_milli: %llu\n", div64_u64(stats->dev_write_blocks * 1000, stats->host_write_blocks));
+	else
+		seq_puts(s, "waf_milli: 0\n");
+
+	kfree(stats);
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(dmz_stats);
+
+static int dmz_zones_show(struct seq_file *s, void *data) {
+	struct dmz_metadata *zmd = s->private;
+	struct dmz_zone *zone = zmd->zone_start;
+
+	seq_puts(s, "zone dev state wp weight\n");
+	for (int i = 0; i < zmd->nr_zones; i++) {
+		unsigned long dev_zone;
+		unsigned int d = dmz_zone_dev(zmd->devs, i, &dev_zone);
+
+		seq_printf(s, "%d %u:%lu %s %u %u\n", i, d, dev_zone, dmz_zone_state_names[dmz_zone_state(zmd, i)], READ_ONCE(zone[i].wp), READ_ONCE(zone[i].weight));
+	}
+
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(dmz_zones);
+
+static const char *const dmz_lat_names[DMZ_LAT_NR] = { "read", "write", "flush", "discard", "alloc", "reclaim_lock", "reclaim" };
+
+/* One line per type: the lower bound in ns of every non-empty bucket and its count. */
+static int dmz_latency_show(struct seq_file *s, void *data) {
+	struct dmz_metadata *zmd = s->private;
+	struct dmz_stats *sum = kmalloc(sizeof(struct dmz_stats), GFP_KERNEL);
+
+	if (!sum)
+		return -ENOMEM;
+
+	dmz_stats_sum(zmd, sum);
+	for (int t = 0; t < DMZ_LAT_NR; t++) {
+		seq_printf(s, "%s:", dmz_lat_names[t]);
+		for (int b = 0; b < DMZ_LAT_BUCKETS; b++)
+			if (sum->lat[t][b])
+				seq_printf(s, " %llu:%llu", b ? 1ULL << b : 0ULL, sum->lat[t][b]);
+		seq_putc(s, '\n');
+	}
+
+	kfree(sum);
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(dmz_latency);
+
+static const char *const dmz_lock_names[DMZ_LOCK_NR] = { "reclaim_lock", "io_lock", "journal_write_lock" };
+
+/* Totals per lock, then the io_lock of every zone that was ever contended. */
+static int dmz_locks_show(struct seq_file *s, void *data) {
+	struct dmz_metadata *zmd = s->private;
+	struct dmz_stats *sum = kmalloc(sizeof(struct dmz_stats), GFP_KERNEL);
+
+	if (!sum)
+		return -ENOMEM;
+
+	dmz_stats_sum(zmd, sum);
+	seq_puts(s, "lock acquired contended wait_ns\n");
+	for (int l = 0; l < DMZ_LOCK_NR; l++)
+		seq_printf(s, "%s %llu %llu %llu\n", dmz_lock_names[l], sum->locks[l].acquired, sum->locks[l].contended, sum->locks[l].wait_ns);
+	kfree(sum);
+
+	seq_puts(s, "\nzone io_lock acquired contended wait_ns\n");
+	for (int i = 0; i < zmd->nr_zones; i++) {
+		struct dmz_lock_stats *l = &zmd->zone_start[i].io_lock_stats;
+
+		if (READ_ONCE(l->contended))
+			seq_printf(s, "%d %llu %llu %llu\n", i, READ_ONCE(l->acquired), READ_ONCE(l->contended), READ_ONCE(l->wait_ns));
+	}
+
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(dmz_locks);
+
+/*
+ * Physical zone holding most mapped blocks of the region starting at lba, how many it holds, and the number of
+ * mapped blocks of the region. cnt is per zone scratch, cleared here: the mapping may change under the scan.
+ */
+static long dmz_heat_zone(struct dmz_metadata *zmd, unsigned long lba, u32 *cnt, u32 *zone_blocks, u32 *mapped) {
+	unsigned long end = min(lba + (1UL << zmd->heat_shift), zmd->nr_blocks);
+	long best = -1;
+
+	memset(cnt, 0, zmd->nr_zones * sizeof(u32));
+	*zone_blocks = *mapped = 0;
+	for (unsigned long l = lba; l < end; l++) {
+		unsigned long pba = dmz_get_map(zmd, l);
+
+		if (pba >= zmd->nr_blocks)
+			continue;
+		(*mapped)++;
+		if (++cnt[pba >> DMZ_ZONE_NR_BLOCKS_SHIFT] > *zone_blocks) {
+			*zone_blocks = cnt[pba >> DMZ_ZONE_NR_BLOCKS_SHIFT];
+			best = pba >> DMZ_ZONE_NR_BLOCKS_SHIFT;
+		}
+	}
+
+	return best;
+}
+
+/*
+ * CSV, one line per region with traffic or mapped blocks. Counts are in sampled blocks, multiply by the sample rate
+ * in the header for an estimate. zone is the physical zone holding most of the region, with its share and weight.
+ */
+static int dmz_heatmap_show(struct seq_file *s, void *data) {
+	struct dmz_metadata *zmd = s->private;
+	u32 *cnt = kvcalloc(zmd->nr_zones, sizeof(u32), GFP_KERNEL);
+
+	if (!cnt)
+		return -ENOMEM;
+
+	seq_printf(s, "# sample %u region_blocks %lu\n", READ_ONCE(zmd->heat_sample), 1UL << zmd->heat_shift);
+	seq_puts(s, "region,lba,reads,writes,mapped,zone,zone_blocks,zone_weight\n");
+	for (unsigned long r = 0; r < DMZ_HEAT_NR_REGIONS; r++) {
+		unsigned long lba = r << zmd->heat_shift;
+		u64 reads = 0, writes = 0;
+		u32 zone_blocks, mapped;
+		long zone;
+		int cpu;
+
+		if (lba >= zmd->nr_blocks)
+			break;
+
+		for_each_possible_cpu (cpu) {
+			reads += per_cpu_ptr(zmd->heat, cpu)->read[r];
+			writes += per_cpu_ptr(zmd->heat, cpu)->write[r];
+		}
+
+		zone = dmz_heat_zone(zmd, lba, cnt, &zone_blocks, &mapped);
+		if (!reads && !writes && !mapped)
+			continue;
+
+		seq_printf(s, "%lu,%lu,%llu,%llu,%u,%ld,%u,%u\n", r, lba, reads, writes, mapped, zone, zone_blocks,
+			   zone < 0 ? 0 : READ_ONCE(zmd->zone_start[zone].weight));
+		cond_resched();
+	}
+
+	kvfree(cnt);
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(dmz_heatmap);
+
+/* Word w of the map dump: header, lba records, zone records, trailer. Every part is a whole number of words. */
+static u64 dmz_map_dump_word(struct dmz_metadata *zmd, u64 w, u64 *hdr_words, u64 *trailer_words) {
+	const u64 nr_hdr = sizeof(struct dmz_map_dump_hdr) / sizeof(u64);
+
+	if (w < nr_hdr)
+		return hdr_words[w];
+	w -= nr_hdr;
+
+	if (w < zmd->nr_blocks) {
+		unsigned long pba = dmz_get_map(zmd, w);
+
+		if (pba >= zmd->nr_blocks)
+			return ~0ULL;
+		return pba | (dmz_test_bit(zmd, pba) ? DMZ_MAP_DUMP_VALID : 0);
+	}
+	w -= zmd->nr_blocks;
+
+	if (w < zmd->nr_zones)
+		return READ_ONCE(zmd->zone_start[w].wp) | (u64)READ_ONCE(zmd->zone_start[w].weight) << 32;
+	w -= zmd->nr_zones;
+
+	return trailer_words[w];
+}
+
+/*
+ * Stream the mapping a page at a time, nothing is allocated per lba. No lock is taken: the generation in header
+ * and trailer tells the reader whether the mapping changed in between.
+ */
+static ssize_t dmz_map_dump_read(struct file *file, char __user *buf, size_t count, loff_t *ppos) {
+	struct dmz_metadata *zmd = file->private_data;
+	// struct dmz_map_dump_hdr and struct dmz_map_dump_trailer, in cpu order until the page is filled.
+	u64 hdr[] = { DMZ_MAP_DUMP_MAGIC, 2, sizeof(u64), zmd->nr_blocks, zmd->nr_zones, zmd->zone_nr_blocks, dmz_map_gen(zmd), 0 };
+	u64 trailer[] = { DMZ_MAP_DUMP_MAGIC, 0 };
+	u64 end = sizeof(hdr) + (zmd->nr_blocks + zmd->nr_zones) * sizeof(u64) + sizeof(trailer);
+	u64 trailer_start = (end - sizeof(trailer)) / sizeof(u64);
+	ssize_t done = 0;
+	__le64 *page;
+
+	BUILD_BUG_ON(sizeof(hdr) != sizeof(struct dmz_map_dump_hdr) || sizeof(trailer) != sizeof(struct dmz_map_dump_trailer));
+
+	if (*ppos >= end)
+		return 0;
+
+	page = (__le64 *)__get_free_page(GFP_KERNEL);
+	if (!page)
+		return -ENOMEM;
+
+	// Records are read after the header generation.
+	smp_rmb();
+
+	while (count && *ppos < end) {
+		u64 base = round_down(*ppos, PAGE_SIZE), off = *ppos - base;
+		u64 len = min_t(u64, PAGE_SIZE, end - base);
+		u64 i = 0;
+
+		for (; i < len / sizeof(u64) && base / sizeof(u64) + i < trailer_start; i++)
+			page[i] = cpu_to_le64(dmz_map_dump_word(zmd, base / sizeof(u64) + i, hdr, trailer));
+
+		// The trailer takes the generation after every record before it was read.
+		if (i < len / sizeof(u64)) {
+			smp_rmb();
+			trailer[1] = dmz_map_gen(zmd);
+		}
+		for (; i < len / sizeof(u64); i++)
+			page[i] = cpu_to_le64(dmz_map_dump_word(zmd, base / sizeof(u64) + i, hdr, trailer));
+
+		len = min_t(u64, len - off, count);
+		if (copy_to_user(buf + done, (char *)page + off, len)) {
+			done = done ? done : -EFAULT;
+			break;
+		}
+
+		done += len;
+		count -= len;
+		*ppos += len;
+		cond_resched();
+	}
+
+	free_page((unsigned long)page);
+	return done;
+}
+
+static const struct file_operations dmz_map_dump_fops = {
+	.owner = THIS_MODULE,
+	.open = simple_open,
+	.read = dmz_map_dump_read,
+	.llseek = default_llseek,
+};
+
+/*
+ * Publish the counters of a resumed target under the name of its disk (dm-N). Debugfs is best effort, failures are ignored. The
+ * directory comes and goes with suspend and resume, so the instances of a reloaded table never share it.
+ */
+void dmz_stats_register(struct dmz_metadata *zmd, const char *name) {
+	struct dentry *dir;
+
+	// Regions cover every block of the volume, the heatmap is off until heat_sample is set.
+	zmd->heat_shift = max_t(int, 0, order_base_2(zmd->nr_blocks) - ilog2(DMZ_HEAT_NR_REGIONS));
+
+	if (zmd->debugfs_dir)
+		return;
+
+	dir = debugfs_create_dir(name, dmz_debugfs_root);
+	if (IS_ERR(dir)) {
+		pr_warn("%s: no debugfs directory, error %ld.\n", name, PTR_ERR(dir));
+		return;
+	}
+
+	zmd->debugfs_dir = dir;
+	debugfs_create_file("stats", 0444, zmd->debugfs_dir, zmd, &dmz_stats_fops);
+	debugfs_create_file("zones", 0444, zmd->debugfs_dir, zmd, &dmz_zones_fops);
+	debugfs_create_file("latency", 0444, zmd->debugfs_dir, zmd, &dmz_latency_fops);
+	debugfs_create_file("locks", 0444, zmd->debugfs_dir, zmd, &dmz_locks_fops);
+	debugfs_create_file("heatmap", 0444, zmd->debugfs_dir, zmd, &dmz_heatmap_fops);
+	debugfs_create_u32("heat_sample", 0644, zmd->debugfs_dir, &zmd->heat_sample);
+	debugfs_create_file("map", 0400, zmd->debugfs_dir, zmd, &dmz_map_dump_fops);
+	debugfs_create_u32("fail_ckpt_delta", 0600, zmd->debugfs_dir, &zmd->fail_ckpt_delta);
+}
@@ -0,0 +1,37 @@
+#ifndef _DMZ_STATS_H_
+#define _DMZ_STATS_H_
+
+#include "dmz.h"
+
+/* Bump a per-CPU counter, lock free and cheap enough for the IO path. */
+#define dmz_stat_add(zmd, field, n) this_cpu_add((zmd)->stats->field, (n))
+#define dmz_stat_inc(zmd, field) this_cpu_inc((zmd)->stats->field)
+#define dmz_stat_lat(zmd, type, ns) this_cpu_inc((zmd)->stats->lat[type][dmz_lat_bucket(ns)])
+
+static inline int dmz_lat_bucket(u64 ns) {
+	return ns ? min_t(int, ilog2(ns), DMZ_LAT_BUCKETS - 1) : 0;
+}
+
+static inline void dmz_heat_add(struct dmz_metadata *zmd, unsigned long lba, unsigned long nr_blocks, bool write) {
+	u32 sample = READ_ONCE(zmd->heat_sample);
+	unsigned long region = min_t(unsigned long, lba >> zmd->heat_shift, DMZ_HEAT_NR_REGIONS - 1);
+
+	if (likely(!sample) || this_cpu_inc_return(zmd->heat->seq) % sample)
+		return;
+
+	// Saturate rather than wrap. An update preempted on its CPU may lose an add, the counts are samples anyway.
+	u32 *ctr = write ? &raw_cpu_ptr(zmd->heat)->write[region] : &raw_cpu_ptr(zmd->heat)->read[region];
+	*ctr = nr_blocks >= U32_MAX - *ctr ? U32_MAX : *ctr + nr_blocks;
+}
+
+void dmz_stats_module_init(void);
+void dmz_stats_module_exit(void);
+
+int dmz_stats_init(struct dmz_metadata *zmd);
+void dmz_stats_exit(struct dmz_metadata *zmd);
+void dmz_stats_register(struct dmz_metadata *zmd, const char *name);
+void dmz_stats_unregister(struct dmz_metadata *zmd);
+
+void dmz_stats_sum(struct dmz_metadata *zmd, struct dmz_stats *sum);
+
+#endif
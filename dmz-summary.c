@@ -0,0 +1,296 @@
+#include "dmz-summary.h"
+#include <linux/crc32.h>
+
+// zones whose summaries are read in one batch during a scan
+#define DMZ_SCAN_NR_ZONES 8
+
+static u32 dmz_summary_crc(struct dmz_summary *sum) {
+	u32 saved = sum->crc, crc;
+
+	sum->crc = 0;
+	crc = crc32_le(~0, (unsigned char *)sum, DMZ_BLOCK_SIZE);
+	sum->crc = saved;
+
+	return crc;
+}
+
+void dmz_summary_clear(struct dmz_zone *zone) {
+	memset(zone->summary, 0xff, DMZ_BLOCK_SIZE);
+}
+
+/**
+ * @brief Record that nr blocks from lba were written at pba, all with sequence seq. Blocks must not cross a segment.
+ * Caller holds the zone io lock.
+ */
+void dmz_summary_add(struct dmz_metadata *zmd, unsigned long pba, unsigned long lba, unsigned long nr, u64 seq) {
+	struct dmz_zone *zone = &zmd->zone_start[pba >> DMZ_ZONE_NR_BLOCKS_SHIFT];
+	unsigned long offset = pba & DMZ_SEG_NR_BLOCKS_MASK;
+
+	for (unsigned long i = 0; i < nr; i++) {
+		zone->summary->entries[offset + i].lba = lba + i;
+		zone->summary->entries[offset + i].seq = seq;
+	}
+}
+
+/**
+ * @brief Close the segment wp sits at the end of: stamp its summary and move wp past it.
+ * The summary itself is written by dmz_summary_submit or dmz_summary_write. Caller holds the zone io lock.
+ */
+void dmz_summary_seal(struct dmz_metadata *zmd, int idx) {
+	struct dmz_zone *zone = &zmd->zone_start[idx];
+	struct dmz_summary *sum = zone->summary;
+
+	sum->magic = DMZ_SUMMARY_MAGIC;
+	sum->pba = ((unsigned long)idx << DMZ_ZONE_NR_BLOCKS_SHIFT) + zone->wp;
+	sum->crc = dmz_summary_crc(sum);
+
+	dmz_map_change_begin(zmd);
+	zone->wp++;
+	dmz_map_change_end(zmd);
+}
+
+static struct bio *dmz_summary_bio(struct dmz_metadata *zmd, struct dmz_zone *zone) {
+	struct bio *bio = bio_alloc(GFP_NOIO, 1);
+
+	dmz_bio_set_pba(zmd, bio, zone->summary->pba);
+	bio_set_op_attrs(bio, REQ_OP_WRITE, REQ_SYNC | REQ_META);
+	dmz_stat_inc(zmd, dev_write_blocks);
+	bio_add_page(bio, virt_to_page(zone->summary), DMZ_BLOCK_SIZE, offset_in_page(zone->summary));
+
+	return bio;
+}
+
+static void dmz_summary_endio(struct bio *bio) {
+	struct dmz_zone *zone = bio->bi_private;
+	struct dmz_metadata *zmd = zone->zmd;
+
+	// Only a scan would miss it, the mapping itself lives in the journal and checkpoints.
+	if (bio->bi_status)
+		pr_err("Summary write at 0x%llx failed. Err: %d", zone->summary->pba, bio->bi_status);
+
+	dmz_summary_clear(zone);
+	dmz_complete_io(zmd, zone - zmd->zone_start);
+
+	bio_put(bio);
+}
+
+static void dmz_summary_work(struct work_struct *work) {
+	struct dmz_zone *zone = container_of(work, struct dmz_zone, summary_work);
+	struct bio *bio = dmz_summary_bio(zone->zmd, zone);
+
+	bio->bi_end_io = dmz_summary_endio;
+	bio->bi_private = zone;
+	submit_bio(bio);
+}
+
+/**
+ * @brief Write the sealed summary after the data clone that completed the segment. Called from its endio,
+ * the zone io lock is handed over and released once the summary is written, so it lands right behind the data.
+ */
+void dmz_summary_submit(struct dmz_metadata *zmd, int idx) {
+	struct dmz_zone *zone = &zmd->zone_start[idx];
+
+	queue_work(zone->write_wq, &zone->summary_work);
+}
+
+/**
+ * @brief Seal and synchronously write the summary of the segment wp sits at the end of. Caller holds the zone io lock.
+ *
+ * @return int (0 is all ok, !0 indicates corresponding errors.)
+ */
+int dmz_summary_write(struct dmz_metadata *zmd, int idx) {
+	struct dmz_zone *zone = &zmd->zone_start[idx];
+	int ret;
+
+	dmz_summary_seal(zmd, idx);
+
+	struct bio *bio = dmz_summary_bio(zmd, zone);
+	ret = dmz_submit_bio_sync(zmd, bio);
+	bio_put(bio);
+	if (ret)
+		pr_err("Summary write at 0x%llx failed. Err: %d", zone->summary->pba, ret);
+
+	dmz_summary_clear(zone);
+
+	return ret;
+}
+
+void dmz_summary_init_zone(struct dmz_metadata *zmd, struct dmz_zone *zone) {
+	zone->zmd = zmd;
+	INIT_WORK(&zone->summary_work, dmz_summary_work);
+	dmz_summary_clear(zone);
+}
+
+static bool dmz_summary_valid(struct dmz_summary *sum, unsigned long pba) {
+	return sum->magic == DMZ_SUMMARY_MAGIC && sum->pba == pba && sum->crc == dmz_summary_crc(sum);
+}
+
+/* Keep the copy of each lba with the highest sequence. reverse_mt of the lba slot holds that sequence meanwhile. */
+static void dmz_scan_apply(struct dmz_metadata *zmd, struct dmz_summary *sum, u64 *max_seq) {
+	struct dmz_zone *zone = zmd->zone_start;
+	unsigned long seg_start = sum->pba - DMZ_SEG_NR_DATA_BLOCKS;
+
+	for (int i = 0; i < DMZ_SEG_NR_DATA_BLOCKS; i++) {
+		struct dmz_summary_entry *e = &sum->entries[i];
+		if (e->lba >= zmd->nr_blocks)
+			continue;
+
+		struct dmz_zone *lzone = &zone[e->lba >> DMZ_ZONE_NR_BLOCKS_SHIFT];
+		unsigned long offset = e->lba & DMZ_ZONE_NR_BLOCKS_MASK;
+		if (!dmz_is_default_pba(lzone->mt[offset].block_id) && lzone->reverse_mt[offset].block_id >= e->seq)
+			continue;
+
+		lzone->mt[offset].block_id = seg_start + i;
+		lzone->reverse_mt[offset].block_id = e->seq;
+		*max_seq = max_t(u64, *max_seq, e->seq);
+	}
+}
+
+/* Turn the scanned mapping into reverse mapping, bitmap and weights. */
+static void dmz_scan_finish(struct dmz_metadata *zmd) {
+	struct dmz_zone *zone = zmd->zone_start;
+
+	for (int i = 0; i < zmd->nr_zones; i++)
+		for (int j = 0; j < zmd->zone_nr_blocks; j++)
+			zone[i].reverse_mt[j].block_id = ~0;
+
+	for (unsigned long lba = 0; lba < zmd->nr_blocks; lba++) {
+		unsigned long pba = dmz_get_map(zmd, lba);
+		if (dmz_is_default_pba(pba))
+			continue;
+
+		struct dmz_zone *pzone = &zone[pba >> DMZ_ZONE_NR_BLOCKS_SHIFT];
+		pzone->reverse_mt[pba & DMZ_ZONE_NR_BLOCKS_MASK].block_id = lba;
+		dmz_set_bit(zmd, pba);
+		pzone->weight++;
+	}
+}
+
+/**
+ * @brief Rebuild the whole mapping from segment summaries, without any checkpoint. Segments below the device
+ * write pointer reported at load are read, zones without one are scanned whole. Summaries of
+ * DMZ_SCAN_NR_ZONES zones are read at once, with every read in flight.
+ * A zone whose last segment has no summary yet can't be attributed, it is treated as full until reclaimed.
+ *
+ * @return int (number of valid summaries found, <0 on errors.)
+ */
+int dmz_scan_metadata(struct dmz_metadata *zmd) {
+	struct dmz_zone *zone = zmd->zone_start;
+	unsigned long nr_segs = zmd->zone_nr_blocks >> DMZ_SEG_NR_BLOCKS_SHIFT;
+	struct dmz_meta_batch batch;
+	struct blk_plug plug;
+	u64 max_seq = 0;
+	int nr_valid = 0, ret;
+
+	struct dmz_summary *buf = kvmalloc((DMZ_SCAN_NR_ZONES * nr_segs) << DMZ_BLOCK_SHIFT, GFP_KERNEL);
+	if (!buf)
+		return -ENOMEM;
+
+	for (int start = zmd->nr_meta_zones; start < zmd->nr_zones; start += DMZ_SCAN_NR_ZONES) {
+		int end = min_t(int, start + DMZ_SCAN_NR_ZONES, zmd->nr_zones);
+
+		dmz_meta_batch_init(zmd, &batch);
+		batch.bdev = zmd->target_bdev;
+		blk_start_plug(&plug);
+		for (int i = start; i < end; i++) {
+			for (unsigned long s = 0; s < zone[i].dev_wp >> DMZ_SEG_NR_BLOCKS_SHIFT; s++) {
+				unsigned long pba = ((unsigned long)i << DMZ_ZONE_NR_BLOCKS_SHIFT) + (s << DMZ_SEG_NR_BLOCKS_SHIFT) + DMZ_SEG_NR_DATA_BLOCKS;
+				dmz_meta_batch_submit(zmd, &batch, REQ_OP_READ, 0, pba, &buf[(i - start) * nr_segs + s], 1);
+			}
+		}
+		blk_finish_plug(&plug);
+
+		ret = dmz_meta_batch_wait(&batch);
+		if (ret) {
+			pr_err("Summary read failed.\n");
+			goto out;
+		}
+
+		for (int i = start; i < end; i++) {
+			unsigned long last = 0;
+
+			for (unsigned long s = 0; s < zone[i].dev_wp >> DMZ_SEG_NR_BLOCKS_SHIFT; s++) {
+				struct dmz_summary *sum = &buf[(i - start) * nr_segs + s];
+				unsigned long pba = ((unsigned long)i << DMZ_ZONE_NR_BLOCKS_SHIFT) + (s << DMZ_SEG_NR_BLOCKS_SHIFT) + DMZ_SEG_NR_DATA_BLOCKS;
+				if (!dmz_summary_valid(sum, pba))
+					continue;
+
+				dmz_scan_apply(zmd, sum, &max_seq);
+				last = s + 1;
+				nr_valid++;
+			}
+
+			if (zone[i].dev_wp & DMZ_SEG_NR_BLOCKS_MASK)
+				zone[i].wp = zmd->zone_nr_blocks;
+			else if (DMZ_IS_SEQ(&zone[i]))
+				zone[i].wp = zone[i].dev_wp;
+			else
+				zone[i].wp = last << DMZ_SEG_NR_BLOCKS_SHIFT;
+		}
+	}
+
+	dmz_scan_finish(zmd);
+	dmz_reclaim_pick_reserved(zmd);
+
+	atomic64_set(&zmd->write_seq, max_seq + DMZ_SEQ_MOUNT_GAP);
+	ret = nr_valid;
+
+	pr_info("Scan found %d summaries.\n", nr_valid);
+
+out:
+	kvfree(buf);
+	return ret;
+}
+
+/**
+ * @brief Check that every zoned device is listed at the position of the volume it was written at. A summary records
+ * the pba it was written to, so the first valid one on a device must be where the layout puts it now, and none
+ * may show up where the layout puts checkpoints and journal. A device without any sealed segment holds nothing
+ * that could be misplaced. The kernel has no generic serial number of block devices to compare instead.
+ *
+ * @return int (0 is all ok, -EINVAL if the devices are not in the order of the volume, <0 on read errors.)
+ */
+int dmz_summary_check_devs(struct dmz_metadata *zmd) {
+	struct dmz_devs *devs = zmd->devs;
+	struct dmz_zone *zone = zmd->zone_start;
+	struct dmz_meta_batch batch;
+	int ret = 0;
+
+	struct dmz_summary *sum = (struct dmz_summary *)__get_free_page(GFP_KERNEL);
+	if (!sum)
+		return -ENOMEM;
+
+	for (unsigned int d = 0; d < devs->nr; d++) {
+		long z;
+
+		for (unsigned long dev_zone = 0; (z = dmz_dev_zone(devs, d, dev_zone)) >= 0; dev_zone++) {
+			unsigned long pba = ((unsigned long)z << DMZ_ZONE_NR_BLOCKS_SHIFT) + DMZ_SEG_NR_DATA_BLOCKS;
+
+			if (!DMZ_IS_SEQ(&zone[z]) || zone[z].cond == BLK_ZONE_COND_OFFLINE || zone[z].dev_wp < DMZ_SEG_NR_BLOCKS)
+				continue;
+
+			dmz_meta_batch_init(zmd, &batch);
+			batch.bdev = zmd->target_bdev;
+			dmz_meta_batch_submit(zmd, &batch, REQ_OP_READ, 0, pba, sum, 1);
+			ret = dmz_meta_batch_wait(&batch);
+			if (ret) {
+				pr_err("Summary read of zone %ld failed.\n", z);
+				goto out;
+			}
+
+			if (sum->magic != DMZ_SUMMARY_MAGIC || sum->crc != dmz_summary_crc(sum))
+				continue;
+			if (z >= zmd->nr_meta_zones && sum->pba == pba)
+				break;
+
+			pr_err("Zoned device %u holds at zone %lu the data of volume zone %llu, not %ld: devices are listed in another order.\n", d, dev_zone,
+			       sum->pba >> DMZ_ZONE_NR_BLOCKS_SHIFT, z);
+			ret = -EINVAL;
+			goto out;
+		}
+	}
+
+out:
+	free_page((unsigned long)sum);
+	return ret;
+}
@@ -0,0 +1,22 @@
+#ifndef _DMZ_SUMMARY_H_
+#define _DMZ_SUMMARY_H_
+
+#include "dmz.h"
+
+/*
+ * Write sequence handed out after a mount starts this far above the last persisted one, so it
+ * stays above every summary written after the last checkpoint.
+ */
+#define DMZ_SEQ_MOUNT_GAP (1ULL << 32)
+
+void dmz_summary_init_zone(struct dmz_metadata *zmd, struct dmz_zone *zone);
+void dmz_summary_clear(struct dmz_zone *zone);
+void dmz_summary_add(struct dmz_metadata *zmd, unsigned long pba, unsigned long lba, unsigned long nr, u64 seq);
+void dmz_summary_seal(struct dmz_metadata *zmd, int zone);
+void dmz_summary_submit(struct dmz_metadata *zmd, int zone);
+int dmz_summary_write(struct dmz_metadata *zmd, int zone);
+
+int dmz_scan_metadata(struct dmz_metadata *zmd);
+int dmz_summary_check_devs(struct dmz_metadata *zmd);
+
+#endif
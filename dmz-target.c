@@ -1,109 +1,61 @@
 #include "dmz.h"
-
-#define BIO_IS_FLUSH(bio) (bio_op(bio) == REQ_OP_FLUSH)
-
-static unsigned tgt_zone = 0;
+#include "dmz-trace.h"
 
 enum { DMZ_BLK_FREE, DMZ_BLK_VALID, DMZ_BLK_INVALID };
 enum { DMZ_UNMAPPED, DMZ_MAPPED };
 
-struct dmz_bioctx {
-	struct bio *bio;
-	refcount_t ref;
-	struct mutex submit_done_lock;
-	int submit_done;
-};
-
 struct dmz_clone_bioctx {
 	struct dmz_bioctx *bioctx;
 	struct dmz_target *dmz;
 	unsigned long lba;
 	unsigned long new_pba;
 	unsigned long nr_blocks; // Read/Write Size
+	int summary; // clone completes its segment, the summary write releases the zone
+	int inplace; // overwrite of cached blocks, the mapping does not change
 };
 
-static inline void dmz_bio_submit_on(struct dmz_bioctx *ctx) {
-	mutex_lock(&ctx->submit_done_lock);
-}
-
-static inline void dmz_bio_submit_off(struct dmz_bioctx *ctx) {
-	mutex_unlock(&ctx->submit_done_lock);
-}
-
-static inline int next_tgt_zone(struct dmz_metadata *zmd) {
-	unsigned int nr = (unsigned int)zmd->nr_zones;
-	tgt_zone++;
-	tgt_zone %= nr;
-	if (tgt_zone == RESERVED_ZONE_ID)
-		tgt_zone++;
-	tgt_zone %= nr;
-	return tgt_zone;
-}
-
 /**
- * @brief func need hold meta_lock
- * make
- * 
- * @param dmz 
- * @param nblocks 
- * @param result 
- * @return{int} zone 
+ * @brief No zone takes writes. Called by dmz_alloc_zone with the reclaim lock held, which is dropped meanwhile.
+ * Freed zones on their way back are waited for rather than reclaiming everything, otherwise every zone is queued
+ * for reclaim.
+ *
+ * @return int (0 to look for a zone again, -ENOSPC if the volume is full.)
  */
-int dmz_pba_alloc_n(struct dmz_target *dmz, int nblocks) {
+int dmz_alloc_stall(struct dmz_target *dmz) {
 	struct dmz_metadata *zmd = dmz->zmd;
-	struct dmz_zone *zone = zmd->zone_start;
-	int cnt = 1;
-
-	dmz_lock_reclaim(zmd);
 
-	int ret = tgt_zone;
-	// This process probablly result in reclaim process blocked.
-	dmz_start_io(zmd, tgt_zone);
-
-	while (zone[tgt_zone].wp == zmd->zone_nr_blocks || tgt_zone == RESERVED_ZONE_ID) {
-		dmz_complete_io(zmd, tgt_zone);
-
-		if (cnt == zmd->nr_zones) {
-			if (dmz_is_full(zmd))
-				return ~0;
-
-			dmz_unlock_reclaim(zmd);
-			for (int i = 0; i < zmd->nr_zones; i++) {
-				struct dmz_reclaim_work *rcw = kzalloc(sizeof(struct dmz_reclaim_work), GFP_KERNEL);
-				if (rcw) {
-					rcw->bdev = zmd->target_bdev;
-					rcw->zone = i;
-					rcw->dmz = dmz;
-					INIT_WORK(&rcw->work, dmz_reclaim_work_process);
-					queue_work(zmd->reclaim_wq, &rcw->work);
-				} else {
-					pr_err("Mem not enough for reclaim.");
-				}
-				udelay(100);
-			}
-
-			dmz_lock_reclaim(zmd);
-		}
-
-		ret = next_tgt_zone(zmd); // function will inc tgt_zone too.
-		cnt++;
-		dmz_start_io(zmd, tgt_zone);
+	if (atomic_read(&zmd->nr_resets)) {
+		dmz_unlock_reclaim(zmd);
+		dmz_wait_resets(zmd);
+		dmz_lock_reclaim(zmd);
+		return 0;
 	}
 
-	next_tgt_zone(zmd);
+	if (dmz_is_full(zmd))
+		return -ENOSPC;
 
 	dmz_unlock_reclaim(zmd);
+	for (int i = 0; i < zmd->nr_zones; i++) {
+		dmz_reclaim_queue(dmz, i);
+		udelay(100);
+	}
+	dmz_lock_reclaim(zmd);
 
-	return ret;
+	return 0;
 }
 
-unsigned long dmz_get_map(struct dmz_metadata *zmd, unsigned long lba) {
-	unsigned long index = lba >> DMZ_ZONE_NR_BLOCKS_SHIFT;
-	unsigned long offset = lba & DMZ_ZONE_NR_BLOCKS_MASK;
+/* Zone a write of nblocks appends to, locked for io, see dmz_alloc_zone. */
+int dmz_pba_alloc_n(struct dmz_target *dmz, int nblocks) {
+	struct dmz_metadata *zmd = dmz->zmd;
+	u64 start = ktime_get_ns();
+
+	int ret = dmz_alloc_zone(dmz);
 
-	struct dmz_zone *cur_zone = zmd->zone_start + index;
+	u64 wait = ktime_get_ns() - start;
+	dmz_stat_lat(zmd, DMZ_LAT_ALLOC, wait);
+	trace_dmz_alloc(ret, nblocks, wait);
 
-	return cur_zone->mt[offset].block_id;
+	return ret;
 }
 
 // map logic to physical. if unmapped, return 0xffff ffff ffff ffff(default reserved blk_id representing invalid)
@@ -118,75 +70,56 @@ unsigned long dmz_l2p(struct dmz_target *dmz, sector_t lba) {
 	return pba;
 }
 
-void dmz_bio_try_endio(struct dmz_bioctx *bioctx, struct bio *bio, blk_status_t status) {
-	dmz_bio_submit_on(bioctx);
-	int able_to_end = bioctx->submit_done;
-	dmz_bio_submit_off(bioctx);
+/**
+ * @brief Drop one reference of the bio, recording status if it is an error. The last one completes the bio:
+ * data is written and its mapping logged, FLUSH and FUA bios complete once the log is durable.
+ */
+void dmz_bioctx_put(struct dmz_bioctx *bioctx, blk_status_t status) {
+	if (status != BLK_STS_OK)
+		WRITE_ONCE(bioctx->status, status);
 
-	if (!able_to_end)
+	if (!atomic_dec_and_test(&bioctx->ref))
 		return;
 
-	if (!refcount_dec_if_one(&bioctx->ref))
-		return;
+	struct bio *bio = dm_bio_from_per_bio_data(bioctx, sizeof(struct dmz_bioctx));
+	if (op_is_flush(bio->bi_opf) && bioctx->status == BLK_STS_OK)
+		dmz_journal_defer_bio(bioctx->zmd, bio);
+	else
+		dmz_bioctx_endio(bioctx, bioctx->status);
+}
 
-	if (status != BLK_STS_OK)
-		bio->bi_status = status;
+/* Complete the bio of bioctx, accounting its latency from dmz_map on. */
+void dmz_bioctx_endio(struct dmz_bioctx *bioctx, blk_status_t status) {
+	struct bio *bio = dm_bio_from_per_bio_data(bioctx, sizeof(struct dmz_bioctx));
+	u64 lat = ktime_get_ns() - bioctx->start_ns;
+
+	if (bioctx->lat_type != DMZ_LAT_NONE)
+		dmz_stat_lat(bioctx->zmd, bioctx->lat_type, lat);
+	trace_dmz_bio_endio(bio, status, lat);
 
+	bio->bi_status = status;
 	bio_endio(bio);
-	kfree(bioctx);
 }
 
 void dmz_update_map(struct dmz_target *dmz, unsigned long lba, unsigned long pba) {
 	// pr_err("<WRITE-UPDATE-MAP> lba: 0x%lx pba: 0x%lx\n", lba, pba);
-	struct dmz_metadata *zmd = dmz->zmd;
-	struct dmz_zone *z = zmd->zone_start;
-	int index = lba >> DMZ_ZONE_NR_BLOCKS_SHIFT;
-	int offset = lba & DMZ_ZONE_NR_BLOCKS_MASK;
-
-	struct dmz_zone *cur_zone = &zmd->zone_start[index];
-	unsigned long old_pba = cur_zone->mt[offset].block_id;
-	cur_zone->mt[offset].block_id = pba;
-
-	int p_index = pba >> DMZ_ZONE_NR_BLOCKS_SHIFT;
-	int p_offset = pba & DMZ_ZONE_NR_BLOCKS_MASK;
-	struct dmz_zone *p_zone = &zmd->zone_start[p_index];
-	p_zone->reverse_mt[p_offset].block_id = lba;
-
-	if (!dmz_is_default_pba(old_pba)) {
-		int old_p_index = old_pba >> DMZ_ZONE_NR_BLOCKS_SHIFT;
-		int old_p_offset = old_pba & DMZ_ZONE_NR_BLOCKS_MASK;
-		struct dmz_zone *old_p_zone = &zmd->zone_start[old_p_index];
-		old_p_zone->reverse_mt[old_p_offset].block_id = ~0;
-	}
-
-	// update bitmap
-
-	if (!dmz_is_default_pba(old_pba)) {
-		dmz_clear_bit(zmd, old_pba);
-
-		int old_p_index = old_pba >> DMZ_ZONE_NR_BLOCKS_SHIFT;
-		z[old_p_index].weight--;
-	}
-
-	dmz_set_bit(zmd, pba);
-	z[p_index].weight++;
+	dmz_journal_update_map(dmz->zmd, lba, pba);
 }
 
-void dmz_submit_clone_bio(struct dmz_metadata *zmd, struct bio *clone, int idx, int remain_nr) {
+void dmz_submit_clone_bio(struct dmz_metadata *zmd, struct bio *clone) {
 	struct dmz_clone_bioctx *clone_ctx = clone->bi_private;
-	struct dmz_bioctx *ctx = clone_ctx->bioctx;
 
-	dmz_bio_submit_on(ctx);
-	if (!remain_nr) {
-		ctx->submit_done = 1;
-	}
+	atomic_inc(&clone_ctx->bioctx->ref);
+	trace_dmz_clone_submit(bio_op(clone), clone_ctx->lba, clone_ctx->new_pba, clone_ctx->nr_blocks, 0);
 	submit_bio(clone);
-	dmz_bio_submit_off(ctx);
 }
 
 void dmz_put_clone_bio(struct dmz_metadata *zmd, struct bio *clone, int idx) {
 	struct dmz_clone_bioctx *clone_ctx = clone->bi_private;
-	dmz_complete_io(zmd, idx);
+	if (clone_ctx->summary)
+		dmz_summary_submit(zmd, idx);
+	else
+		dmz_complete_io(zmd, idx);
 	kfree(clone_ctx);
 	bio_put(clone);
 }
@@ -198,30 +131,21 @@ void dmz_read_clone_endio(struct bio *clone) {
 	struct dmz_metadata *zmd = dmz->zmd;
 	struct dmz_bioctx *bioctx = clone_bioctx->bioctx;
 	unsigned idx = clone_bioctx->new_pba >> DMZ_ZONE_NR_BLOCKS_SHIFT;
-	// pr_info("<dmz_read_clone_endio>");
 
-	refcount_dec(&bioctx->ref);
-
-	if (status != BLK_STS_OK) {
-		bioctx->bio->bi_status = status;
-	}
-
-	dmz_bio_try_endio(bioctx, bioctx->bio, status);
+	trace_dmz_clone_endio(REQ_OP_READ, clone_bioctx->lba, clone_bioctx->new_pba, clone_bioctx->nr_blocks, status);
 
 	dmz_put_clone_bio(zmd, clone, idx);
-}
-
-void dmz_handle_read_zero(struct bio *bio, unsigned int nr_blocks) {
-	unsigned int size = nr_blocks << DMZ_BLOCK_SHIFT;
 
-	/* Clear nr_blocks */
-	swap(bio->bi_iter.bi_size, size);
-	zero_fill_bio(bio);
-	swap(bio->bi_iter.bi_size, size);
+	dmz_bioctx_put(bioctx, status);
+}
 
-	bio_advance(bio, size);
+/* Zero nr_blocks of bio at iter, the bio's own iterator is left alone. */
+void dmz_handle_read_zero(struct bio *bio, struct bvec_iter iter, unsigned int nr_blocks) {
+	struct bio_vec bv;
 
-	pr_err("<READ ZERO>");
+	iter.bi_size = nr_blocks << DMZ_BLOCK_SHIFT;
+	__bio_for_each_segment(bv, bio, iter, iter)
+		zero_user(bv.bv_page, bv.bv_offset, bv.bv_len);
 }
 
 int dmz_submit_read_bio(struct dmz_target *dmz, struct bio *bio, struct dmz_bioctx *bioctx) {
@@ -230,19 +154,15 @@ int dmz_submit_read_bio(struct dmz_target *dmz, struct bio *bio, struct dmz_bioc
 	struct dmz_metadata *zmd = dmz->zmd;
 
 	unsigned long lba = bio->bi_iter.bi_sector >> DMZ_BLOCK_SECTORS_SHIFT;
+	struct bvec_iter iter = bio->bi_iter;
 
 	dmz_lock_reclaim(zmd);
 
 	while (nr_blocks) {
-		int ret = 0;
 		unsigned long pba = dmz_l2p(dmz, lba);
 
 		if (dmz_is_default_pba(pba)) {
-			dmz_handle_read_zero(bio, 1);
-			if (!(nr_blocks - 1)) {
-				bio_endio(bio);
-				// FIXME Under such case, bioctx can't be freed resulting in memory leak.
-			}
+			dmz_handle_read_zero(bio, iter, 1);
 			goto post_iter;
 		}
 
@@ -254,31 +174,28 @@ int dmz_submit_read_bio(struct dmz_target *dmz, struct bio *bio, struct dmz_bioc
 
 		struct dmz_clone_bioctx *clone_bioctx = kzalloc(sizeof(struct dmz_clone_bioctx), GFP_KERNEL);
 		if (!clone_bioctx) {
-			kfree(clone_bio);
+			bio_put(clone_bio);
 			ret = -ENOMEM;
 			goto out;
 		}
 
-		bio_set_dev(clone_bio, zmd->target_bdev);
-
 		clone_bioctx->bioctx = bioctx;
 		clone_bioctx->dmz = dmz;
 		clone_bioctx->lba = lba;
 		clone_bioctx->new_pba = pba; // unlock process will need it.
 		clone_bioctx->nr_blocks = 1;
 
-		clone_bio->bi_iter.bi_sector = pba << DMZ_BLOCK_SECTORS_SHIFT;
+		clone_bio->bi_iter = iter;
+		dmz_bio_set_pba(zmd, clone_bio, pba);
 		clone_bio->bi_iter.bi_size = DMZ_BLOCK_SIZE;
 		clone_bio->bi_end_io = dmz_read_clone_endio;
 		clone_bio->bi_private = clone_bioctx;
 
-		refcount_inc(&bioctx->ref);
-
 		dmz_start_io(zmd, pba >> DMZ_ZONE_NR_BLOCKS_SHIFT);
-		dmz_submit_clone_bio(zmd, clone_bio, pba >> DMZ_ZONE_NR_BLOCKS_SHIFT, nr_blocks - 1);
-		bio_advance(bio, clone_bio->bi_iter.bi_size);
+		dmz_submit_clone_bio(zmd, clone_bio);
 
 	post_iter:
+		bio_advance_iter(bio, &iter, DMZ_BLOCK_SIZE);
 		lba++;
 		nr_blocks--;
 	}
@@ -320,14 +237,15 @@ void dmz_write_clone_endio(struct bio *clone) {
 
 	struct bio *resubmit_bio = NULL;
 
-	refcount_dec(&bioctx->ref);
+	trace_dmz_clone_endio(REQ_OP_WRITE, clone_bioctx->lba, clone_bioctx->new_pba, nr_blocks, status);
 
 	// if write op succeeds, update mapping. (validate wp and invalidate old_pba if old_pba exists.)
-	if (status == BLK_STS_OK) {
+	if (status == BLK_STS_OK && clone_bioctx->inplace) {
+		atomic_inc(&zmd->journal.nr_inplace);
+	} else if (status == BLK_STS_OK) {
 		for (int i = 0; i < nr_blocks; i++)
 			dmz_update_map(dmz, clone_bioctx->lba + i, clone_bioctx->new_pba + i);
 	} else {
-		bioctx->bio->bi_status = status;
 		pr_err("Errno %d\n", status);
 		goto resubmit;
 	}
@@ -336,24 +254,13 @@ end_clone:
 	index = clone_bioctx->new_pba >> DMZ_ZONE_NR_BLOCKS_SHIFT;
 	offset = clone_bioctx->new_pba & DMZ_ZONE_NR_BLOCKS_MASK;
 
-	// When zone is full start reclaim
-	if (offset + nr_blocks == zmd->zone_nr_blocks) {
-		// Start Reclaim.
-		struct dmz_reclaim_work *rcw = kzalloc(sizeof(struct dmz_reclaim_work), GFP_KERNEL);
-		if (rcw) {
-			rcw->bdev = zmd->target_bdev;
-			rcw->zone = index;
-			rcw->dmz = dmz;
-			INIT_WORK(&rcw->work, dmz_reclaim_work_process);
-			queue_work(zmd->reclaim_wq, &rcw->work);
-		} else {
-			pr_err("Mem not enough for reclaim.");
-		}
-	}
-
-	dmz_bio_try_endio(bioctx, bioctx->bio, status);
+	// When zone is full start reclaim, destage for a cache zone. The last block of the zone is a summary.
+	if (!clone_bioctx->inplace && offset + nr_blocks == zmd->zone_nr_blocks - 1)
+		dmz_zone_filled(dmz, index);
 
 	dmz_put_clone_bio(zmd, clone, index);
+
+	dmz_bioctx_put(bioctx, status);
 	return;
 
 resubmit:
@@ -361,10 +268,9 @@ resubmit:
 	resubmit_bio = bio_clone_fast(clone, GFP_KERNEL, NULL);
 	if (!resubmit_bio)
 		goto resubmit;
-	resubmit_bio->bi_iter.bi_sector = clone_bioctx->new_pba << DMZ_BLOCK_SECTORS_SHIFT;
+	dmz_bio_set_pba(zmd, resubmit_bio, clone_bioctx->new_pba);
 	resubmit_bio->bi_iter.bi_size = nr_blocks << DMZ_BLOCK_SHIFT;
 
-	bio_set_dev(resubmit_bio, zmd->target_bdev);
 	submit_bio_wait(resubmit_bio);
 	pr_info("Waiting End %s\n", resubmit_bio->bi_status ? "Fail" : "Succ");
 	if (resubmit_bio->bi_status)
@@ -379,30 +285,26 @@ int dmz_submit_write_bio(struct dmz_target *dmz, struct bio *bio, struct dmz_bio
 	struct dmz_metadata *zmd = dmz->zmd;
 	struct dmz_zone *zone = zmd->zone_start;
 
-	if (!nr_sectors) {
-		goto flush;
-	}
-
 	if (nr_sectors & 0x7 || bio->bi_iter.bi_sector & 0x7) {
 		goto not_aligned;
 	}
 
 	unsigned long lba = bio->bi_iter.bi_sector >> DMZ_BLOCK_SECTORS_SHIFT;
+	struct bvec_iter iter = bio->bi_iter;
+	// Small bios go to the conventional zone cache, if the device has one.
+	bool cache = dmz_cache_write(zmd, nr_blocks);
 
 	while (nr_blocks) {
-		int ret = 0;
 		unsigned long pba;
+		int blk_num, inplace;
 
-		int rzone = dmz_pba_alloc_n(dmz, nr_blocks);
+		int rzone = dmz_write_place(dmz, lba, nr_blocks, cache, &pba, &blk_num, &inplace);
 		if (dmz_is_default_pba(rzone)) {
 			ret = -ENOSPC;
 			goto out;
 		}
-
-		int blk_num = min((int)(zmd->zone_nr_blocks - zone[rzone].wp), nr_blocks);
-
-		pba = zone[rzone].wp + (rzone << DMZ_ZONE_NR_BLOCKS_SHIFT);
-		zone[rzone].wp += blk_num;
+		if (!inplace)
+			dmz_summary_add(zmd, pba, lba, blk_num, atomic64_inc_return(&zmd->write_seq));
 
 		struct bio *clone_bio = bio_clone_fast(bio, GFP_KERNEL, NULL);
 		if (!clone_bio) {
@@ -412,26 +314,30 @@ int dmz_submit_write_bio(struct dmz_target *dmz, struct bio *bio, struct dmz_bio
 
 		struct dmz_clone_bioctx *clone_bioctx = kzalloc(sizeof(struct dmz_clone_bioctx), GFP_KERNEL);
 		if (!clone_bioctx) {
-			kfree(clone_bio);
+			bio_put(clone_bio);
 			ret = -ENOMEM;
 			goto out;
 		}
 
-		bio_set_dev(clone_bio, zmd->target_bdev);
+		// Durability comes from the group commit at completion, not from flushing the device per write.
+		clone_bio->bi_opf &= ~(REQ_PREFLUSH | REQ_FUA);
 
 		clone_bioctx->bioctx = bioctx;
 		clone_bioctx->dmz = dmz;
 		clone_bioctx->lba = lba;
 		clone_bioctx->new_pba = pba;
 		clone_bioctx->nr_blocks = blk_num;
+		clone_bioctx->inplace = inplace;
+		clone_bioctx->summary = !inplace && !dmz_wp_seg_left(zone[rzone].wp);
+		if (clone_bioctx->summary)
+			dmz_summary_seal(zmd, rzone);
 
-		clone_bio->bi_iter.bi_sector = pba << DMZ_BLOCK_SECTORS_SHIFT;
+		clone_bio->bi_iter = iter;
+		dmz_bio_set_pba(zmd, clone_bio, pba);
 		clone_bio->bi_iter.bi_size = blk_num << DMZ_BLOCK_SHIFT;
 		clone_bio->bi_end_io = dmz_write_clone_endio;
 		clone_bio->bi_private = clone_bioctx;
 
-		refcount_inc(&bioctx->ref);
-
 		// struct dmz_write_work *wrwk = kmalloc(sizeof(struct dmz_write_work), GFP_KERNEL);
 		// if (!wrwk) {
 		// 	kfree(clone_bio);
@@ -445,9 +351,10 @@ int dmz_submit_write_bio(struct dmz_target *dmz, struct bio *bio, struct dmz_bio
 
 		// queue_work(zone[rzone].write_wq, &wrwk->work);
 
-		dmz_submit_clone_bio(zmd, clone_bio, pba >> DMZ_ZONE_NR_BLOCKS_SHIFT, nr_blocks - blk_num);
+		dmz_stat_add(zmd, dev_write_blocks, blk_num);
+		dmz_submit_clone_bio(zmd, clone_bio);
 
-		bio_advance(bio, clone_bio->bi_iter.bi_size);
+		bio_advance_iter(bio, &iter, blk_num << DMZ_BLOCK_SHIFT);
 
 		lba += blk_num;
 		nr_blocks -= blk_num;
@@ -458,16 +365,8 @@ int dmz_submit_write_bio(struct dmz_target *dmz, struct bio *bio, struct dmz_bio
 /** Not supported yet. **/
 not_aligned:
 	pr_err("module require bio aligned to block size.");
-	bio->bi_status = BLK_STS_NOTSUPP;
-	bio_endio(bio);
 	return -EINVAL;
 
-flush:
-	zero_fill_bio(bio);
-	bio->bi_status = BLK_STS_OK;
-	bio_endio(bio);
-	return 0;
-
 /** Error Handling **/
 out:
 	return ret;
@@ -487,7 +386,9 @@ int dmz_handle_discard(struct dmz_target *dmz, struct bio *bio) {
 		if (dmz_is_default_pba(pba)) {
 			// discarding unmapped is invalid
 		} else {
+			dmz_map_change_begin(zmd);
 			dmz_clear_bit(zmd, pba);
+			dmz_map_change_end(zmd);
 			// int index = pba >> DMZ_BLOCK_SHIFT, offset = pba % zmd->zone_nr_blocks;
 			// zone[index].reverse_mt[offset].block_id = ~0;
 			// index = lba >> DMZ_BLOCK_SHIFT, offset = lba % zmd->zone_nr_blocks;
@@ -495,39 +396,51 @@ int dmz_handle_discard(struct dmz_target *dmz, struct bio *bio) {
 		}
 	}
 
-	bio->bi_status = BLK_STS_OK;
-	bio_endio(bio);
-
 	return ret;
 }
 
-/* Map bio */
+/**
+ * @brief Map a bio from dm. Its context lives in the per-bio data and holds one reference per clone in flight
+ * plus one for mapping itself, the bio completes from the endio of whichever drops the last.
+ */
 int dmz_map(struct dmz_target *dmz, struct bio *bio) {
-	// pr_info("Map: bi_sector: %llx\t bi_size: %x\n", bio->bi_iter.bi_sector, bio->bi_iter.bi_size);
-	// pr_info("start_sector: %lld, nr_sectors: %d op: %d\n", bio->bi_iter.bi_sector, bio_sectors(bio), bio_op(bio));
-	struct dmz_bioctx *bioctx = kmalloc(sizeof(struct dmz_bioctx), GFP_KERNEL);
-	int ret = DM_MAPIO_SUBMITTED;
+	struct dmz_metadata *zmd = dmz->zmd;
+	struct dmz_bioctx *bioctx = dm_per_bio_data(bio, sizeof(struct dmz_bioctx));
+	int ret = 0;
 
-	bioctx->bio = bio;
-	refcount_set(&bioctx->ref, 1);
-	mutex_init(&bioctx->submit_done_lock);
-	bioctx->submit_done = 0;
+	bioctx->zmd = dmz->zmd;
+	atomic_set(&bioctx->ref, 1);
+	bioctx->status = BLK_STS_OK;
+	bioctx->start_ns = ktime_get_ns();
+	trace_dmz_map(bio);
 
 	switch (bio_op(bio)) {
 	case REQ_OP_READ:
+		bioctx->lat_type = DMZ_LAT_READ;
+		dmz_stat_add(zmd, host_read_blocks, dmz_sect2blk(bio_sectors(bio)));
+		dmz_heat_add(zmd, dmz_bio_block(bio), dmz_bio_blocks(bio), false);
 		ret = dmz_submit_read_bio(dmz, bio, bioctx);
 		break;
 	case REQ_OP_WRITE:
+		// An empty write is a FLUSH. Every completed write already has its mapping in the journal, it only commits it.
+		bioctx->lat_type = bio_sectors(bio) ? DMZ_LAT_WRITE : DMZ_LAT_FLUSH;
+		if (!bio_sectors(bio))
+			break;
+		dmz_stat_add(zmd, host_write_blocks, dmz_sect2blk(bio_sectors(bio)));
+		dmz_heat_add(zmd, dmz_bio_block(bio), dmz_bio_blocks(bio), true);
 		ret = dmz_submit_write_bio(dmz, bio, bioctx);
 		break;
 	case REQ_OP_DISCARD:
-	case REQ_OP_WRITE_ZEROES:
+		bioctx->lat_type = DMZ_LAT_DISCARD;
 		ret = dmz_handle_discard(dmz, bio);
 		break;
 	default:
-		ret = -EIO;
+		bioctx->lat_type = DMZ_LAT_NONE;
+		ret = -EOPNOTSUPP;
 		break;
 	}
 
-	return ret;
+	dmz_bioctx_put(bioctx, errno_to_blk_status(ret));
+
+	return DM_MAPIO_SUBMITTED;
 }
@@ -0,0 +1,213 @@
+#include "dmz.h"
+#include <kunit/test.h>
+#include <linux/random.h>
+
+/*
+ * KUnit suite of the FTL core: invariants of the mapping and the validity bitmap, and the per-op cost of the
+ * primitives on the IO path. Built as its own module with dmz-ftl.o, see the Makefile.
+ */
+
+#define DMZ_TEST_NR_ZONES 4
+#define DMZ_TEST_NR_OPS (1 << 20)
+
+// ns per op above which a benchmark fails, 0 only reports.
+static unsigned int bench_max_ns;
+module_param(bench_max_ns, uint, 0644);
+MODULE_PARM_DESC(bench_max_ns, "Fail benchmarks slower than this many ns per op (0: report only)");
+
+// Checkpoints are out of scope here, dmz-utils.c is not linked in.
+void dmz_dirty_mt(struct dmz_metadata *zmd, unsigned long lba) {
+}
+
+void dmz_dirty_rmt(struct dmz_metadata *zmd, unsigned long pba) {
+}
+
+void dmz_dirty_bitmap(struct dmz_metadata *zmd, unsigned long pos) {
+}
+
+static void dmz_test_exit(struct kunit *test) {
+	struct dmz_metadata *zmd = test->priv;
+
+	for (int i = 0; zmd->zone_start && i < DMZ_TEST_NR_ZONES; i++) {
+		kvfree(zmd->zone_start[i].mt);
+		kvfree(zmd->zone_start[i].reverse_mt);
+	}
+	kvfree(zmd->bitmap_start);
+}
+
+static int dmz_test_init(struct kunit *test) {
+	struct dmz_metadata *zmd = kunit_kzalloc(test, sizeof(struct dmz_metadata), GFP_KERNEL);
+
+	if (!zmd)
+		return -ENOMEM;
+
+	zmd->nr_zones = DMZ_TEST_NR_ZONES;
+	zmd->zone_nr_blocks = 1 << DMZ_ZONE_NR_BLOCKS_SHIFT;
+	zmd->nr_blocks = DMZ_TEST_NR_ZONES << DMZ_ZONE_NR_BLOCKS_SHIFT;
+	zmd->reserved_zone = DMZ_TEST_NR_ZONES - 1;
+
+	zmd->zone_start = kunit_kzalloc(test, DMZ_TEST_NR_ZONES * sizeof(struct dmz_zone), GFP_KERNEL);
+	zmd->bitmap_start = kvzalloc(zmd->nr_blocks >> 3, GFP_KERNEL);
+	if (!zmd->zone_start || !zmd->bitmap_start)
+		goto err;
+
+	for (int i = 0; i < DMZ_TEST_NR_ZONES; i++) {
+		struct dmz_zone *zone = &zmd->zone_start[i];
+
+		zone->mt = kvmalloc(sizeof(struct dmz_map) << DMZ_ZONE_NR_BLOCKS_SHIFT, GFP_KERNEL);
+		zone->reverse_mt = kvmalloc(sizeof(struct dmz_map) << DMZ_ZONE_NR_BLOCKS_SHIFT, GFP_KERNEL);
+		if (!zone->mt || !zone->reverse_mt)
+			goto err;
+		memset(zone->mt, 0xff, sizeof(struct dmz_map) << DMZ_ZONE_NR_BLOCKS_SHIFT);
+		memset(zone->reverse_mt, 0xff, sizeof(struct dmz_map) << DMZ_ZONE_NR_BLOCKS_SHIFT);
+	}
+
+	test->priv = zmd;
+	return 0;
+
+err:
+	test->priv = zmd;
+	dmz_test_exit(test);
+	return -ENOMEM;
+}
+
+/* Writes of random lbas, appended to zones in order like the allocator does, overwrites included. */
+static void dmz_test_fill(struct dmz_metadata *zmd, unsigned long nr) {
+	unsigned long capacity = (DMZ_TEST_NR_ZONES - 1) << DMZ_ZONE_NR_BLOCKS_SHIFT;
+
+	for (unsigned long pba = 0; pba < nr && pba < capacity; pba++)
+		dmz_set_map(zmd, prandom_u32() % (capacity / 2), pba);
+}
+
+static void dmz_test_map_unmapped(struct kunit *test) {
+	struct dmz_metadata *zmd = test->priv;
+
+	for (unsigned long lba = 0; lba < zmd->nr_blocks; lba += 4099)
+		KUNIT_EXPECT_TRUE(test, dmz_is_default_pba(dmz_get_map(zmd, lba)));
+}
+
+static void dmz_test_bits(struct kunit *test) {
+	struct dmz_metadata *zmd = test->priv;
+	unsigned long pos[] = { 0, 1, 7, 8, 63, 64, (1 << DMZ_ZONE_NR_BLOCKS_SHIFT) - 1, zmd->nr_blocks - 1 };
+
+	for (int i = 0; i < ARRAY_SIZE(pos); i++) {
+		KUNIT_EXPECT_FALSE(test, dmz_test_bit(zmd, pos[i]));
+		dmz_set_bit(zmd, pos[i]);
+		KUNIT_EXPECT_TRUE(test, dmz_test_bit(zmd, pos[i]));
+		// Neighbours stay untouched.
+		if (pos[i])
+			KUNIT_EXPECT_FALSE(test, dmz_test_bit(zmd, pos[i] - 1));
+		if (pos[i] + 1 < zmd->nr_blocks)
+			KUNIT_EXPECT_FALSE(test, dmz_test_bit(zmd, pos[i] + 1));
+		dmz_clear_bit(zmd, pos[i]);
+		KUNIT_EXPECT_FALSE(test, dmz_test_bit(zmd, pos[i]));
+	}
+}
+
+/* mt and reverse_mt are inverse of each other on every valid block, and every mapped lba points at a valid block. */
+static void dmz_test_map_inverse(struct kunit *test) {
+	struct dmz_metadata *zmd = test->priv;
+
+	dmz_test_fill(zmd, 200000);
+
+	for (unsigned long lba = 0; lba < zmd->nr_blocks; lba++) {
+		unsigned long pba = dmz_get_map(zmd, lba);
+
+		if (dmz_is_default_pba(pba))
+			continue;
+		KUNIT_ASSERT_LT(test, pba, zmd->nr_blocks);
+		KUNIT_EXPECT_TRUE(test, dmz_test_bit(zmd, pba));
+		KUNIT_EXPECT_EQ(test, dmz_p2l(zmd, pba), lba);
+	}
+
+	for (unsigned long pba = 0; pba < zmd->nr_blocks; pba++) {
+		if (dmz_test_bit(zmd, pba))
+			KUNIT_EXPECT_EQ(test, dmz_get_map(zmd, dmz_p2l(zmd, pba)), pba);
+		else
+			KUNIT_EXPECT_TRUE(test, dmz_is_default_pba(dmz_p2l(zmd, pba)));
+	}
+}
+
+/* Zone weight is the number of valid blocks in the bitmap, remapping to the same pba counts once. */
+static void dmz_test_weight(struct kunit *test) {
+	struct dmz_metadata *zmd = test->priv;
+
+	dmz_test_fill(zmd, 150000);
+	dmz_set_map(zmd, 0, 150000);
+	dmz_set_map(zmd, 0, 150000);
+
+	for (int i = 0; i < DMZ_TEST_NR_ZONES; i++) {
+		unsigned int weight = 0;
+
+		for (unsigned long b = 0; b < zmd->zone_nr_blocks; b++)
+			weight += dmz_test_bit(zmd, ((unsigned long)i << DMZ_ZONE_NR_BLOCKS_SHIFT) + b);
+		KUNIT_EXPECT_EQ(test, zmd->zone_start[i].weight, weight);
+	}
+}
+
+static void dmz_test_bench_report(struct kunit *test, const char *name, u64 ns) {
+	u64 per_op = div64_u64(ns, DMZ_TEST_NR_OPS);
+
+	kunit_info(test, "%s: %llu ns/op\n", name, per_op);
+	if (bench_max_ns)
+		KUNIT_EXPECT_LE(test, per_op, (u64)bench_max_ns);
+}
+
+/* Per-op cost of the primitives, over a mapped volume and random positions. */
+static void dmz_test_bench(struct kunit *test) {
+	struct dmz_metadata *zmd = test->priv;
+	unsigned long capacity = (DMZ_TEST_NR_ZONES - 1) << DMZ_ZONE_NR_BLOCKS_SHIFT;
+	unsigned long sum = 0;
+	u64 start;
+
+	dmz_test_fill(zmd, capacity);
+
+	start = ktime_get_ns();
+	for (unsigned long i = 0; i < DMZ_TEST_NR_OPS; i++)
+		sum += dmz_get_map(zmd, (i * 7919) % capacity);
+	dmz_test_bench_report(test, "dmz_get_map", ktime_get_ns() - start);
+
+	start = ktime_get_ns();
+	for (unsigned long i = 0; i < DMZ_TEST_NR_OPS; i++)
+		sum += dmz_p2l(zmd, (i * 7919) % capacity);
+	dmz_test_bench_report(test, "dmz_p2l", ktime_get_ns() - start);
+
+	start = ktime_get_ns();
+	for (unsigned long i = 0; i < DMZ_TEST_NR_OPS; i++)
+		sum += dmz_test_bit(zmd, (i * 7919) % capacity);
+	dmz_test_bench_report(test, "dmz_test_bit", ktime_get_ns() - start);
+
+	start = ktime_get_ns();
+	for (unsigned long i = 0; i < DMZ_TEST_NR_OPS; i++)
+		dmz_set_bit(zmd, (i * 7919) % capacity);
+	dmz_test_bench_report(test, "dmz_set_bit", ktime_get_ns() - start);
+
+	// Overwrites: every call invalidates the old copy and validates the new one. Pbas get reused, so the map
+	// is not consistent afterwards, only the cost counts here.
+	start = ktime_get_ns();
+	for (unsigned long i = 0; i < DMZ_TEST_NR_OPS; i++)
+		dmz_set_map(zmd, (i * 7919) % (capacity / 2), i % capacity);
+	dmz_test_bench_report(test, "dmz_set_map", ktime_get_ns() - start);
+
+	// Keep the loops above from being optimized out.
+	KUNIT_EXPECT_NE(test, sum, 0UL);
+}
+
+static struct kunit_case dmz_test_cases[] = {
+	KUNIT_CASE(dmz_test_map_unmapped),
+	KUNIT_CASE(dmz_test_bits),
+	KUNIT_CASE(dmz_test_map_inverse),
+	KUNIT_CASE(dmz_test_weight),
+	KUNIT_CASE(dmz_test_bench),
+	{},
+};
+
+static struct kunit_suite dmz_test_suite = {
+	.name = "dmzoned-ftl",
+	.init = dmz_test_init,
+	.exit = dmz_test_exit,
+	.test_cases = dmz_test_cases,
+};
+kunit_test_suites(&dmz_test_suite);
+
+MODULE_LICENSE("GPL");
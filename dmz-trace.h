@@ -0,0 +1,147 @@
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM dmzoned
+
+#if !defined(_DMZ_TRACE_H_) || defined(TRACE_HEADER_MULTI_READ)
+#define _DMZ_TRACE_H_
+
+#include <linux/tracepoint.h>
+#include <linux/blkdev.h>
+
+/*
+ * Bio lifecycle: dmz_map when dm hands a bio over, dmz_clone_submit/dmz_clone_endio around every clone sent to a
+ * zoned device, dmz_bio_endio when the bio completes. Waits that add to it: dmz_alloc, dmz_reclaim_lock,
+ * dmz_group_commit for FLUSH and FUA.
+ */
+TRACE_EVENT(dmz_map,
+	TP_PROTO(struct bio *bio),
+	TP_ARGS(bio),
+	TP_STRUCT__entry(
+		__field(unsigned int, op)
+		__field(sector_t, sector)
+		__field(unsigned int, nr_sectors)
+	),
+	TP_fast_assign(
+		__entry->op = bio->bi_opf;
+		__entry->sector = bio->bi_iter.bi_sector;
+		__entry->nr_sectors = bio_sectors(bio);
+	),
+	TP_printk("op=0x%x sector=%llu nr_sectors=%u", __entry->op, (unsigned long long)__entry->sector, __entry->nr_sectors)
+);
+
+TRACE_EVENT(dmz_bio_endio,
+	TP_PROTO(struct bio *bio, blk_status_t status, u64 lat_ns),
+	TP_ARGS(bio, status, lat_ns),
+	TP_STRUCT__entry(
+		__field(unsigned int, op)
+		__field(sector_t, sector)
+		__field(int, status)
+		__field(u64, lat_ns)
+	),
+	TP_fast_assign(
+		__entry->op = bio->bi_opf;
+		__entry->sector = bio->bi_iter.bi_sector;
+		__entry->status = status;
+		__entry->lat_ns = lat_ns;
+	),
+	TP_printk("op=0x%x sector=%llu status=%d lat_ns=%llu", __entry->op, (unsigned long long)__entry->sector, __entry->status, __entry->lat_ns)
+);
+
+DECLARE_EVENT_CLASS(dmz_clone_class,
+	TP_PROTO(unsigned int op, unsigned long lba, unsigned long pba, unsigned long nr_blocks, int status),
+	TP_ARGS(op, lba, pba, nr_blocks, status),
+	TP_STRUCT__entry(
+		__field(unsigned int, op)
+		__field(unsigned long, lba)
+		__field(unsigned long, pba)
+		__field(unsigned long, nr_blocks)
+		__field(int, status)
+	),
+	TP_fast_assign(
+		__entry->op = op;
+		__entry->lba = lba;
+		__entry->pba = pba;
+		__entry->nr_blocks = nr_blocks;
+		__entry->status = status;
+	),
+	TP_printk("op=%u lba=%lu pba=%lu nr_blocks=%lu status=%d", __entry->op, __entry->lba, __entry->pba, __entry->nr_blocks, __entry->status)
+);
+
+DEFINE_EVENT(dmz_clone_class, dmz_clone_submit,
+	TP_PROTO(unsigned int op, unsigned long lba, unsigned long pba, unsigned long nr_blocks, int status),
+	TP_ARGS(op, lba, pba, nr_blocks, status)
+);
+
+DEFINE_EVENT(dmz_clone_class, dmz_clone_endio,
+	TP_PROTO(unsigned int op, unsigned long lba, unsigned long pba, unsigned long nr_blocks, int status),
+	TP_ARGS(op, lba, pba, nr_blocks, status)
+);
+
+TRACE_EVENT(dmz_alloc,
+	TP_PROTO(int zone, int nr_blocks, u64 wait_ns),
+	TP_ARGS(zone, nr_blocks, wait_ns),
+	TP_STRUCT__entry(
+		__field(int, zone)
+		__field(int, nr_blocks)
+		__field(u64, wait_ns)
+	),
+	TP_fast_assign(
+		__entry->zone = zone;
+		__entry->nr_blocks = nr_blocks;
+		__entry->wait_ns = wait_ns;
+	),
+	TP_printk("zone=%d nr_blocks=%d wait_ns=%llu", __entry->zone, __entry->nr_blocks, __entry->wait_ns)
+);
+
+TRACE_EVENT(dmz_reclaim_lock,
+	TP_PROTO(u64 wait_ns),
+	TP_ARGS(wait_ns),
+	TP_STRUCT__entry(
+		__field(u64, wait_ns)
+	),
+	TP_fast_assign(
+		__entry->wait_ns = wait_ns;
+	),
+	TP_printk("wait_ns=%llu", __entry->wait_ns)
+);
+
+TRACE_EVENT(dmz_reclaim_zone,
+	TP_PROTO(int zone, int nr_blocks, int ret, u64 lat_ns),
+	TP_ARGS(zone, nr_blocks, ret, lat_ns),
+	TP_STRUCT__entry(
+		__field(int, zone)
+		__field(int, nr_blocks)
+		__field(int, ret)
+		__field(u64, lat_ns)
+	),
+	TP_fast_assign(
+		__entry->zone = zone;
+		__entry->nr_blocks = nr_blocks;
+		__entry->ret = ret;
+		__entry->lat_ns = lat_ns;
+	),
+	TP_printk("zone=%d nr_blocks=%d ret=%d lat_ns=%llu", __entry->zone, __entry->nr_blocks, __entry->ret, __entry->lat_ns)
+);
+
+TRACE_EVENT(dmz_group_commit,
+	TP_PROTO(int nr_bios, int ret, u64 lat_ns),
+	TP_ARGS(nr_bios, ret, lat_ns),
+	TP_STRUCT__entry(
+		__field(int, nr_bios)
+		__field(int, ret)
+		__field(u64, lat_ns)
+	),
+	TP_fast_assign(
+		__entry->nr_bios = nr_bios;
+		__entry->ret = ret;
+		__entry->lat_ns = lat_ns;
+	),
+	TP_printk("nr_bios=%d ret=%d lat_ns=%llu", __entry->nr_bios, __entry->ret, __entry->lat_ns)
+);
+
+#endif
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE dmz-trace
+#include <trace/define_trace.h>
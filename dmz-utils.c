@@ -1,201 +1,361 @@
 #include "dmz-utils.h"
+#include "dmz-trace.h"
 #include <linux/mm.h>
 
-unsigned long meta_flags;
-unsigned long *zone_lock_flags;
 
 // TODO inc_wp should trigger recliam process under proper circumustance.
 int dmz_inc_wp(struct dmz_metadata *zmd, struct dmz_zone *zone) {
 	return 0;
 }
 
+static void dmz_meta_batch_endio(struct bio *bio) {
+	struct dmz_meta_batch *batch = bio->bi_private;
+
+	if (bio->bi_status)
+		batch->status = bio->bi_status;
+
+	if (atomic_dec_and_test(&batch->pending))
+		complete(&batch->done);
+
+	bio_put(bio);
+}
+
+static struct page *dmz_buf_to_page(void *buf) {
+	if (is_vmalloc_addr(buf))
+		return vmalloc_to_page(buf);
+	return virt_to_page(buf);
+}
+
+/* Batches go to the metadata device, callers reading data zones set bdev to the target. */
+void dmz_meta_batch_init(struct dmz_metadata *zmd, struct dmz_meta_batch *batch) {
+	batch->bdev = zmd->meta_bdev;
+	// The initial reference is dropped by dmz_meta_batch_wait.
+	atomic_set(&batch->pending, 1);
+	batch->status = BLK_STS_OK;
+	init_completion(&batch->done);
+}
+
 /**
- * @brief Function allocate a block.(one block is 4KB in default.)
+ * @brief Submit nr_blocks blocks of buf starting at pba without waiting. The range is split into bios of
+ * at most BIO_MAX_PAGES blocks which never cross a zone boundary. buf may be kmalloc or vmalloc memory.
  * 
- * @return int (0 is all ok, !0 indicates corresponding errors.)
  */
-int dmz_write_block(struct dmz_metadata *zmd, unsigned long pba, struct page *page) {
-	struct bio *bio = bio_alloc(GFP_KERNEL, 1);
-	if (!bio)
-		goto alloc_bio;
-
-	bio_add_page(bio, page, DMZ_BLOCK_SIZE, 0);
-	bio_set_dev(bio, zmd->target_bdev);
-	bio_set_op_attrs(bio, REQ_OP_WRITE, 0);
-	bio->bi_iter.bi_sector = pba << 3;
-	submit_bio_wait(bio);
+void dmz_meta_batch_submit(struct dmz_metadata *zmd, struct dmz_meta_batch *batch, unsigned int op, unsigned int op_flags, unsigned long pba, void *buf, unsigned long nr_blocks) {
+	while (nr_blocks) {
+		unsigned long zone_remain = zmd->zone_nr_blocks - (pba & DMZ_ZONE_NR_BLOCKS_MASK);
+		unsigned int nr = min_t(unsigned long, nr_blocks, min_t(unsigned long, zone_remain, BIO_MAX_PAGES));
+
+		struct bio *bio = bio_alloc(GFP_NOIO, nr);
+		// Zones of the target may sit on any of its devices, the metadata device is a plain range.
+		if (batch->bdev == zmd->target_bdev) {
+			dmz_bio_set_pba(zmd, bio, pba);
+		} else {
+			bio_set_dev(bio, batch->bdev);
+			bio->bi_iter.bi_sector = dmz_blk2sect(pba);
+		}
+		bio_set_op_attrs(bio, op, op_flags | REQ_SYNC | REQ_META | REQ_PRIO);
+		for (int i = 0; i < nr; i++) {
+			void *blk = buf + ((unsigned long)i << DMZ_BLOCK_SHIFT);
+			bio_add_page(bio, dmz_buf_to_page(blk), DMZ_BLOCK_SIZE, offset_in_page(blk));
+		}
+		bio->bi_end_io = dmz_meta_batch_endio;
+		bio->bi_private = batch;
 
-	bio_put(bio);
+		if (op == REQ_OP_WRITE)
+			dmz_stat_add(zmd, dev_write_blocks, nr);
+		atomic_inc(&batch->pending);
+		submit_bio(bio);
 
-	if (bio->bi_status != BLK_STS_OK) {
-		goto write_err;
+		pba += nr;
+		buf += (unsigned long)nr << DMZ_BLOCK_SHIFT;
+		nr_blocks -= nr;
 	}
+}
 
-	return 0;
+int dmz_meta_batch_wait(struct dmz_meta_batch *batch) {
+	if (!atomic_dec_and_test(&batch->pending))
+		wait_for_completion_io(&batch->done);
 
-alloc_bio:
-	return -1;
-write_err:
-	return -1;
+	return batch->status ? -EIO : 0;
 }
 
-int dmz_determine_target_zone(struct dmz_metadata *zmd, int need, unsigned long *wp_after_flush, unsigned long *target_zones, int index) {
-	unsigned long wp;
-	int target_zone = ~0;
-	for (int i = 0; i < zmd->nr_zones; i++) {
-		if (zmd->zone_nr_blocks - wp_after_flush[i] >= need) {
-			target_zone = i;
-			wp = wp_after_flush[i];
-			wp_after_flush[i] += need;
-			break;
-		}
-	}
+static void dmz_poll_endio(struct bio *bio) {
+	complete(bio->bi_private);
+}
 
-	if (!(~target_zone)) {
-		return -1;
+/**
+ * @brief Submit bio and wait for it. With polling enabled and a polled queue below, the bio goes out REQ_HIPRI
+ * and the caller spins on the completion queue instead of sleeping until the interrupt.
+ *
+ * @return int (0 is all ok, !0 indicates corresponding errors.)
+ */
+int dmz_submit_bio_sync(struct dmz_metadata *zmd, struct bio *bio) {
+	struct request_queue *q = bio->bi_disk->queue;
+	DECLARE_COMPLETION_ONSTACK(done);
+
+	if (!zmd->poll || !test_bit(QUEUE_FLAG_POLL, &q->queue_flags))
+		return submit_bio_wait(bio);
+
+	bio->bi_opf |= REQ_HIPRI;
+	bio->bi_private = &done;
+	bio->bi_end_io = dmz_poll_endio;
+
+	blk_qc_t cookie = submit_bio(bio);
+	while (!try_wait_for_completion(&done)) {
+		if (!blk_poll(q, cookie, true))
+			cond_resched();
 	}
 
-	target_zones[index] = target_zone * zmd->zone_nr_blocks + wp;
-	return 0;
+	return blk_status_to_errno(bio->bi_status);
 }
 
-int dmz_flush_do(struct dmz_target *dmz) {
-	struct dmz_metadata *zmd = dmz->zmd;
-	struct dmz_zone *zone = zmd->zone_start;
-	int ret = 0, reclaim_zone = 0;
+/* Checkpoint block indices of the mapping block of lba, the reverse mapping block and the bitmap block of pba. */
+void dmz_dirty_mt(struct dmz_metadata *zmd, unsigned long lba) {
+	set_bit(zmd->nr_zone_struct_need_blocks + (lba >> DMZ_MAP_PER_BLOCK_SHIFT), zmd->ckpt_dirty);
+}
 
-	ret = dmz_reclaim_zone(dmz, reclaim_zone++);
-	if (ret) {
-		pr_err("Recalim failed.\n");
-	}
-	zone[0].wp = 1;
+void dmz_dirty_rmt(struct dmz_metadata *zmd, unsigned long pba) {
+	unsigned long rmt_info = zmd->nr_zone_struct_need_blocks + (unsigned long)zmd->nr_zones * zmd->nr_zone_mt_need_blocks;
 
-	// compute how many blocks mappings, reverser mappings, bitmap, metadata needs.
+	set_bit(rmt_info + (pba >> DMZ_MAP_PER_BLOCK_SHIFT), zmd->ckpt_dirty);
+}
 
-	// how many blocks mappings of each zone needs. For example, 256MB zone need 128 Blocks to store mappings.
-	int nr_zone_mt_need_blocks = ((zmd->zone_nr_blocks * sizeof(struct dmz_map)) / DMZ_BLOCK_SIZE) + 1;
+void dmz_dirty_bitmap(struct dmz_metadata *zmd, unsigned long pos) {
+	unsigned long bitmap_info = zmd->nr_zone_struct_need_blocks + 2 * (unsigned long)zmd->nr_zones * zmd->nr_zone_mt_need_blocks;
 
-	// how many blocks bitmap need. For example, 256MB zone need 2 Blocks to store bitmaps.
-	int nr_zone_bitmap_need_blocks = ((zmd->zone_nr_blocks >> 3) / DMZ_BLOCK_SIZE) + 1;
+	set_bit(bitmap_info + (pos >> DMZ_BLOCK_SHIFT_BITS), zmd->ckpt_dirty);
+}
 
-	// how many blocks zone structs need.
-	int nr_zone_struct_need_blocks = ((zmd->nr_zones * sizeof(struct dmz_zone)) / DMZ_BLOCK_SIZE) + 1;
+/**
+ * @brief PREFLUSH on metadata writes only empties the cache of the metadata device. Data on every other device
+ * must be flushed explicitly before the metadata describing it is written.
+ *
+ * @return int (0 is all ok, !0 indicates corresponding errors.)
+ */
+int dmz_flush_data_dev(struct dmz_metadata *zmd) {
+	return dmz_devs_flush(zmd);
+}
 
-	/** All things flush do is changing zones->wp in order in advance and write info into blocks in the same order **/
+static void dmz_slot_set_wp(struct dmz_metadata *zmd, int slot, unsigned long written) {
+	struct dmz_zone *zone = zmd->zone_start;
+	int slot_zone = slot * zmd->nr_slot_zones;
 
-	// init wp_after_flush
-	unsigned long *wp_after_flush, *mapping_target_zones, *rmapping_target_zones, *bitmap_target_zones;
+	// Slot zones of a metadata device are not tracked, they are overwritten in place.
+	if (DMZ_HAS_META_DEV(zmd))
+		return;
 
-repeat_try:
-	wp_after_flush = kzalloc(zmd->nr_zones * sizeof(unsigned long), GFP_KERNEL);
-	mapping_target_zones = kzalloc(zmd->nr_zones * sizeof(unsigned long), GFP_KERNEL);
-	rmapping_target_zones = kzalloc(zmd->nr_zones * sizeof(unsigned long), GFP_KERNEL);
-	bitmap_target_zones = kzalloc(zmd->nr_zones * sizeof(unsigned long), GFP_KERNEL);
+	for (int i = slot_zone; i < slot_zone + zmd->nr_slot_zones; i++) {
+		zone[i].wp = min(written, zmd->zone_nr_blocks);
+		written -= zone[i].wp;
+	}
+}
 
-	if (!wp_after_flush || !mapping_target_zones || !rmapping_target_zones || !bitmap_target_zones) {
-		pr_info("alloc wp arrays failed.\n");
-		goto fail;
+/*
+ * Full checkpoint: reset slot, then write zone descriptors, mappings, reverse mappings and bitmap of all zones.
+ * Returns the slot offset of the superblock through commit.
+ */
+static int dmz_flush_full(struct dmz_metadata *zmd, int slot, struct dmz_zone_desc *desc, struct dmz_super *super, unsigned long *commit) {
+	struct dmz_zone *zone = zmd->zone_start;
+	struct dmz_meta_batch batch;
+	struct blk_plug plug;
+	int slot_zone = slot * zmd->nr_slot_zones;
+	unsigned long base = (unsigned long)slot_zone << DMZ_ZONE_NR_BLOCKS_SHIFT;
+	int ret;
+
+	// Stale blocks left in a slot of a metadata device fail the generation checks, no reset needed.
+	if (!DMZ_HAS_META_DEV(zmd)) {
+		ret = dmz_reset_zones_async(zmd, slot_zone, zmd->nr_slot_zones);
+		if (ret)
+			return ret;
+		for (int i = slot_zone; i < slot_zone + zmd->nr_slot_zones; i++) {
+			dmz_wait_zone_reset(zmd, i);
+			if (zone[i].wp)
+				return -EIO;
+		}
 	}
 
+	// Everything is written in slot order with all bios in flight. Writes to the same sequential zone
+	// are kept in order by the zone write locking of the target queue scheduler.
+	dmz_meta_batch_init(zmd, &batch);
+	blk_start_plug(&plug);
+	dmz_meta_batch_submit(zmd, &batch, REQ_OP_WRITE, 0, base + super->zones_info, desc, zmd->nr_zone_struct_need_blocks);
+	for (int i = 0; i < zmd->nr_zones; i++)
+		dmz_meta_batch_submit(zmd, &batch, REQ_OP_WRITE, 0, base + super->mt_info + i * zmd->nr_zone_mt_need_blocks, zone[i].mt, zmd->nr_zone_mt_need_blocks);
 	for (int i = 0; i < zmd->nr_zones; i++)
-		wp_after_flush[i] = zone[i].wp;
+		dmz_meta_batch_submit(zmd, &batch, REQ_OP_WRITE, 0, base + super->rmt_info + i * zmd->nr_zone_mt_need_blocks, zone[i].reverse_mt, zmd->nr_zone_mt_need_blocks);
+	dmz_meta_batch_submit(zmd, &batch, REQ_OP_WRITE, 0, base + super->bitmap_info, zmd->bitmap_start, zmd->nr_zones * zmd->nr_zone_bitmap_need_blocks);
+	blk_finish_plug(&plug);
 
-	for (int i = 0; i < zmd->nr_zones; i++) {
-		if (dmz_determine_target_zone(zmd, nr_zone_mt_need_blocks, wp_after_flush, mapping_target_zones, i) || dmz_determine_target_zone(zmd, nr_zone_mt_need_blocks, wp_after_flush, rmapping_target_zones, i) ||
-		    dmz_determine_target_zone(zmd, nr_zone_bitmap_need_blocks, wp_after_flush, bitmap_target_zones, i)) {
-			goto again;
-		}
-	}
+	*commit = zmd->nr_ckpt_blocks;
 
-	unsigned long zone_struct_target_zonewp;
-	if (dmz_determine_target_zone(zmd, nr_zone_struct_need_blocks, wp_after_flush, &zone_struct_target_zonewp, 0)) {
-		goto again;
+	return dmz_meta_batch_wait(&batch);
+}
+
+/*
+ * Delta checkpoint: append the nr dirty checkpoint blocks to the slot of the latest checkpoint.
+ * Dirty blocks that are consecutive both in the layout and in memory go out as one bio.
+ * Returns the slot offset of the superblock through commit.
+ */
+static int dmz_flush_delta(struct dmz_metadata *zmd, struct dmz_zone_desc *desc, struct dmz_super *super, unsigned long nr, unsigned long *commit) {
+	struct dmz_meta_batch batch;
+	struct blk_plug plug;
+	unsigned long base = (unsigned long)zmd->ckpt_slot * zmd->nr_slot_zones << DMZ_ZONE_NR_BLOCKS_SHIFT;
+	unsigned long nr_idx_blocks = DIV_ROUND_UP(nr, DMZ_DELTA_IDX_PER_BLOCK);
+	unsigned long data = zmd->ckpt_wp + 1 + nr_idx_blocks;
+	unsigned long bit, n = 0;
+	int ret;
+
+	struct dmz_delta *hdr = kvzalloc((1 + nr_idx_blocks) << DMZ_BLOCK_SHIFT, GFP_KERNEL);
+	if (!hdr)
+		return -ENOMEM;
+	__u32 *idx = (void *)hdr + DMZ_BLOCK_SIZE;
+
+	for_each_set_bit(bit, zmd->ckpt_dirty, zmd->nr_ckpt_blocks)
+		idx[n++] = bit;
+
+	hdr->magic = DMZ_DELTA_MAGIC;
+	hdr->gen = super->gen;
+	hdr->nr_blocks = nr;
+	hdr->crc = dmz_delta_crc(hdr);
+
+	dmz_meta_batch_init(zmd, &batch);
+	blk_start_plug(&plug);
+	dmz_meta_batch_submit(zmd, &batch, REQ_OP_WRITE, 0, base + zmd->ckpt_wp, hdr, 1 + nr_idx_blocks);
+	// Fault injection: the header is written, the rest is not, like a delta torn by a write error.
+	if (zmd->fail_ckpt_delta) {
+		zmd->fail_ckpt_delta--;
+		nr = 0;
+		batch.status = BLK_STS_IOERR;
+	}
+	for (unsigned long i = 0, run; i < nr; i += run) {
+		run = dmz_ckpt_run(zmd, desc, &idx[i], nr - i);
+		dmz_meta_batch_submit(zmd, &batch, REQ_OP_WRITE, 0, base + data + i, dmz_ckpt_block_addr(zmd, desc, idx[i]), run);
 	}
+	blk_finish_plug(&plug);
 
-	for (int i = 0; i < zmd->nr_zones; i++) {
-		int target = mapping_target_zones[i] / zmd->zone_nr_blocks;
-		zone[i].mt_blk_n = mapping_target_zones[i];
-		zone[target].wp += nr_zone_mt_need_blocks;
+	ret = dmz_meta_batch_wait(&batch);
+	kvfree(hdr);
+
+	*commit = data + nr;
+
+	return ret;
+}
+
+/**
+ * @brief Write a checkpoint and commit it by writing its superblock. The checkpoint is a delta of the blocks changed
+ * since the latest one, appended to its slot, while that is small and fits. Otherwise it is a full checkpoint into
+ * the other slot, so the latest one stays valid until the new superblock is durable. The journal stays valid
+ * until then too, it is emptied once the new checkpoint is committed.
+ * Caller must have stopped IO and hold the journal write lock.
+ * 
+ * @return int (0 is all ok, !0 indicates corresponding errors.)
+ */
+int dmz_flush_do(struct dmz_target *dmz) {
+	struct dmz_metadata *zmd = dmz->zmd;
+	struct dmz_zone *zone = zmd->zone_start;
+	struct dmz_meta_batch batch;
+	unsigned long commit;
+	int ret = 0;
 
-		target = rmapping_target_zones[i] / zmd->zone_nr_blocks;
-		zone[i].rmt_blk_n = rmapping_target_zones[i];
-		zone[target].wp += nr_zone_mt_need_blocks;
+	unsigned long gen = zmd->ckpt_gen + 1;
 
-		target = bitmap_target_zones[i] / zmd->zone_nr_blocks;
-		zone[i].bitmap_blk_n = bitmap_target_zones[i];
-		zone[target].wp += nr_zone_bitmap_need_blocks;
+	struct dmz_zone_desc *desc = kvzalloc((unsigned long)zmd->nr_zone_struct_need_blocks << DMZ_BLOCK_SHIFT, GFP_KERNEL);
+	struct dmz_super *super = kzalloc(DMZ_BLOCK_SIZE, GFP_KERNEL);
+	if (!desc || !super) {
+		ret = -ENOMEM;
+		goto alloc;
 	}
 
-	struct page *sblk_page = alloc_page(GFP_KERNEL);
-	if (!sblk_page) {
-		pr_info("alloc page failed.\n");
-		goto fail;
+	memcpy(super, zmd->sblk, sizeof(struct dmz_super));
+	dmz_ckpt_layout(zmd->nr_zones, super);
+
+	super->magic = DMZ_MAGIC;
+	super->gen = gen;
+	super->nr_zones = zmd->nr_zones;
+	super->nr_meta_zones = zmd->nr_meta_zones;
+	super->nr_devs = zmd->devs->nr;
+	for (unsigned int d = 0; d < zmd->devs->nr; d++)
+		super->dev_nr_zones[d] = zmd->devs->dev[d].nr_zones;
+	super->reserved_zone = zmd->reserved_zone;
+	super->write_seq = atomic64_read(&zmd->write_seq);
+	super->crc = dmz_super_crc(super);
+
+	for (int i = 0; i < zmd->nr_zones; i++) {
+		desc[i].wp = zone[i].wp;
+		desc[i].weight = zone[i].weight;
+		desc[i].type = zone[i].type;
 	}
-	struct dmz_super *super = (struct dmz_super *)page_address(sblk_page);
-	memcpy(super, zmd->sblk, 512);
-	super->magic = ~0;
-	super->zones_info = zone_struct_target_zonewp;
-	zone[zone_struct_target_zonewp >> DMZ_BLOCK_SHIFT].wp += nr_zone_struct_need_blocks;
 
-	ret = dmz_write_block(zmd, 0, virt_to_page(super));
+	// Zone descriptors change with nearly every write, they always go into a delta.
+	bitmap_set(zmd->ckpt_dirty, 0, zmd->nr_zone_struct_need_blocks);
+	unsigned long nr_dirty = bitmap_weight(zmd->ckpt_dirty, zmd->nr_ckpt_blocks);
+	unsigned long delta_blocks = 1 + DIV_ROUND_UP(nr_dirty, DMZ_DELTA_IDX_PER_BLOCK) + nr_dirty + 1;
+	bool delta = zmd->sblk->magic == DMZ_MAGIC && nr_dirty < zmd->nr_ckpt_blocks / 2 &&
+		     zmd->ckpt_wp + delta_blocks <= ((unsigned long)zmd->nr_slot_zones << DMZ_ZONE_NR_BLOCKS_SHIFT);
+	int slot;
+	unsigned long base;
+
+retry:
+	slot = delta ? zmd->ckpt_slot : (zmd->ckpt_slot + 1) % DMZ_NR_CKPT_SLOTS;
+	base = (unsigned long)slot * zmd->nr_slot_zones << DMZ_ZONE_NR_BLOCKS_SHIFT;
+
+	if (delta)
+		ret = dmz_flush_delta(zmd, desc, super, nr_dirty, &commit);
+	else
+		ret = dmz_flush_full(zmd, slot, desc, super, &commit);
 	if (ret) {
-		pr_err("write failed.\n");
+		pr_err("Checkpoint write failed.\n");
+		goto fail;
 	}
 
-	for (int i = 0; i < zmd->nr_zones; i++) {
-		for (int j = 0; j < nr_zone_mt_need_blocks; j++) {
-			unsigned long lint = (unsigned long)zone[i].mt;
-			ret = dmz_write_block(zmd, zone[i].mt_blk_n + j, virt_to_page(lint + (j << DMZ_BLOCK_SHIFT)));
-			if (ret) {
-				pr_err("write failed.\n");
-			}
-		}
-		for (int j = 0; j < nr_zone_mt_need_blocks; j++) {
-			unsigned long lint = (unsigned long)zone[i].reverse_mt;
-			ret = dmz_write_block(zmd, zone[i].rmt_blk_n + j, virt_to_page(lint + (j << DMZ_BLOCK_SHIFT)));
-			if (ret) {
-				pr_err("write failed.\n");
-			}
-		}
-		for (int j = 0; j < nr_zone_bitmap_need_blocks; j++) {
-			unsigned long bitmap_longint = (unsigned long)zone[i].bitmap;
-			ret = dmz_write_block(zmd, zone[i].bitmap_blk_n + j, virt_to_page(bitmap_longint + (j << DMZ_BLOCK_SHIFT)));
-			if (ret) {
-				pr_err("write failed.\n");
-			}
-		}
+	ret = dmz_flush_data_dev(zmd);
+	if (ret) {
+		pr_err("Data device flush failed.\n");
+		goto fail;
 	}
 
-	for (int i = 0; i < nr_zone_struct_need_blocks; i++) {
-		unsigned long lint = (unsigned long)zmd->zone_start;
-		dmz_write_block(zmd, zone_struct_target_zonewp + i, virt_to_page(lint + (i << DMZ_BLOCK_SHIFT)));
+	// Commit. PREFLUSH makes the checkpoint durable before the superblock, FUA the superblock itself.
+	dmz_meta_batch_init(zmd, &batch);
+	dmz_meta_batch_submit(zmd, &batch, REQ_OP_WRITE, REQ_PREFLUSH | REQ_FUA, base + commit, super, 1);
+	ret = dmz_meta_batch_wait(&batch);
+	if (ret) {
+		pr_err("Checkpoint commit failed.\n");
+		goto fail;
 	}
 
-	kfree(wp_after_flush);
-	kfree(mapping_target_zones);
-	kfree(rmapping_target_zones);
-	kfree(bitmap_target_zones);
+	memcpy(zmd->sblk, super, sizeof(struct dmz_super));
+	zmd->ckpt_gen = gen;
+	zmd->ckpt_slot = slot;
+	zmd->ckpt_wp = commit + 1;
+	dmz_slot_set_wp(zmd, slot, zmd->ckpt_wp);
 
-	return 0;
-fail:
-	kfree(wp_after_flush);
-	kfree(mapping_target_zones);
-	kfree(rmapping_target_zones);
-	kfree(bitmap_target_zones);
-	return -1;
+	bitmap_zero(zmd->ckpt_dirty, zmd->nr_ckpt_blocks);
 
-again:
+	if (dmz_journal_reset(zmd, gen))
+		pr_err("Journal reset failed.\n");
+	goto alloc;
 
-	if (reclaim_zone >= zmd->nr_zones)
-		goto fail;
+fail:
+	/*
+	 * The slot wp moved past whatever part of the delta made it to the device. Load stops at the first delta
+	 * that is not committed, so later deltas appended behind it would never be read: close the slot to deltas
+	 * and write a full checkpoint into the other one right away. The latest checkpoint stays valid meanwhile.
+	 */
+	if (delta) {
+		zmd->ckpt_wp = (unsigned long)zmd->nr_slot_zones << DMZ_ZONE_NR_BLOCKS_SHIFT;
+		dmz_slot_set_wp(zmd, slot, zmd->ckpt_wp);
+		delta = false;
+		goto retry;
+	}
 
-	pr_info("Repeat try %d.\n", reclaim_zone);
-	dmz_reclaim_zone(dmz, reclaim_zone++);
-	goto repeat_try;
+alloc:
+	kfree(super);
+	kvfree(desc);
+	return ret;
 }
 
 /**
- * @brief Reclaim one zone and write metadata and mappings and reverse mappings and bitmaps into device.
+ * @brief Checkpoint mappings, reverse mappings, bitmap and zones into device.
  * Note IO is not allowed when flush is under process.
  * 
  * @param dmz 
@@ -203,24 +363,29 @@ again:
  */
 int dmz_flush(struct dmz_target *dmz) {
 	struct dmz_metadata *zmd = dmz->zmd;
+	int ret;
 
-	struct dmz_zone *zone = zmd->zone_start;
-	unsigned long prev = ~0, chosen = 0;
-	// find minimum weight zone
-	for (int i = 0; i < zmd->nr_map_blocks; i++) {
-		if ((&zone[i])->wp < prev) {
-			prev = (&zone[i])->wp;
-			chosen = i;
-		}
+	dmz_lock_reclaim(zmd);
+
+	// In-flight clones hold their zone io lock until they complete, their mapping updates belong to this checkpoint.
+	for (int i = zmd->nr_meta_zones; i < zmd->nr_zones; i++)
+		dmz_start_io(zmd, i);
+
+	dmz_wait_resets(zmd);
+
+	dmz_lock_journal(zmd);
+	ret = dmz_flush_do(dmz);
+	if (ret) {
+		pr_err("flush failed.\n");
 	}
+	dmz_unlock_journal(zmd);
 
-	// predicate mappings, bitmap, zones, metadata after flush and then do the flush.
-	// ret = dmz_flush_do(dmz);
-	// if (ret) {
-	// 	pr_err("flush failed.\n");
-	// }
+	for (int i = zmd->nr_meta_zones; i < zmd->nr_zones; i++)
+		dmz_complete_io(zmd, i);
 
-	return 0;
+	dmz_unlock_reclaim(zmd);
+
+	return ret;
 }
 
 int dmz_locks_init(struct dmz_metadata *zmd) {
@@ -228,6 +393,9 @@ int dmz_locks_init(struct dmz_metadata *zmd) {
 	mutex_init(&zmd->reclaim_lock);
 	mutex_init(&zmd->freezone_lock);
 
+	atomic_set(&zmd->nr_resets, 0);
+	init_waitqueue_head(&zmd->reset_wait);
+
 	struct dmz_zone *zone = zmd->zone_start;
 	for (int i = 0; i < zmd->nr_zones; i++) {
 		spin_lock_init(&zone[i].lock);
@@ -235,26 +403,26 @@ int dmz_locks_init(struct dmz_metadata *zmd) {
 		mutex_init(&zone[i].map_lock);
 	}
 
-	zone_lock_flags = kcalloc(zmd->nr_zones, sizeof(unsigned long), GFP_KERNEL);
-	if (!zone_lock_flags)
+	zmd->zone_lock_flags = kcalloc(zmd->nr_zones, sizeof(unsigned long), GFP_KERNEL);
+	if (!zmd->zone_lock_flags)
 		return -1;
 
 	return 0;
 }
 
 void dmz_locks_cleanup(struct dmz_metadata *zmd) {
-	if (zone_lock_flags)
-		kfree(zone_lock_flags);
+	if (zmd->zone_lock_flags)
+		kfree(zmd->zone_lock_flags);
 }
 
 int dmz_lock_metadata(struct dmz_metadata *zmd) {
-	spin_lock_irqsave(&zmd->meta_lock, meta_flags);
+	spin_lock_irqsave(&zmd->meta_lock, zmd->meta_flags);
 
 	return 0;
 }
 
 void dmz_unlock_metadata(struct dmz_metadata *zmd) {
-	spin_unlock_irqrestore(&zmd->meta_lock, meta_flags);
+	spin_unlock_irqrestore(&zmd->meta_lock, zmd->meta_flags);
 }
 
 int dmz_lock_zone(struct dmz_metadata *zmd, int idx) {
@@ -262,7 +430,7 @@ int dmz_lock_zone(struct dmz_metadata *zmd, int idx) {
 	if (spin_is_locked(&zone[idx].lock))
 		return -1;
 
-	spin_lock_irqsave(&zone[idx].lock, zone_lock_flags[idx]);
+	spin_lock_irqsave(&zone[idx].lock, zmd->zone_lock_flags[idx]);
 
 	return 0;
 }
@@ -272,13 +440,42 @@ void dmz_unlock_zone(struct dmz_metadata *zmd, int idx) {
 	if (!spin_is_locked(&zone[idx].lock))
 		return;
 
-	spin_unlock_irqrestore(&zone[idx].lock, zone_lock_flags[idx]);
+	spin_unlock_irqrestore(&zone[idx].lock, zmd->zone_lock_flags[idx]);
+}
+
+/**
+ * @brief Take lock, counting the acquisition under type. Only a failed trylock is timed, the uncontended path
+ * costs a per-CPU increment.
+ *
+ * @return bool whether the lock was contended, wait gets the time spent waiting for it.
+ */
+static bool dmz_mutex_lock(struct dmz_metadata *zmd, struct mutex *lock, int type, u64 *wait) {
+	u64 start;
+
+	dmz_stat_inc(zmd, locks[type].acquired);
+	*wait = 0;
+	if (mutex_trylock(lock))
+		return false;
+
+	start = ktime_get_ns();
+	mutex_lock(lock);
+	*wait = ktime_get_ns() - start;
+
+	dmz_stat_inc(zmd, locks[type].contended);
+	dmz_stat_add(zmd, locks[type].wait_ns, *wait);
+	return true;
 }
 
 void dmz_start_io(struct dmz_metadata *zmd, int idx) {
 	struct dmz_zone *zone = zmd->zone_start;
-	mutex_lock(&zone[idx].io_lock);
-	// pr_info("<Zone %d IO Locked>.", idx);
+	u64 wait;
+	bool contended = dmz_mutex_lock(zmd, &zone[idx].io_lock, DMZ_LOCK_IO, &wait);
+
+	zone[idx].io_lock_stats.acquired++;
+	if (contended) {
+		zone[idx].io_lock_stats.contended++;
+		zone[idx].io_lock_stats.wait_ns += wait;
+	}
 }
 
 void dmz_complete_io(struct dmz_metadata *zmd, int idx) {
@@ -297,7 +494,12 @@ int dmz_is_on_io(struct dmz_metadata *zmd, int idx) {
 }
 
 int dmz_lock_reclaim(struct dmz_metadata *zmd) {
-	mutex_lock(&zmd->reclaim_lock);
+	u64 wait;
+
+	dmz_mutex_lock(zmd, &zmd->reclaim_lock, DMZ_LOCK_RECLAIM, &wait);
+
+	dmz_stat_lat(zmd, DMZ_LAT_RECLAIM_LOCK, wait);
+	trace_dmz_reclaim_lock(wait);
 	return 0;
 }
 
@@ -305,6 +507,16 @@ void dmz_unlock_reclaim(struct dmz_metadata *zmd) {
 	mutex_unlock(&zmd->reclaim_lock);
 }
 
+void dmz_lock_journal(struct dmz_metadata *zmd) {
+	u64 wait;
+
+	dmz_mutex_lock(zmd, &zmd->journal.write_lock, DMZ_LOCK_JOURNAL, &wait);
+}
+
+void dmz_unlock_journal(struct dmz_metadata *zmd) {
+	mutex_unlock(&zmd->journal.write_lock);
+}
+
 void dmz_lock_map(struct dmz_metadata *zmd, int idx) {
 	struct dmz_zone *zone = zmd->zone_start;
 	mutex_lock(&zone[idx].map_lock);
@@ -315,11 +527,18 @@ void dmz_unlock_map(struct dmz_metadata *zmd, int idx) {
 	mutex_unlock(&zone[idx].map_lock);
 }
 
+static int dmz_zone_mgmt(struct dmz_metadata *zmd, enum req_opf op, int idx) {
+	sector_t sector;
+	struct block_device *bdev = dmz_zone_bdev(zmd, idx, &sector);
+
+	return blkdev_zone_mgmt(bdev, op, sector, zmd->zone_nr_sectors, GFP_KERNEL);
+}
+
 int dmz_open_zone(struct dmz_metadata *zmd, int idx) {
 	struct dmz_zone *zone = zmd->zone_start;
 	int ret = 0;
 	if (DMZ_IS_SEQ(&zone[idx]))
-		ret = blkdev_zone_mgmt(zmd->target_bdev, REQ_OP_ZONE_OPEN, idx << (DMZ_ZONE_NR_BLOCKS_SHIFT + DMZ_BLOCK_SECTORS_SHIFT), zmd->zone_nr_sectors, GFP_KERNEL);
+		ret = dmz_zone_mgmt(zmd, REQ_OP_ZONE_OPEN, idx);
 	if (ret)
 		pr_err("Open Zone %d Failed.", idx);
 	return ret;
@@ -329,7 +548,7 @@ int dmz_close_zone(struct dmz_metadata *zmd, int idx) {
 	struct dmz_zone *zone = zmd->zone_start;
 	int ret = 0;
 	if (DMZ_IS_SEQ(&zone[idx]))
-		ret = blkdev_zone_mgmt(zmd->target_bdev, REQ_OP_ZONE_CLOSE, idx << (DMZ_ZONE_NR_BLOCKS_SHIFT + DMZ_BLOCK_SECTORS_SHIFT), zmd->zone_nr_sectors, GFP_KERNEL);
+		ret = dmz_zone_mgmt(zmd, REQ_OP_ZONE_CLOSE, idx);
 	if (ret)
 		pr_err("Close Zone %d Failed.", idx);
 	return ret;
@@ -339,84 +558,206 @@ int dmz_finish_zone(struct dmz_metadata *zmd, int idx) {
 	struct dmz_zone *zone = zmd->zone_start;
 	int ret = 0;
 	if (DMZ_IS_SEQ(&zone[idx]))
-		ret = blkdev_zone_mgmt(zmd->target_bdev, REQ_OP_ZONE_FINISH, idx << (DMZ_ZONE_NR_BLOCKS_SHIFT + DMZ_BLOCK_SECTORS_SHIFT), zmd->zone_nr_sectors, GFP_KERNEL);
+		ret = dmz_zone_mgmt(zmd, REQ_OP_ZONE_FINISH, idx);
 	if (ret)
 		pr_err("Finish Zone %d Failed.", idx);
 	return ret;
 }
 
-int dmz_reset_zone(struct dmz_metadata *zmd, int idx) {
+struct dmz_reset_ctx {
+	struct dmz_metadata *zmd;
+	int start;
+	int nr;
+};
+
+static void dmz_reset_endio(struct bio *bio) {
+	struct dmz_reset_ctx *ctx = bio->bi_private;
+	struct dmz_metadata *zmd = ctx->zmd;
 	struct dmz_zone *zone = zmd->zone_start;
-	int ret = 0;
 
-	if (DMZ_IS_SEQ(&zone[idx]))
-		ret = blkdev_zone_mgmt(zmd->target_bdev, REQ_OP_ZONE_RESET, idx << (DMZ_ZONE_NR_BLOCKS_SHIFT + DMZ_BLOCK_SECTORS_SHIFT), 1 << (DMZ_ZONE_NR_BLOCKS_SHIFT + DMZ_BLOCK_SECTORS_SHIFT), GFP_KERNEL);
+	if (bio->bi_status)
+		pr_err("Reset Zone %d-%d Failed. Err: %d", ctx->start, ctx->start + ctx->nr - 1, bio->bi_status);
 
-	if (ret)
+	for (int i = ctx->start; i < ctx->start + ctx->nr; i++) {
+		if (!test_bit(DMZ_ZONE_RESETTING, &zone[i].flags))
+			continue;
+
+		// Zone only goes back to the free pool once the device has really reset it.
+		if (!bio->bi_status) {
+			dmz_map_change_begin(zmd);
+			zone[i].wp = 0;
+			zone[i].weight = 0;
+			dmz_map_change_end(zmd);
+			dmz_summary_clear(&zone[i]);
+		}
+
+		clear_bit_unlock(DMZ_ZONE_RESETTING, &zone[i].flags);
+		smp_mb__after_atomic();
+		wake_up_bit(&zone[i].flags, DMZ_ZONE_RESETTING);
+	}
+
+	if (atomic_dec_and_test(&zmd->nr_resets))
+		wake_up_all(&zmd->reset_wait);
+
+	kfree(ctx);
+	bio_put(bio);
+}
+
+/**
+ * @brief Issue a zone management bio without waiting for it. Zones of the range must already be flagged DMZ_ZONE_RESETTING.
+ * 
+ * @return int (0 is all ok, !0 indicates corresponding errors.)
+ */
+static int dmz_submit_reset(struct dmz_metadata *zmd, enum req_opf op, int start, int nr) {
+	struct dmz_reset_ctx *ctx = kmalloc(sizeof(struct dmz_reset_ctx), GFP_NOIO);
+	if (!ctx)
+		goto alloc_ctx;
+
+	struct bio *bio = bio_alloc(GFP_NOIO, 0);
+	if (!bio)
+		goto alloc_bio;
+
+	ctx->zmd = zmd;
+	ctx->start = start;
+	ctx->nr = nr;
+
+	// Reset all only goes out for a target on a single device, zone start is then 0.
+	dmz_bio_set_pba(zmd, bio, (unsigned long)start << DMZ_ZONE_NR_BLOCKS_SHIFT);
+	bio_set_op_attrs(bio, op, REQ_SYNC);
+	bio->bi_end_io = dmz_reset_endio;
+	bio->bi_private = ctx;
+
+	atomic_inc(&zmd->nr_resets);
+	submit_bio(bio);
+
+	return 0;
+
+alloc_bio:
+	kfree(ctx);
+alloc_ctx:
+	return -ENOMEM;
+}
+
+/* Clear the reset flag of zones whose reset could not be issued. */
+static void dmz_abort_reset(struct dmz_metadata *zmd, int start, int nr) {
+	struct dmz_zone *zone = zmd->zone_start;
+
+	for (int i = start; i < start + nr; i++) {
+		if (!test_bit(DMZ_ZONE_RESETTING, &zone[i].flags))
+			continue;
+		clear_bit_unlock(DMZ_ZONE_RESETTING, &zone[i].flags);
+		smp_mb__after_atomic();
+		wake_up_bit(&zone[i].flags, DMZ_ZONE_RESETTING);
+	}
+}
+
+/**
+ * @brief Queue a reset of zone idx and return immediately. The zone is kept out of allocation until the reset completes.
+ * 
+ * @return int (0 is all ok, !0 indicates corresponding errors.)
+ */
+int dmz_reset_zone_async(struct dmz_metadata *zmd, int idx) {
+	struct dmz_zone *zone = zmd->zone_start;
+	int ret;
+
+	// Conventional zones have no write pointer, nothing to wait for.
+	if (!DMZ_IS_SEQ(&zone[idx])) {
+		dmz_map_change_begin(zmd);
+		zone[idx].wp = 0;
+		zone[idx].weight = 0;
+		dmz_map_change_end(zmd);
+		dmz_summary_clear(&zone[idx]);
+		return 0;
+	}
+
+	if (test_and_set_bit_lock(DMZ_ZONE_RESETTING, &zone[idx].flags))
+		return 0;
+
+	ret = dmz_submit_reset(zmd, REQ_OP_ZONE_RESET, idx, 1);
+	if (ret) {
 		pr_err("Reset Zone %d Failed. Err: %d", idx, ret);
-	else
-		pr_info("Reset Zone %d Succ.", idx);
+		dmz_abort_reset(zmd, idx, 1);
+	}
 
-	zone[idx].wp = 0;
-	zone[idx].weight = 0;
 	return ret;
 }
 
-bool dmz_is_full(struct dmz_metadata *zmd) {
+/**
+ * @brief Reset zones [start, start + nr) asynchronously. The whole device is reset with a single
+ * REQ_OP_ZONE_RESET_ALL when the target supports it, otherwise all per-zone resets are put in flight under one plug.
+ * 
+ * @return int (0 is all ok, !0 indicates corresponding errors.)
+ */
+int dmz_reset_zones_async(struct dmz_metadata *zmd, int start, int nr) {
 	struct dmz_zone *zone = zmd->zone_start;
-	bool full = true;
-	for (int i = 0; i < zmd->nr_zones; i++) {
-		if (zmd->zone_nr_blocks != zone[i].weight) {
-			full = false;
+	struct blk_plug plug;
+	int ret = 0;
+
+	if (!start && nr == zmd->nr_zones && zmd->devs->nr == 1 && blk_queue_zone_resetall(bdev_get_queue(zmd->target_bdev))) {
+		for (int i = start; i < start + nr; i++) {
+			if (DMZ_IS_SEQ(&zone[i])) {
+				set_bit(DMZ_ZONE_RESETTING, &zone[i].flags);
+			} else {
+				dmz_map_change_begin(zmd);
+				zone[i].wp = 0;
+				zone[i].weight = 0;
+				dmz_map_change_end(zmd);
+			}
 		}
+
+		ret = dmz_submit_reset(zmd, REQ_OP_ZONE_RESET_ALL, start, nr);
+		if (!ret)
+			return 0;
+
+		dmz_abort_reset(zmd, start, nr);
+	}
+
+	blk_start_plug(&plug);
+	for (int i = start; i < start + nr; i++) {
+		int err = dmz_reset_zone_async(zmd, i);
+		if (err)
+			ret = err;
 	}
+	blk_finish_plug(&plug);
 
-	return full;
+	return ret;
 }
 
-unsigned long *dmz_bitmap_alloc(unsigned long size) {
-	unsigned long *bitmap;
+void dmz_wait_zone_reset(struct dmz_metadata *zmd, int idx) {
+	struct dmz_zone *zone = zmd->zone_start;
 
-	bitmap = kzalloc(size, GFP_KERNEL);
-	if (!bitmap)
-		return NULL;
-	return bitmap;
+	wait_on_bit_io(&zone[idx].flags, DMZ_ZONE_RESETTING, TASK_UNINTERRUPTIBLE);
 }
 
-void dmz_bitmap_free(unsigned long *bitmap) {
-	kfree(bitmap);
+void dmz_wait_resets(struct dmz_metadata *zmd) {
+	wait_event(zmd->reset_wait, !atomic_read(&zmd->nr_resets));
 }
 
-void dmz_set_bit(struct dmz_metadata *zmd, unsigned long pos) {
-	unsigned long bitmap = (unsigned long)zmd->bitmap_start;
-	unsigned long index = pos >> 3, offset = pos & ((0x1 << 3) - 1); // a byte can contain 8 bit (8 blocks's validity)
-	bitmap += index;
-	char v = *((char *)bitmap);
-	v = v | (0x1 << offset);
-	*((char *)bitmap) = v;
-}
+/* Synchronous reset, only for callers which need the zone empty right now. */
+int dmz_reset_zone(struct dmz_metadata *zmd, int idx) {
+	struct dmz_zone *zone = zmd->zone_start;
+	int ret;
+
+	dmz_wait_zone_reset(zmd, idx);
 
-void dmz_clear_bit(struct dmz_metadata *zmd, unsigned long pos) {
-	unsigned long bitmap = (unsigned long)zmd->bitmap_start;
-	unsigned long index = pos >> 3, offset = pos & ((0x1 << 3) - 1); // a byte can contain 8 bit (8 blocks's validity)
-	bitmap += index;
-	char v = *((char *)bitmap);
-	v = v & (~(0x1 << offset));
-	*((char *)bitmap) = v;
+	ret = dmz_reset_zone_async(zmd, idx);
+	if (ret)
+		return ret;
+
+	dmz_wait_zone_reset(zmd, idx);
+
+	return zone[idx].wp ? -EIO : 0;
 }
 
-bool dmz_test_bit(struct dmz_metadata *zmd, unsigned long pos) {
-	unsigned long bitmap = (unsigned long)zmd->bitmap_start;
-	unsigned long index = pos >> 3, offset = pos & ((0x1 << 3) - 1); // a byte can contain 8 bit (8 blocks's validity)
-	bitmap += index;
-	char v = *((char *)bitmap);
-	v = v & (0x1 << offset);
-	return !!v;
+unsigned long *dmz_bitmap_alloc(unsigned long size) {
+	unsigned long *bitmap;
+
+	bitmap = kvzalloc(size, GFP_KERNEL);
+	if (!bitmap)
+		return NULL;
+	return bitmap;
 }
 
-void dmz_print_zones(struct dmz_metadata *zmd, char *tag) {
-	struct dmz_zone *z = zmd->zone_start;
-	for (int i = 0; i < zmd->nr_zones; i++) {
-		pr_info("%s zone %d: %x, we: %x", tag, i, z[i].wp, z[i].weight);
-	}
-}
\ No newline at end of file
+void dmz_bitmap_free(unsigned long *bitmap) {
+	kvfree(bitmap);
+}
@@ -3,8 +3,18 @@
 
 #include "dmz.h"
 
+void dmz_dirty_mt(struct dmz_metadata *zmd, unsigned long lba);
+void dmz_dirty_rmt(struct dmz_metadata *zmd, unsigned long pba);
+void dmz_dirty_bitmap(struct dmz_metadata *zmd, unsigned long pos);
+int dmz_flush_do(struct dmz_target *dmz);
 int dmz_flush(struct dmz_target *dmz);
 
+void dmz_meta_batch_init(struct dmz_metadata *zmd, struct dmz_meta_batch *batch);
+int dmz_flush_data_dev(struct dmz_metadata *zmd);
+void dmz_meta_batch_submit(struct dmz_metadata *zmd, struct dmz_meta_batch *batch, unsigned int op, unsigned int op_flags, unsigned long pba, void *buf, unsigned long nr_blocks);
+int dmz_meta_batch_wait(struct dmz_meta_batch *batch);
+int dmz_submit_bio_sync(struct dmz_metadata *zmd, struct bio *bio);
+
 int dmz_locks_init(struct dmz_metadata *zmd);
 void dmz_locks_cleanup(struct dmz_metadata *zmd);
 
@@ -24,20 +34,21 @@ void dmz_unlock_map(struct dmz_metadata *zmd, int zone);
 int dmz_lock_reclaim(struct dmz_metadata *zmd);
 void dmz_unlock_reclaim(struct dmz_metadata *zmd);
 
+void dmz_lock_journal(struct dmz_metadata *zmd);
+void dmz_unlock_journal(struct dmz_metadata *zmd);
+
 int dmz_open_zone(struct dmz_metadata *zmd, int zone);
 int dmz_close_zone(struct dmz_metadata *zmd, int zone);
 int dmz_finish_zone(struct dmz_metadata *zmd, int zone);
 int dmz_reset_zone(struct dmz_metadata *zmd, int zone);
+int dmz_reset_zone_async(struct dmz_metadata *zmd, int zone);
+int dmz_reset_zones_async(struct dmz_metadata *zmd, int start, int nr);
+void dmz_wait_zone_reset(struct dmz_metadata *zmd, int zone);
+void dmz_wait_resets(struct dmz_metadata *zmd);
 
 void dmz_check_zones(struct dmz_metadata *zmd);
-bool dmz_is_full(struct dmz_metadata *zmd);
 
 unsigned long *dmz_bitmap_alloc(unsigned long size);
 void dmz_bitmap_free(unsigned long* bitmap);
-void dmz_set_bit(struct dmz_metadata *zmd, unsigned long pos);
-void dmz_clear_bit(struct dmz_metadata *zmd, unsigned long pos);
-bool dmz_test_bit(struct dmz_metadata *zmd, unsigned long pos);
-
-void dmz_print_zones(struct dmz_metadata* zmd, char* tag);
 
 #endif
\ No newline at end of file
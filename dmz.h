@@ -11,6 +11,7 @@
 #ifndef _DMZ_H_
 #define _DMZ_H_
 
+#ifdef __KERNEL__
 #include <linux/types.h>
 #include <linux/blkdev.h>
 #include <linux/device-mapper.h>
@@ -29,6 +30,11 @@
 #include <linux/blk-mq.h>
 #include <linux/workqueue.h>
 #include <linux/delay.h>
+#include <linux/sort.h>
+#else
+// Userspace build of the FTL core, see sim/.
+#include "dmz-compat.h"
+#endif
 
 #define KB (1 << 10)
 #define MB (1 << 20)
@@ -58,6 +64,30 @@
 #define DMZ_ZONE_NR_BLOCKS_SHIFT (16)
 #define DMZ_ZONE_NR_BLOCKS_MASK ((1 << DMZ_ZONE_NR_BLOCKS_SHIFT) - 1)
 
+/*
+ * Data zones are written in segments: DMZ_SEG_NR_DATA_BLOCKS data blocks followed by
+ * one summary block recording the lba and write sequence of each of them.
+ */
+#define DMZ_SEG_NR_BLOCKS_SHIFT (8)
+#define DMZ_SEG_NR_BLOCKS (1 << DMZ_SEG_NR_BLOCKS_SHIFT)
+#define DMZ_SEG_NR_BLOCKS_MASK (DMZ_SEG_NR_BLOCKS - 1)
+#define DMZ_SEG_NR_DATA_BLOCKS (DMZ_SEG_NR_BLOCKS - 1)
+#define DMZ_ZONE_NR_DATA_BLOCKS (((1 << DMZ_ZONE_NR_BLOCKS_SHIFT) >> DMZ_SEG_NR_BLOCKS_SHIFT) * DMZ_SEG_NR_DATA_BLOCKS)
+
+// data blocks below wp, summaries excluded
+#define dmz_wp_nr_data(wp) ((wp) - ((wp) >> DMZ_SEG_NR_BLOCKS_SHIFT))
+// data blocks left in the segment wp is in
+#define dmz_wp_seg_left(wp) (DMZ_SEG_NR_DATA_BLOCKS - ((wp)&DMZ_SEG_NR_BLOCKS_MASK))
+
+/*
+ * Blocks needed to persist the mapping (or reverse mapping) and the bitmap of one zone.
+ */
+#define DMZ_ZONE_MT_BLOCKS DIV_ROUND_UP(sizeof(struct dmz_map) << DMZ_ZONE_NR_BLOCKS_SHIFT, DMZ_BLOCK_SIZE)
+#define DMZ_ZONE_BITMAP_BLOCKS DIV_ROUND_UP((1 << DMZ_ZONE_NR_BLOCKS_SHIFT) >> 3, DMZ_BLOCK_SIZE)
+
+// mappings in one block of a mapping table
+#define DMZ_MAP_PER_BLOCK_SHIFT (DMZ_BLOCK_SHIFT - 3)
+
 /*
  * 4KB block <-> 512B sector conversion.
  */
@@ -76,19 +106,80 @@
 #define dmz_is_default_pba(pba) (!(~pba))
 
 #define DMZ_IS_SEQ(zone) ((zone)->type == DMZ_ZONE_SEQ)
+// metadata on its own device: its zones are plain block ranges there, all zones of the target hold data
+#define DMZ_HAS_META_DEV(zmd) ((zmd)->meta_bdev != (zmd)->target_bdev)
 #define DMZ_IS_RND(zone) ((zone)->type == DMZ_ZONE_RND)
+#define DMZ_IS_CACHE(zone) test_bit(DMZ_ZONE_CACHE, &(zone)->flags)
 
 #define DMZ_MIN_BIOS 8192
 
+/*
+ * Zoned devices one target spans. Metadata zones stay at the front of the first device,
+ * data zones after them are interleaved: consecutive zones sit on consecutive devices.
+ */
+#define DMZ_MAX_DEVS 8
+
+#define DMZ_MAGIC ((__u64)0x484d5a44) // "DZMH"
+#define DMZ_SUMMARY_MAGIC ((__u32)0x535a4d44) // "DMZS"
+#define DMZ_DELTA_MAGIC ((__u64)0x445a4d44) // "DMZD"
+
+/*
+ * Number of checkpoint slots. Checkpoints alternate between the slots so that the
+ * previous one stays intact until the new superblock is durable.
+ */
+#define DMZ_NR_CKPT_SLOTS 2
+
+/*
+ * Mapping journal, placed right after the checkpoint slots.
+ */
+#define DMZ_NR_JOURNAL_ZONES 1
+#define DMZ_JOURNAL_NR_BUFS 256
+// journal zone fill, in percent, that queues a checkpoint by default
+#define DMZ_JOURNAL_CKPT_PCT 75
+
+/*
+ * Conventional zone write cache. Writes of at most cache_max_blocks (DMZ_CACHE_MAX_BLOCKS by default) go there and overwrite
+ * their cached copy in place, destage moves a full cache zone out destage_batch
+ * (DMZ_DESTAGE_BATCH by default) blocks at a time.
+ */
+#define DMZ_CACHE_MAX_BLOCKS 8
+#define DMZ_DESTAGE_BATCH 1024
+
 enum DMZ_STATUS { DMZ_BLOCK_FREE, DMZ_BLOCK_INVALID, DMZ_BLOCK_VALID };
 enum DMZ_ZONE_TYPE { DMZ_ZONE_NONE, DMZ_ZONE_SEQ, DMZ_ZONE_RND };
 
-extern int RESERVED_ZONE_ID;
+/*
+ * Zone state flags (bit numbers in dmz_zone->flags).
+ */
+enum {
+	DMZ_ZONE_RESETTING, // reset issued, zone is not back in the free pool yet
+	DMZ_ZONE_CACHE, // conventional zone caching small writes, never allocated to other writes
+	DMZ_ZONE_DESTAGING, // destage of the cache zone is queued
+};
 
+/*
+ * Checkpoint superblock. It is the last block of a checkpoint slot and is written
+ * (with PREFLUSH|FUA) after everything else of the checkpoint, so a valid one
+ * commits the whole slot. Block offsets are relative to the start of the slot.
+ */
 struct dmz_super {
 	__u64 magic; // 8
 
-	__u64 zones_info; // 8;
+	__u64 gen; // 8, checkpoint generation, the valid slot with the highest one wins
+
+	__u64 nr_zones; // 8
+	__u64 nr_meta_zones; // 8
+
+	__u64 zones_info; // 8, zone descriptors
+	__u64 mt_info; // 8, mapping tables
+	__u64 rmt_info; // 8, reverse mapping tables
+	__u64 bitmap_info; // 8, validity bitmap
+
+	__u64 reserved_zone; // 8, zone reclaim copies valid blocks into
+	__u64 write_seq; // 8, last write sequence handed out before the checkpoint
+
+	__u32 crc; // 4, crc32 of this struct with crc set to 0
+	__u32 pad; // 4
 
 	__u8 dmz_uuid[16];
 
@@ -96,12 +187,211 @@ struct dmz_super {
 
 	__u8 dmz_label[32];
 
-	__u8 reserved[432];
+	__u32 nr_devs; // 4, zoned devices of the volume, 0 in checkpoints older than this field (one device)
+	__u32 pad2; // 4
+	__u32 dev_nr_zones[DMZ_MAX_DEVS]; // 32, zones reported by each device, in table order
+
+	__u8 reserved[320];
+};
+
+/*
+ * Delta checkpoint header. Deltas are appended to the slot of the latest checkpoint and hold only
+ * the checkpoint blocks changed since: this header, the checkpoint index of each block (__u32 each,
+ * DMZ_DELTA_IDX_PER_BLOCK per block), the blocks themselves, then a superblock committing them.
+ */
+struct dmz_delta {
+	__u64 magic; // 8
+	__u64 gen; // 8, generation the delta commits, one above the previous checkpoint
+	__u64 nr_blocks; // 8
+	__u32 crc; // 4, crc32 of the block with crc set to 0
+	__u32 pad; // 4
+
+	__u8 reserved[4064];
+};
+
+#define DMZ_DELTA_IDX_PER_BLOCK (DMZ_BLOCK_SIZE / sizeof(__u32))
+
+/* One mapping change, logged when a write (or a reclaim copy) completes. */
+struct dmz_journal_entry {
+	__u64 lba;
+	__u64 old_pba;
+	__u64 new_pba;
+};
+
+#define DMZ_JOURNAL_NR_ENTRIES ((DMZ_BLOCK_SIZE - 32) / sizeof(struct dmz_journal_entry))
+
+/*
+ * On-disk journal block. Blocks are appended to the journal zone in seq order and
+ * only apply on top of the checkpoint of the same generation.
+ */
+struct dmz_journal_block {
+	__u64 magic; // 8
+	__u64 gen; // 8
+	__u64 seq; // 8
+	__u32 nr_entries; // 4
+	__u32 crc; // 4, crc32 of the block with crc set to 0
+
+	struct dmz_journal_entry entries[DMZ_JOURNAL_NR_ENTRIES];
+	__u8 pad[DMZ_BLOCK_SIZE - 32 - DMZ_JOURNAL_NR_ENTRIES * sizeof(struct dmz_journal_entry)];
+};
+
+struct dmz_summary_entry {
+	__u64 lba; // ~0 if the block holds no data
+	__u64 seq; // write sequence, the highest one of an lba is its current copy
+};
+
+/*
+ * Segment summary, the last block of every segment. Written once all data blocks of
+ * the segment are allocated, a scan of all summaries rebuilds the whole mapping.
+ */
+struct dmz_summary {
+	__u32 magic; // 4
+	__u32 crc; // 4, crc32 of the block with crc set to 0
+	__u64 pba; // 8, where this summary lives, rejects stale or misplaced blocks
+
+	struct dmz_summary_entry entries[DMZ_SEG_NR_DATA_BLOCKS];
+};
+
+/*
+ * Mapping dump streamed by the debugfs "map" file: this header, one __le64 per lba of the volume (pba, with
+ * DMZ_MAP_DUMP_VALID if the block is valid, ~0 if unmapped), one __le64 per zone (wp, weight << 32), then a trailer.
+ * The dump is consistent if the generations of header and trailer are even and equal, see scripts/map-report.py.
+ */
+#define DMZ_MAP_DUMP_MAGIC ((__u64)0x504d5a44) // "DZMP"
+#define DMZ_MAP_DUMP_VALID (1ULL << 63)
+
+struct dmz_map_dump_hdr {
+	__le64 magic;
+	__le64 version;
+	__le64 record_size;
+	__le64 nr_lbas;
+	__le64 nr_zones;
+	__le64 zone_nr_blocks;
+	__le64 gen; // mapping generation when the header was read
+	__le64 reserved;
+};
+
+struct dmz_map_dump_trailer {
+	__le64 magic;
+	__le64 gen; // mapping generation when the trailer was read
+};
+
+/* On-disk zone descriptor, the persistent part of struct dmz_zone. */
+struct dmz_zone_desc {
+	__u32 wp;
+	__u32 weight;
+	__u32 type;
+	__u32 reserved;
+};
+
+/*
+ * In-memory mapping journal. Entries are appended to a ring of journal blocks from
+ * any context; full blocks between tail and head are written out by the journal work.
+ */
+struct dmz_journal {
+	struct dmz_target *dmz;
+
+	int zone; // journal zone
+	unsigned long wp; // blocks written to the journal zone since the last checkpoint
+
+	u64 gen; // checkpoint generation the journal applies to
+	u64 seq; // seq of the next journal block
+
+	// ring of in-memory blocks, [tail, head) are full, head is being filled
+	spinlock_t lock;
+	struct dmz_journal_block *blocks;
+	unsigned long head;
+	unsigned long tail;
+	bool overflow; // entries were dropped, only a checkpoint can persist them now
+	bool unflushed; // journal blocks were written without FUA since the last commit
+	atomic_t nr_inplace; // in-place cache overwrites completed since the last cache flush, they log nothing
+
+	// serializes journal writes and checkpoints
+	struct mutex write_lock;
+
+	struct workqueue_struct *wq;
+	struct work_struct write_work;
+	struct work_struct ckpt_work;
+
+	// group commit: FLUSH and FUA bios waiting for the next commit, all served by one
+	struct list_head flush_bios;
+	struct work_struct flush_work;
+};
+
+struct dmz_zdev {
+	struct dm_dev *ddev;
+	struct block_device *bdev;
+	unsigned int nr_zones; // zones the device reports
+};
+
+struct dmz_devs {
+	unsigned int nr;
+	unsigned int nr_zones; // total the target uses, nr_meta_zones + nr * nr_dev_zones
+	unsigned int nr_meta_zones;
+	unsigned int nr_dev_zones; // data zones used on each device
+	struct dmz_zdev dev[DMZ_MAX_DEVS];
+};
+
+/* Latency histograms: log2 buckets of nanoseconds, the last one takes everything above. */
+enum { DMZ_LAT_READ, DMZ_LAT_WRITE, DMZ_LAT_FLUSH, DMZ_LAT_DISCARD, DMZ_LAT_ALLOC, DMZ_LAT_RECLAIM_LOCK, DMZ_LAT_RECLAIM, DMZ_LAT_NR };
+#define DMZ_LAT_BUCKETS 36
+#define DMZ_LAT_NONE (-1) // bios not accounted, e.g. unsupported ops
+
+/* Sleeping locks of the IO path. Waits are only timed when the lock was contended. */
+enum { DMZ_LOCK_RECLAIM, DMZ_LOCK_IO, DMZ_LOCK_JOURNAL, DMZ_LOCK_NR };
+
+struct dmz_lock_stats {
+	u64 acquired;
+	u64 contended;
+	u64 wait_ns;
+};
+
+/*
+ * Counters in blocks, kept per CPU and only summed when read through debugfs.
+ * Device writes count everything that reaches the devices: data, summaries, reclaim, journal and checkpoints.
+ */
+struct dmz_stats {
+	u64 host_read_blocks;
+	u64 host_write_blocks;
+	u64 dev_write_blocks;
+	u64 reclaim_blocks;
+	u64 destage_blocks;
+	u64 reclaims;
+	u64 alloc_stalls;
+	u64 lat[DMZ_LAT_NR][DMZ_LAT_BUCKETS];
+	struct dmz_lock_stats locks[DMZ_LOCK_NR];
+};
+
+/*
+ * Sampled LBA heatmap, per CPU. The logical space is cut in DMZ_HEAT_NR_REGIONS regions of 1 << heat_shift blocks,
+ * one bio in heat_sample adds its blocks to its region. Small enough for a per-CPU allocation, which u64 counts
+ * would not be, so the counts saturate at U32_MAX.
+ */
+#define DMZ_HEAT_NR_REGIONS 2048
+
+struct dmz_heat {
+	u32 seq;
+	u32 read[DMZ_HEAT_NR_REGIONS];
+	u32 write[DMZ_HEAT_NR_REGIONS];
+};
+
+/*
+ * Policy knobs. Table options set them at load, "dmsetup message" changes them under live IO, see dmz-create.c.
+ * Readers take a single READ_ONCE snapshot, a change applies from the next decision on.
+ */
+struct dmz_tunables {
+	unsigned int cache_max_blocks; // largest write that goes to the cache
+	unsigned int destage_batch; // blocks of a cache zone destaged per batch
+	unsigned int reclaim_invalid_pct; // invalid blocks, in percent, for a zone to be reclaimed as soon as it fills
+	unsigned int ckpt_pct; // journal zone fill, in percent, that queues a checkpoint
 };
 
 struct dmz_metadata {
 	struct dmz_dev *dev;
+	struct dmz_devs *devs;
 	struct block_device *target_bdev;
+	// checkpoint slots and journal, target_bdev itself unless a separate metadata device is used
+	struct block_device *meta_bdev;
 
 	unsigned long capacity;
 	char name[BDEVNAME_SIZE];
@@ -122,6 +412,18 @@ struct dmz_metadata {
 	int nr_zone_bitmap_need_blocks;
 	int nr_zone_struct_need_blocks;
 
+	// checkpoint layout, zones [0, nr_meta_zones) hold DMZ_NR_CKPT_SLOTS slots of nr_slot_zones each.
+	unsigned long nr_ckpt_blocks;
+	int nr_slot_zones;
+	int nr_meta_zones;
+	unsigned long ckpt_gen;
+	int ckpt_slot; // slot holding the latest checkpoint
+	unsigned long ckpt_wp; // blocks used in that slot, deltas are appended there
+	u32 fail_ckpt_delta; // fault injection, number of delta checkpoints to tear
+
+	// checkpoint blocks changed since the latest checkpoint, indexed like the checkpoint layout
+	unsigned long *ckpt_dirty;
+
 	struct dmz_super *sblk;
 
 	struct dmz_zone *zone_start;
@@ -129,12 +431,48 @@ struct dmz_metadata {
 
 	int useable_start;
 
+	// zone reclaim copies valid blocks into, it never holds any outside of a reclaim
+	int reserved_zone;
+	// zone the next write allocation starts looking at
+	unsigned int tgt_zone;
+
+	// bumped before and after every change of mapping, validity or zone wp, see dmz_map_gen
+	atomic64_t map_gen_begin;
+	atomic64_t map_gen_end;
+
 	// locks
 	spinlock_t meta_lock;
+	unsigned long meta_flags;
+	unsigned long *zone_lock_flags;
 	struct mutex reclaim_lock;
 	struct mutex freezone_lock;
 
 	struct workqueue_struct* reclaim_wq;
+
+	// in-flight zone resets
+	atomic_t nr_resets;
+	wait_queue_head_t reset_wait;
+
+	struct dmz_journal journal;
+
+	// write sequence, stamped into segment summaries
+	atomic64_t write_seq;
+
+	// conventional zones caching small writes, cache_cur indexes the one being filled
+	int nr_cache_zones;
+	unsigned int max_cache_zones;
+	bool poll; // poll the zoned devices for synchronous internal IO
+
+	// policy knobs, changed at runtime
+	struct dmz_tunables tun;
+
+	struct dmz_stats __percpu *stats;
+	struct dmz_heat __percpu *heat;
+	unsigned int heat_shift;
+	u32 heat_sample; // 0 disables the heatmap
+	struct dentry *debugfs_dir;
+	int *cache_zones;
+	int cache_cur;
 };
 
 /**
@@ -160,6 +498,30 @@ struct dmz_resubmit_work {
 	struct dmz_target* dmz;
 };
 
+/**
+ * @brief Per-bio context, it lives in the dm per-bio data (per_io_data_size).
+ * 
+ */
+struct dmz_bioctx {
+	struct dmz_metadata *zmd;
+	atomic_t ref; // clones in flight, plus one while the bio is being mapped
+	blk_status_t status;
+	struct list_head flush_entry; // on the journal group commit list
+	u64 start_ns; // when dm mapped the bio
+	int lat_type; // DMZ_LAT_READ .. DMZ_LAT_DISCARD, or DMZ_LAT_NONE
+};
+
+/**
+ * @brief A batch of metadata bios in flight, waited for all at once.
+ * 
+ */
+struct dmz_meta_batch {
+	struct block_device *bdev;
+	atomic_t pending;
+	blk_status_t status;
+	struct completion done;
+};
+
 /** Note: sizeof(struct dmz_map) must be power of 2 to make sure block_size is aligned to sizeof(struct dmz_map) **/
 struct dmz_map {
 	unsigned long block_id;
@@ -176,28 +538,36 @@ struct dmz_dev {
 	unsigned int nr_zones;
 	unsigned long nr_zone_sectors;
 
-	struct request_queue *queue;
-	struct gendisk *disk;
-
-	struct blk_mq_tag_set set;
 };
 
 /*
  * Target descriptor.
  */
 struct dmz_target {
+	struct dm_target *ti;
+
 	struct dmz_dev *dev;
 
 	struct dmz_metadata *zmd;
 
 	unsigned int flags;
 
+	// zoned devices, the first one is target_bdev
+	struct dmz_devs devs;
 	struct block_device *target_bdev;
+	// optional regular device holding checkpoints and journal, NULL if they live on target_bdev
+	struct dm_dev *meta_ddev;
+	struct block_device *meta_bdev;
+
+	// table options, see dmz-create.c
+	unsigned int max_cache_zones;
+	bool poll;
+	unsigned int op_ratio;
+	unsigned int nr_reserved_zones;
+	struct dmz_tunables tun;
 
 	// if we want to clone bios, bio_set is neccessary.
 	struct bio_set bio_set;
-
-	refcount_t ref;
 };
 
 /** make sure size is power of 2 in order to fit one block size. **/
@@ -207,45 +577,61 @@ struct dmz_zone {
 	unsigned long *bitmap; // 8
 
 	int type; // 4
+	// device write pointer (in blocks, FULL and conventional zones count as full) and condition at load
+	unsigned int dev_wp; // 4
+	unsigned char cond; // 1
+
+	unsigned long flags; // 8
 
 	// Mapping Table
 	struct dmz_map *mt; // 8
 	// Reverse Mapping Table，when block store mappings(which has no lba), store corresponding zone.
 	struct dmz_map *reverse_mt; // 8
 
-	// mt block pbn
-	unsigned long mt_blk_n; // 8
-	// reverse mt block pbn
-	unsigned long rmt_blk_n; // 8
-	// bitmap block pbn
-	unsigned long bitmap_blk_n; // 8
-
 	// lock for wp
 	spinlock_t lock; // 4
 
 	// lock for io
 	struct mutex io_lock; // 32
+	// io_lock of this zone alone, updated by its holder
+	struct dmz_lock_stats io_lock_stats;
 	// lock for mapping and bitmap
 	struct mutex map_lock; // 32
 
 	struct workqueue_struct *write_wq; // 8
+
+	// summary of the segment being filled, and the work writing it once the segment is complete
+	struct dmz_summary *summary; // 8
+	struct work_struct summary_work;
+	struct dmz_metadata *zmd; // 8
 };
 
 int dmz_ctr_reclaim(void);
 int dmz_reclaim_zone(struct dmz_target *dmz, int zone);
+void dmz_reclaim_queue(struct dmz_target *dmz, int zone);
+int dmz_reclaim_move(struct dmz_target *dmz, unsigned long lba, unsigned long pba);
 
-unsigned long dmz_get_map(struct dmz_metadata *zmd, unsigned long lba);
 void dmz_update_map(struct dmz_target *dmz, unsigned long lba, unsigned long pba);
 
 int dmz_pba_alloc(struct dmz_target *dmz);
+int dmz_pba_alloc_n(struct dmz_target *dmz, int nblocks);
+int dmz_alloc_stall(struct dmz_target *dmz);
 unsigned long dmz_reclaim_pba_alloc(struct dmz_target *dmz, int reclaim_zone);
 
 int dmz_map(struct dmz_target *dmz, struct bio *bio);
+void dmz_bioctx_endio(struct dmz_bioctx *bioctx, blk_status_t status);
 
 void dmz_reclaim_work_process(struct work_struct *work);
 
 /** functions defined in dmz-metadata.h depends on structs defined above. **/
 #include "dmz-metadata.h"
 #include "dmz-utils.h"
+#include "dmz-journal.h"
+#include "dmz-summary.h"
+#include "dmz-cache.h"
+#include "dmz-devs.h"
+#include "dmz-stats.h"
+#include "dmz-ftl.h"
+#include "dmz-policy.h"
 
 #endif
@@ -0,0 +1,90 @@
+#!/usr/bin/env python3
+#
+# Reports of scripts/bench.sh.
+#   summarize: one JSON line from the fio JSON output of a job and the target stats before and after it.
+#   compare:   job by job change between two reports, e.g. two builds.
+#
+
+import argparse
+import json
+import sys
+
+PERCENTILES = {"p50": "50.000000", "p99": "99.000000", "p999": "99.900000"}
+
+
+def read_stats(path):
+    stats = {}
+    with open(path) as f:
+        for line in f:
+            key, _, val = line.partition(":")
+            if val.strip().isdigit():
+                stats[key.strip()] = int(val)
+    return stats
+
+
+def summary(job_name, build, fio_json, before, after):
+    with open(fio_json) as f:
+        job = json.load(f)["jobs"][0]
+    before, after = read_stats(before), read_stats(after)
+    delta = {k: after[k] - before.get(k, 0) for k in after if k.endswith(("_bytes", "reclaims", "alloc_stalls"))}
+
+    out = {"job": job_name, "build": build}
+    for op in ("read", "write", "trim"):
+        res = job.get(op)
+        if not res or not res["io_bytes"]:
+            continue
+        out[op + "_iops"] = round(res["iops"])
+        out[op + "_bw_kib"] = res["bw"]
+        pct = res["clat_ns"].get("percentile", {})
+        for name, key in PERCENTILES.items():
+            out["%s_%s_us" % (op, name)] = round(pct.get(key, 0) / 1000, 1)
+
+    out.update(delta)
+    host = delta.get("host_write_bytes", 0)
+    out["waf"] = round(delta.get("dev_write_bytes", 0) / host, 3) if host else 0
+    return out
+
+
+def summarize(args):
+    print(json.dumps(summary(args.job, args.build, args.fio, args.before, args.after), sort_keys=True))
+
+
+def load(path):
+    with open(path) as f:
+        return {r["job"]: r for r in map(json.loads, f) if r}
+
+
+def compare(args):
+    a, b = load(args.a), load(args.b)
+    for job in sorted(set(a) & set(b)):
+        for key in sorted(set(a[job]) & set(b[job])):
+            va, vb = a[job][key], b[job][key]
+            if not isinstance(va, (int, float)) or va == vb:
+                continue
+            change = "%+.1f%%" % ((vb - va) * 100 / va) if va else "new"
+            print("%-16s %-24s %14s %14s %10s" % (job, key, va, vb, change))
+
+
+def main():
+    parser = argparse.ArgumentParser()
+    sub = parser.add_subparsers(dest="cmd", required=True)
+
+    p = sub.add_parser("summarize")
+    p.add_argument("--job", required=True)
+    p.add_argument("--build", default="unknown")
+    p.add_argument("fio")
+    p.add_argument("before")
+    p.add_argument("after")
+    p.set_defaults(func=summarize)
+
+    p = sub.add_parser("compare")
+    p.add_argument("a")
+    p.add_argument("b")
+    p.set_defaults(func=compare)
+
+    args = parser.parse_args()
+    args.func(args)
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,71 @@
+#!/bin/bash
+#
+# Benchmark suite on zoned null_blk. Every job in fio/bench runs on a freshly created target, the report gets one
+# JSON line per job with throughput, latency percentiles and the WAF the target counted while the job ran.
+#
+# Usage: sudo scripts/bench.sh [-z <nr seq zones>] [-r <runtime s>] [-o <report>] [-t "<opt args>"] [job...]
+#
+
+set -e
+
+scriptdir=$(cd $(dirname "$0") && pwd)
+topdir=$(dirname "$scriptdir")
+jobdir="$topdir/fio/bench"
+
+nr_zones=16
+runtime=60
+report=
+opts=
+while getopts "z:r:o:t:" opt; do
+	case $opt in
+	z) nr_zones=$OPTARG ;;
+	r) runtime=$OPTARG ;;
+	o) report=$OPTARG ;;
+	t) opts=$OPTARG ;;
+	*) sed -n 6p "$0"; exit 1 ;;
+	esac
+done
+shift $((OPTIND - 1))
+
+jobs=${@:-$(ls "$jobdir" | grep -v '\.inc$')}
+build=$(git -C "$topdir" describe --always --dirty 2>/dev/null || echo unknown)
+report=${report:-bench-$build-$(date +%Y%m%d-%H%M%S).jsonl}
+tmp=$(mktemp -d)
+trap 'dmsetup remove dmz-bench 2>/dev/null; rm -rf "$tmp"' EXIT
+
+if ! lsmod | grep -q '^dmzoned'; then
+	make -C "$topdir"
+	insmod "$topdir/dmzoned.ko"
+fi
+
+mountpoint -q /sys/kernel/debug || mount -t debugfs none /sys/kernel/debug
+
+bdev=/dev/nullb$(bash "$scriptdir/nullblk.sh" 4096 256 0 $nr_zones | sed -n 's/^Created \/dev\/nullb//p')
+
+# <#opt args> counts words, dmsetup needs it in front of the options.
+table="0 $(blockdev --getsz $bdev) dmzoned $bdev"
+[ -n "$opts" ] && table="$table $(echo $opts | wc -w) $opts"
+
+for job in $jobs; do
+	# Every job starts from an empty volume: zones reset, the target formats them again.
+	dmsetup remove dmz-bench 2>/dev/null || true
+	blkzone reset $bdev
+	echo "$table" | dmsetup create dmz-bench
+	udevadm settle
+
+	export DMZ_DEV=/dev/mapper/dmz-bench DMZ_RUNTIME=$runtime
+	stats=/sys/kernel/debug/dmzoned/$(basename $(readlink -f $DMZ_DEV))/stats
+
+	if grep -q '^\[prefill\]' "$jobdir/$job"; then
+		fio --section=prefill "$jobdir/$job" >/dev/null
+	fi
+
+	cp $stats "$tmp/before"
+	fio --section=run --output-format=json --output="$tmp/fio.json" "$jobdir/$job"
+	cp $stats "$tmp/after"
+
+	python3 "$scriptdir/bench-report.py" summarize --job $job --build $build "$tmp/fio.json" "$tmp/before" "$tmp/after" | tee -a "$report"
+done
+
+dmsetup remove dmz-bench
+echo "Report: $report"
@@ -0,0 +1,51 @@
+#!/bin/bash
+# A delta checkpoint torn by a write error must not stop checkpointing: the target falls back to a full one and
+# later checkpoints keep working. fail_ckpt_delta in debugfs tears the next delta after its header is written.
+# Usage: sudo scripts/ckpt-fault-test.sh
+
+set -e
+
+bdev=/dev/nullb$(bash scripts/nullblk.sh 4096 256 0 16 | sed -n 's/^Created \/dev\/nullb//p')
+table="0 $(blockdev --getsz $bdev) dmzoned $bdev"
+name=dmz-ckpt-fault
+ko=dmzoned.ko
+
+make
+lsmod | grep -q '^dmzoned' || insmod $ko
+mountpoint -q /sys/kernel/debug || mount -t debugfs none /sys/kernel/debug
+trap 'dmsetup remove $name 2>/dev/null' EXIT
+
+# fio writes a verifiable pattern at offset $1, or checks every pattern written so far with verify.
+run() {
+	fio --name=ckpt --filename=/dev/mapper/$name --ioengine=libaio --direct=1 --bs=4k --iodepth=16 --rw=randwrite \
+		--size=64m --offset=$1 --verify=crc32c --verify_state_save=0 $2 >/dev/null
+}
+
+# Load the target, check the data at offset $1, write new data at $3, then unload it, which checkpoints.
+# With $2 set, the delta checkpoint at unload is torn.
+cycle() {
+	echo "$table" | dmsetup create $name
+	udevadm settle
+	[ -z "$1" ] || run $1 --verify_only
+	[ -z "$3" ] || run $3 --do_verify=0
+	[ -z "$2" ] || echo 1 >/sys/kernel/debug/dmzoned/$(basename $(readlink -f /dev/mapper/$name))/fail_ckpt_delta
+	dmesg --clear
+	dmsetup remove $name
+	if [ -n "$2" ] && ! dmesg | grep -q "Checkpoint write failed"; then
+		echo "FAIL: no delta checkpoint was torn"
+		exit 1
+	fi
+	if dmesg | grep -q "Checkpoint at suspend failed"; then
+		echo "FAIL: checkpoint after a torn delta failed"
+		exit 1
+	fi
+}
+
+blkzone reset $bdev
+cycle "" tear 0
+# The fallback full checkpoint went to the other slot, deltas append there again.
+cycle 0 "" 128m
+cycle 128m tear 256m
+cycle 256m
+
+echo PASS
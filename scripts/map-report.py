@@ -0,0 +1,145 @@
+#!/usr/bin/env python3
+#
+# Offline analysis of the mapping dump of a target (debugfs "map" file, layout in dmz.h): how many lbas are mapped
+# and valid, how fragmented the mapping is (extents of consecutive lbas on consecutive pbas and their lengths) and
+# how full of valid data every zone is. The dump is read again while the mapping changes under it.
+#
+# Discard clears the valid bit of a block but keeps its mapping and the weight of its zone, so a zone weight may
+# exceed its valid blocks by up to its discarded (mapped, not valid) ones. Only a weight outside that range is
+# reported as a mismatch, with exit status 1.
+#
+# Usage: sudo scripts/map-report.py [--dev dm-0 | --file dump] [--save dump] [--json]
+#
+
+import argparse
+import array
+import json
+import sys
+
+MAGIC = 0x504d5a44
+VALID = 1 << 63
+UNMAPPED = (1 << 64) - 1
+HDR_WORDS, TRAILER_WORDS = 8, 2
+SEG_NR_BLOCKS_SHIFT = 8
+
+
+def read_dump(path, retries):
+    """Return (header dict, records, zone words) of a consistent dump."""
+    for _ in range(retries):
+        with open(path, "rb") as f:
+            raw = f.read()
+        words = array.array("Q", raw)
+        if sys.byteorder == "big":
+            words.byteswap()
+
+        if len(words) < HDR_WORDS + TRAILER_WORDS or words[0] != MAGIC:
+            raise SystemExit("%s: not a mapping dump" % path)
+        magic, version, record_size, nr_lbas, nr_zones, zone_nr_blocks, gen, _ = words[:HDR_WORDS]
+        if version != 2 or record_size != 8 or len(words) != HDR_WORDS + nr_lbas + nr_zones + TRAILER_WORDS:
+            raise SystemExit("%s: unsupported dump, version %d, %d bytes" % (path, version, len(raw)))
+
+        # An odd generation means a change was under way.
+        if words[-TRAILER_WORDS] == MAGIC and gen % 2 == 0 and words[-1] == gen:
+            hdr = {"nr_lbas": nr_lbas, "nr_zones": nr_zones, "zone_nr_blocks": zone_nr_blocks, "gen": gen}
+            records = words[HDR_WORDS:HDR_WORDS + nr_lbas]
+            return hdr, records, words[HDR_WORDS + nr_lbas:HDR_WORDS + nr_lbas + nr_zones], raw
+    raise SystemExit("%s: mapping kept changing over %d reads, quiesce the target" % (path, retries))
+
+
+def analyze(hdr, records, zones):
+    zone_nr_blocks = hdr["zone_nr_blocks"]
+    valid_per_zone = [0] * hdr["nr_zones"]
+    discarded_per_zone = [0] * hdr["nr_zones"]
+    hist = {}
+    mapped = valid = discarded = extents = 0
+    run, prev = 0, None
+
+    for rec in records:
+        if rec == UNMAPPED:
+            pba = None
+        else:
+            mapped += 1
+            pba = rec & ~VALID
+            if rec & VALID:
+                valid += 1
+                valid_per_zone[pba // zone_nr_blocks] += 1
+            else:
+                discarded += 1
+                discarded_per_zone[pba // zone_nr_blocks] += 1
+
+        # An extent is a run of lbas mapped to consecutive pbas.
+        if pba is not None and prev is not None and pba == prev + 1:
+            run += 1
+        else:
+            if run:
+                hist[run.bit_length() - 1] = hist.get(run.bit_length() - 1, 0) + 1
+                extents += 1
+            run = 1 if pba is not None else 0
+        prev = pba
+    if run:
+        hist[run.bit_length() - 1] = hist.get(run.bit_length() - 1, 0) + 1
+        extents += 1
+
+    out_zones = []
+    for i, word in enumerate(zones):
+        wp, weight = word & 0xffffffff, word >> 32
+        written = wp - (wp >> SEG_NR_BLOCKS_SHIFT)
+        out_zones.append({"zone": i, "wp": wp, "weight": weight, "valid": valid_per_zone[i],
+                          "discarded": discarded_per_zone[i],
+                          "valid_ratio": round(valid_per_zone[i] / written, 3) if written else 0})
+
+    return {
+        "gen": hdr["gen"],
+        "nr_lbas": hdr["nr_lbas"],
+        "mapped": mapped,
+        "valid": valid,
+        "discarded": discarded,
+        "extents": extents,
+        "mean_extent_blocks": round(mapped / extents, 1) if extents else 0,
+        # bucket b counts the extents of 2^b to 2^(b+1)-1 blocks
+        "extent_hist_log2": {str(b): hist[b] for b in sorted(hist)},
+        "zones": out_zones,
+        "weight_mismatch": [z["zone"] for z in out_zones
+                            if not z["valid"] <= z["weight"] <= z["valid"] + z["discarded"]],
+    }
+
+
+def print_report(rep):
+    print("gen %d: %d lbas, %d mapped, %d valid, %d discarded" %
+          (rep["gen"], rep["nr_lbas"], rep["mapped"], rep["valid"], rep["discarded"]))
+    print("%d extents, %.1f blocks on average" % (rep["extents"], rep["mean_extent_blocks"]))
+    for b, n in rep["extent_hist_log2"].items():
+        print("  %8d - %-8d %10d" % (1 << int(b), (2 << int(b)) - 1, n))
+    print("%6s %8s %8s %9s %8s" % ("zone", "wp", "valid", "discarded", "ratio"))
+    for z in rep["zones"]:
+        if z["wp"]:
+            print("%6d %8d %8d %9d %8.3f" % (z["zone"], z["wp"], z["valid"], z["discarded"], z["valid_ratio"]))
+    if rep["weight_mismatch"]:
+        print("Zone weight is outside its valid and discarded blocks in zones %s" % rep["weight_mismatch"])
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Analyze the mapping dump of a dmzoned target.")
+    parser.add_argument("--dev", default="dm-0", help="disk name (dm-N) of the target")
+    parser.add_argument("--file", help="read a saved dump instead")
+    parser.add_argument("--save", help="also save the dump read")
+    parser.add_argument("--retries", type=int, default=5)
+    parser.add_argument("--json", action="store_true", help="print the report as JSON")
+    args = parser.parse_args()
+
+    path = args.file or "/sys/kernel/debug/dmzoned/%s/map" % args.dev
+    hdr, records, zones, raw = read_dump(path, args.retries)
+    if args.save:
+        with open(args.save, "wb") as f:
+            f.write(raw)
+
+    rep = analyze(hdr, records, zones)
+    if args.json:
+        print(json.dumps(rep, sort_keys=True))
+    else:
+        print_report(rep)
+    return 1 if rep["weight_mismatch"] else 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
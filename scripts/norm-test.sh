@@ -8,3 +8,10 @@ ko=dmzoned.ko
 
 make
 sudo insmod $ko
+# Table: <zoned dev> [<#opt args> <opt args>...], see dmz-create.c
+echo "0 $(sudo blockdev --getsz $bdev) dmzoned $bdev" | sudo dmsetup create dmz-test --table -
+sudo dmsetup table dmz-test
+# Advertised limits, mkfs picks its alignment from them.
+for l in logical_block_size physical_block_size minimum_io_size optimal_io_size discard_granularity discard_max_bytes max_segments zoned; do
+	echo "$l: $(cat /sys/block/$(basename $(readlink -f /dev/mapper/dmz-test))/queue/$l)"
+done
@@ -0,0 +1,125 @@
+#!/usr/bin/env python3
+#
+# Replay a blktrace capture, as printed by blkparse with its default format, against the target or the userspace
+# simulator. The target is driven by fio from an iolog with the original timing (or none with --asap), the
+# simulator gets the same requests in its own trace format. Both print the WAF, reclaim counters and, for the
+# target, latency percentiles per op.
+#
+# Usage: sudo scripts/replay.py [--dev /dev/dm-0 | --sim "<dmz-sim args>"] [--asap] [--action Q] trace.txt
+#
+
+import argparse
+import importlib
+import json
+import os
+import subprocess
+import sys
+import tempfile
+
+sys.path.insert(0, os.path.dirname(os.path.abspath(__file__)))
+report = importlib.import_module("bench-report")
+
+TOPDIR = os.path.dirname(os.path.dirname(os.path.abspath(__file__)))
+BLOCK_SHIFT, BLOCK_SECTORS_SHIFT = 12, 3
+
+
+def parse(path, action, dev):
+    """Yield (seconds, op, sector, nr_sectors) for each event of action, op is R, W, D or F."""
+    with open(path) as f:
+        for line in f:
+            fields = line.split()
+            # dev cpu seq time pid action rwbs [sector + nr_sectors [cmd]]
+            if len(fields) < 7 or fields[5] != action or (dev and fields[0] != dev):
+                continue
+            rwbs = fields[6]
+            flush = rwbs.startswith("F")
+            rwbs = rwbs[1:] if flush else rwbs
+            op = rwbs[:1] if rwbs[:1] in ("R", "W", "D") else None
+
+            if op and len(fields) >= 10 and fields[8] == "+":
+                yield float(fields[3]), op, int(fields[7]), int(fields[9])
+            elif flush:
+                yield float(fields[3]), "F", 0, 0
+
+
+def replay_sim(events, args):
+    sim = os.path.join(TOPDIR, "sim", "dmz-sim")
+    if not os.path.exists(sim):
+        subprocess.run(["make", "-C", os.path.dirname(sim)], check=True, stdout=subprocess.DEVNULL)
+
+    proc = subprocess.Popen([sim] + args.sim.split() + ["-T", "-"], stdin=subprocess.PIPE, text=True)
+    for _, op, sector, nr in events:
+        proc.stdin.write("%s %d %d\n" % (op, sector, nr))
+    proc.stdin.close()
+    return proc.wait()
+
+
+def write_iolog(events, path, dev, capacity):
+    """fio iolog version 3, timestamps in ms. Offsets past the end of the volume are folded into it.
+    The volume has 4K logical blocks and fio runs O_DIRECT, so every IO is widened to whole blocks as dmz-sim does."""
+    actions = {"R": "read", "W": "write", "D": "trim", "F": "sync"}
+    with open(path, "w") as f:
+        f.write("fio version 3 iolog\n0 %s add\n0 %s open\n" % (dev, dev))
+        start, ts = None, 0
+        for ts_s, op, sector, nr in events:
+            start = ts_s if start is None else start
+            ts = int((ts_s - start) * 1000)
+            if op == "F":
+                f.write("%d %s sync\n" % (ts, dev))
+                continue
+            nr_blocks = capacity >> BLOCK_SECTORS_SHIFT
+            block = (sector >> BLOCK_SECTORS_SHIFT) % nr_blocks
+            length = ((sector + max(nr, 1) - 1) >> BLOCK_SECTORS_SHIFT) - (sector >> BLOCK_SECTORS_SHIFT) + 1
+            offset = block << BLOCK_SHIFT
+            length = min(length, nr_blocks - block) << BLOCK_SHIFT
+            f.write("%d %s %s %d %d\n" % (ts, dev, actions[op], offset, length))
+        f.write("%d %s close\n" % (ts, dev))
+
+
+def replay_dev(events, args):
+    capacity = int(subprocess.check_output(["blockdev", "--getsz", args.dev]))
+    name = os.path.basename(os.path.realpath(args.dev))
+    stats = "/sys/kernel/debug/dmzoned/%s/stats" % name
+
+    with tempfile.TemporaryDirectory() as tmp:
+        iolog, out = os.path.join(tmp, "iolog"), os.path.join(tmp, "fio.json")
+        write_iolog(events, iolog, args.dev, capacity)
+
+        before = os.path.join(tmp, "before")
+        with open(stats) as src, open(before, "w") as dst:
+            dst.write(src.read())
+
+        subprocess.run(["fio", "--name=replay", "--ioengine=libaio", "--direct=1", "--iodepth=%d" % args.iodepth,
+                        "--read_iolog=%s" % iolog, "--replay_no_stall=%d" % args.asap, "--percentile_list=50:99:99.9",
+                        "--output-format=json", "--output=%s" % out], check=True)
+
+        after = os.path.join(tmp, "after")
+        with open(stats) as src, open(after, "w") as dst:
+            dst.write(src.read())
+
+        build = subprocess.run(["git", "-C", TOPDIR, "describe", "--always", "--dirty"], capture_output=True, text=True).stdout.strip()
+        print(json.dumps(report.summary(os.path.basename(args.trace), build or "unknown", out, before, after), sort_keys=True))
+    return 0
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Replay blkparse output against the target or the simulator.")
+    parser.add_argument("trace", help="blkparse output, default format")
+    parser.add_argument("--dev", default="/dev/dm-0", help="target to replay against")
+    parser.add_argument("--sim", help="replay in sim/dmz-sim instead, with these arguments")
+    parser.add_argument("--asap", action="store_true", help="ignore the original timing")
+    parser.add_argument("--action", default="Q", help="blktrace action to replay, Q (queued) or D (issued)")
+    parser.add_argument("--trace-dev", help="only events of this major,minor")
+    parser.add_argument("--iodepth", type=int, default=32)
+    args = parser.parse_args()
+
+    events = list(parse(args.trace, args.action, args.trace_dev))
+    if not events:
+        print("No %s events in %s" % (args.action, args.trace), file=sys.stderr)
+        return 1
+
+    return replay_sim(events, args) if args.sim is not None else replay_dev(events, args)
+
+
+if __name__ == "__main__":
+    sys.exit(main())
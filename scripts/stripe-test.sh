@@ -0,0 +1,33 @@
+#!/bin/bash
+# One dmzoned volume over several zoned null_blk devices.
+# Usage: stripe-test.sh [nr devices]
+
+nr=${1:-4}
+devs=""
+
+for i in $(seq 1 $nr); do
+	nid=$(sudo bash scripts/nullblk.sh 512 256 0 10 | sed 's|Created /dev/nullb||')
+	devs="$devs /dev/nullb$nid"
+done
+
+ko=dmzoned.ko
+
+make
+sudo insmod $ko
+# Table length is recomputed by the target from the devices, any non-zero value does.
+echo "0 1 dmzoned$devs" | sudo dmsetup create dmz-stripe --table -
+sudo dmsetup table dmz-stripe
+
+# The volume must not load with the devices listed in another order, and must load again in its own.
+swapped=$(echo $devs | awk '{ t = $1; $1 = $2; $2 = t; print }')
+sudo fio --name=stripe --filename=/dev/mapper/dmz-stripe --ioengine=libaio --direct=1 --bs=128k --iodepth=16 --rw=write \
+	--size=2g --verify=crc32c --verify_state_save=0 --do_verify=0 >/dev/null
+sudo dmsetup remove dmz-stripe
+if echo "0 1 dmzoned $swapped" | sudo dmsetup create dmz-stripe --table - 2>/dev/null; then
+	echo "FAIL: loaded with the devices swapped"
+	sudo dmsetup remove dmz-stripe
+	exit 1
+fi
+echo "0 1 dmzoned$devs" | sudo dmsetup create dmz-stripe --table -
+sudo fio --name=stripe --filename=/dev/mapper/dmz-stripe --ioengine=libaio --direct=1 --bs=128k --iodepth=16 --rw=write \
+	--size=2g --verify=crc32c --verify_state_save=0 --verify_only >/dev/null && echo PASS
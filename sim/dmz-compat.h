@@ -0,0 +1,85 @@
+#ifndef _DMZ_COMPAT_H_
+#define _DMZ_COMPAT_H_
+
+/*
+ * Just enough of the kernel for dmz.h and dmz-ftl.c to build in userspace. The simulator is single threaded,
+ * locks, waits and works are placeholders that only give the structs of dmz.h their members.
+ */
+#include <errno.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef uint8_t u8;
+typedef uint16_t u16;
+typedef uint32_t u32;
+typedef uint64_t u64;
+typedef uint8_t __u8;
+typedef uint16_t __u16;
+typedef uint32_t __u32;
+typedef uint64_t __u64;
+typedef uint64_t __le64;
+typedef u64 sector_t;
+typedef u8 blk_status_t;
+
+#define SECTOR_SHIFT 9
+#define DIV_ROUND_UP(n, d) (((n) + (d)-1) / (d))
+#define min_t(type, a, b) ((type)(a) < (type)(b) ? (type)(a) : (type)(b))
+#define max_t(type, a, b) ((type)(a) > (type)(b) ? (type)(a) : (type)(b))
+#define container_of(ptr, type, member) ((type *)((char *)(ptr)-offsetof(type, member)))
+#define sort(base, num, size, cmp, swap) qsort(base, num, size, cmp)
+#define ilog2(n) (63 - __builtin_clzll(n))
+#define __percpu
+#define likely(x) (x)
+#define READ_ONCE(x) (x)
+#define WRITE_ONCE(x, v) ((x) = (v))
+#define U32_MAX UINT32_MAX
+#define raw_cpu_ptr(ptr) (ptr)
+#define this_cpu_add(pcp, v) ((pcp) += (v))
+#define this_cpu_inc(pcp) ((pcp) += 1)
+#define this_cpu_inc_return(pcp) ((pcp) += 1)
+#define atomic64_read(v) ((v)->counter)
+#define atomic64_inc(v) ((v)->counter++)
+#define smp_rmb()
+#define smp_mb__before_atomic()
+#define smp_mb__after_atomic()
+
+#define pr_err(...) fprintf(stderr, __VA_ARGS__)
+#define pr_info(...) fprintf(stderr, __VA_ARGS__)
+
+static inline bool test_bit(long nr, const unsigned long *addr) {
+	return (addr[nr / (8 * sizeof(long))] >> (nr % (8 * sizeof(long)))) & 1;
+}
+
+static inline void set_bit(long nr, unsigned long *addr) {
+	addr[nr / (8 * sizeof(long))] |= 1UL << (nr % (8 * sizeof(long)));
+}
+
+static inline void clear_bit(long nr, unsigned long *addr) {
+	addr[nr / (8 * sizeof(long))] &= ~(1UL << (nr % (8 * sizeof(long))));
+}
+
+typedef struct { int locked; } spinlock_t;
+struct mutex { int locked; };
+typedef struct { int counter; } atomic_t;
+typedef struct { long long counter; } atomic64_t;
+typedef struct { int unused; } wait_queue_head_t;
+struct list_head { struct list_head *next, *prev; };
+struct work_struct { void (*func)(struct work_struct *); };
+struct completion { unsigned int done; };
+struct bio_set { int unused; };
+
+struct bio;
+struct blk_zone;
+struct block_device;
+struct dentry;
+struct dm_dev;
+struct dm_target;
+struct workqueue_struct;
+
+typedef int (*report_zones_cb)(struct blk_zone *zone, unsigned int idx, void *data);
+
+#endif
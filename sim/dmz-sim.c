@@ -0,0 +1,615 @@
+#include "dmz.h"
+#include <errno.h>
+#include <getopt.h>
+#include <math.h>
+#include <time.h>
+
+/*
+ * Userspace FTL simulator. Mapping is dmz-ftl.c, write placement, allocation, reclaim, eager reclaim, the write
+ * cache and destage placement are dmz-policy.c. This file supplies the device side that the kernel files implement
+ * with bios, locks and works, on an in-memory mock zoned device. The mock rejects writes off the write pointer of
+ * sequential zones and records the lba each block was written for, so every read can be checked against the mapping.
+ */
+
+enum { DMZ_SIM_SWEEP, DMZ_SIM_GREEDY };
+enum { DMZ_SIM_UNIFORM, DMZ_SIM_SEQ, DMZ_SIM_SKEW, DMZ_SIM_TRACE };
+
+struct dmz_sim {
+	struct dmz_metadata zmd;
+	struct dmz_target dmz;
+	struct dmz_devs devs;
+	unsigned long capacity; // exported blocks, sized like dmz_capacity
+	int policy;
+
+	// mock zoned device: write pointer of every zone, lba every block holds (~0 for summaries)
+	unsigned int *dev_wp;
+	unsigned long *dev_lba;
+
+	struct dmz_stats stats;
+	u64 ops;
+	u64 resets;
+	u64 discards;
+	u64 verify_errors;
+	int err; // first error of a reclaim or destage started from the write path
+};
+
+#define dmz_sim_of(dmz) container_of(dmz, struct dmz_sim, dmz)
+
+static int dmz_sim_dev_write(struct dmz_sim *sim, unsigned long pba, unsigned long lba) {
+	unsigned long idx = pba >> DMZ_ZONE_NR_BLOCKS_SHIFT;
+	unsigned int offset = pba & DMZ_ZONE_NR_BLOCKS_MASK;
+
+	// Conventional zones take writes anywhere, cached blocks are overwritten in place.
+	if (DMZ_IS_SEQ(&sim->zmd.zone_start[idx]) && offset != sim->dev_wp[idx]) {
+		pr_err("Unaligned write at pba 0x%lx, zone %lu wp %u.\n", pba, idx, sim->dev_wp[idx]);
+		return -EIO;
+	}
+
+	sim->dev_wp[idx] = max_t(unsigned int, sim->dev_wp[idx], offset + 1);
+	sim->dev_lba[pba] = lba;
+	sim->stats.dev_write_blocks++;
+
+	return 0;
+}
+
+static void dmz_sim_dev_reset(struct dmz_sim *sim, int idx) {
+	struct dmz_zone *zone = &sim->zmd.zone_start[idx];
+
+	sim->dev_wp[idx] = 0;
+	zone->wp = 0;
+	if (!DMZ_IS_SEQ(zone))
+		zone->weight = 0;
+	sim->resets++;
+}
+
+/* A read of a valid block must find the lba it was written for. */
+static void dmz_sim_verify(struct dmz_sim *sim, unsigned long lba, unsigned long pba) {
+	if (dmz_is_default_pba(pba) || !dmz_test_bit(&sim->zmd, pba))
+		return;
+
+	if (sim->dev_lba[pba] != lba)
+		sim->verify_errors++;
+}
+
+/* Write the summary closing the segment wp sits at the end of, like dmz_summary_seal and its write. */
+static int dmz_sim_seal(struct dmz_sim *sim, int idx) {
+	struct dmz_zone *zone = &sim->zmd.zone_start[idx];
+	unsigned long pba = ((unsigned long)idx << DMZ_ZONE_NR_BLOCKS_SHIFT) + zone->wp;
+
+	zone->wp++;
+	return dmz_sim_dev_write(sim, pba, ~0UL);
+}
+
+/*
+ * Device side of the kernel files. Checkpoints and the journal are not simulated: nothing is marked dirty and
+ * commits succeed at once. The simulator is single threaded, locks do nothing, resets complete at once and the
+ * reclaim and destage works the kernel queues run right away.
+ */
+void dmz_dirty_mt(struct dmz_metadata *zmd, unsigned long lba) {
+}
+
+void dmz_dirty_rmt(struct dmz_metadata *zmd, unsigned long pba) {
+}
+
+void dmz_dirty_bitmap(struct dmz_metadata *zmd, unsigned long pos) {
+}
+
+void dmz_start_io(struct dmz_metadata *zmd, int idx) {
+}
+
+void dmz_complete_io(struct dmz_metadata *zmd, int idx) {
+}
+
+int dmz_lock_reclaim(struct dmz_metadata *zmd) {
+	return 0;
+}
+
+void dmz_unlock_reclaim(struct dmz_metadata *zmd) {
+}
+
+// The mock is a single device.
+bool dmz_same_dev(struct dmz_metadata *zmd, unsigned long a, unsigned long b) {
+	return true;
+}
+
+void dmz_wait_zone_reset(struct dmz_metadata *zmd, int idx) {
+}
+
+int dmz_reset_zone(struct dmz_metadata *zmd, int idx) {
+	dmz_sim_dev_reset(container_of(zmd, struct dmz_sim, zmd), idx);
+	return 0;
+}
+
+int dmz_reset_zone_async(struct dmz_metadata *zmd, int idx) {
+	return dmz_reset_zone(zmd, idx);
+}
+
+int dmz_journal_commit(struct dmz_target *dmz) {
+	return 0;
+}
+
+int dmz_summary_write(struct dmz_metadata *zmd, int idx) {
+	return dmz_sim_seal(container_of(zmd, struct dmz_sim, zmd), idx);
+}
+
+int dmz_reclaim_move(struct dmz_target *dmz, unsigned long lba, unsigned long pba) {
+	struct dmz_sim *sim = dmz_sim_of(dmz);
+	struct dmz_metadata *zmd = &sim->zmd;
+	struct dmz_zone *z = zmd->zone_start;
+	unsigned long new_pba = ((unsigned long)zmd->reserved_zone << DMZ_ZONE_NR_BLOCKS_SHIFT) + z[zmd->reserved_zone].wp;
+	int ret;
+
+	dmz_sim_verify(sim, lba, pba);
+	if ((ret = dmz_sim_dev_write(sim, new_pba, lba)))
+		return ret;
+	z[zmd->reserved_zone].wp++;
+	sim->stats.reclaim_blocks++;
+	dmz_set_map(zmd, lba, new_pba);
+
+	return 0;
+}
+
+void dmz_reclaim_queue(struct dmz_target *dmz, int idx) {
+	struct dmz_sim *sim = dmz_sim_of(dmz);
+	int cnt = 0, ret = dmz_reclaim_victim(dmz, idx, &cnt);
+
+	// A destage without room fails in the kernel work too, the cache zone waits for the next try.
+	if (ret && ret != -ENOSPC && !sim->err)
+		sim->err = ret;
+}
+
+void dmz_cache_kick(struct dmz_target *dmz, int idx) {
+	if (dmz->zmd->zone_start[idx].weight)
+		dmz_reclaim_queue(dmz, idx);
+}
+
+/* dmz_destage_zone on the mock: same lba order and placement, the whole zone is one batch. */
+int dmz_destage_zone(struct dmz_target *dmz, int idx) {
+	struct dmz_sim *sim = dmz_sim_of(dmz);
+	struct dmz_metadata *zmd = &sim->zmd;
+	struct dmz_zone *zone = zmd->zone_start;
+	int dst = zmd->nr_meta_zones, ret = 0;
+
+	unsigned long *lbas = malloc((zone[idx].weight + 1) * sizeof(unsigned long));
+	if (!lbas)
+		return -ENOMEM;
+
+	unsigned long nr = dmz_destage_collect(zmd, idx, lbas);
+	for (unsigned long i = 0; i < nr && !ret;) {
+		unsigned long cnt, pba = dmz_destage_place(zmd, &dst, nr - i, &cnt);
+		if (dmz_is_default_pba(pba)) {
+			ret = -ENOSPC;
+			break;
+		}
+
+		for (unsigned long k = 0; k < cnt && !ret; k++) {
+			dmz_sim_verify(sim, lbas[i + k], dmz_get_map(zmd, lbas[i + k]));
+			if (!(ret = dmz_sim_dev_write(sim, pba + k, lbas[i + k])))
+				dmz_set_map(zmd, lbas[i + k], pba + k);
+		}
+		sim->stats.destage_blocks += cnt;
+
+		if (!ret && !dmz_wp_seg_left(zone[dst].wp))
+			ret = dmz_sim_seal(sim, dst);
+		i += cnt;
+	}
+
+	if (!ret)
+		dmz_sim_dev_reset(sim, idx);
+	free(lbas);
+	return ret;
+}
+
+int dmz_pba_alloc_n(struct dmz_target *dmz, int nblocks) {
+	return dmz_alloc_zone(dmz);
+}
+
+/* Zone with the most invalid blocks, -1 if reclaim frees nothing anywhere. */
+static int dmz_sim_greedy_victim(struct dmz_sim *sim) {
+	struct dmz_metadata *zmd = &sim->zmd;
+	struct dmz_zone *z = zmd->zone_start;
+	unsigned int best = 0;
+	int victim = -1;
+
+	for (int i = zmd->nr_meta_zones; i < zmd->nr_zones; i++) {
+		if (!dmz_reclaim_needed(zmd, i) || DMZ_IS_CACHE(&z[i]))
+			continue;
+		if (dmz_wp_nr_data(z[i].wp) - z[i].weight > best) {
+			best = dmz_wp_nr_data(z[i].wp) - z[i].weight;
+			victim = i;
+		}
+	}
+
+	return victim;
+}
+
+/*
+ * No zone takes writes. Sweep is what the kernel does, it queues every zone for reclaim. Greedy, not in the
+ * kernel, frees the one victim with the most invalid blocks.
+ */
+int dmz_alloc_stall(struct dmz_target *dmz) {
+	struct dmz_sim *sim = dmz_sim_of(dmz);
+	u64 resets = sim->resets;
+	int victim;
+
+	if (dmz_is_full(&sim->zmd))
+		return -ENOSPC;
+
+	switch (sim->policy) {
+	case DMZ_SIM_GREEDY:
+		for (int n = 0; n < sim->zmd.nr_cache_zones; n++)
+			dmz_cache_kick(dmz, sim->zmd.cache_zones[n]);
+		victim = dmz_sim_greedy_victim(sim);
+		if (victim >= 0)
+			dmz_reclaim_queue(dmz, victim);
+		break;
+	default:
+		for (int i = 0; i < sim->zmd.nr_zones; i++)
+			dmz_reclaim_queue(dmz, i);
+		break;
+	}
+
+	if (sim->err)
+		return sim->err;
+
+	// Nothing was freed, the kernel would queue reclaim over and over.
+	return sim->resets == resets ? -ENOSPC : 0;
+}
+
+/* dmz_submit_write_bio and its clone endio without bios: the mapping changes once data is written. */
+static int dmz_sim_write(struct dmz_sim *sim, unsigned long lba, unsigned long nr_blocks) {
+	struct dmz_metadata *zmd = &sim->zmd;
+	struct dmz_zone *zone = zmd->zone_start;
+	bool cache = dmz_cache_write(zmd, nr_blocks);
+	int ret;
+
+	sim->stats.host_write_blocks += nr_blocks;
+
+	while (nr_blocks) {
+		unsigned long pba;
+		int blk_num, inplace;
+
+		int rzone = dmz_write_place(&sim->dmz, lba, nr_blocks, cache, &pba, &blk_num, &inplace);
+		if (dmz_is_default_pba(rzone))
+			return sim->err ? sim->err : -ENOSPC;
+
+		for (int i = 0; i < blk_num; i++) {
+			if ((ret = dmz_sim_dev_write(sim, pba + i, lba + i)))
+				return ret;
+			if (!inplace)
+				dmz_set_map(zmd, lba + i, pba + i);
+		}
+
+		if (!inplace && !dmz_wp_seg_left(zone[rzone].wp) && (ret = dmz_sim_seal(sim, rzone)))
+			return ret;
+
+		// The last block of the zone is a summary.
+		if (!inplace && (pba & DMZ_ZONE_NR_BLOCKS_MASK) + blk_num == zmd->zone_nr_blocks - 1)
+			dmz_zone_filled(&sim->dmz, rzone);
+		if (sim->err)
+			return sim->err;
+
+		lba += blk_num;
+		nr_blocks -= blk_num;
+	}
+
+	return 0;
+}
+
+static void dmz_sim_read(struct dmz_sim *sim, unsigned long lba, unsigned long nr_blocks) {
+	sim->stats.host_read_blocks += nr_blocks;
+
+	for (unsigned long i = 0; i < nr_blocks; i++)
+		dmz_sim_verify(sim, lba + i, dmz_get_map(&sim->zmd, lba + i));
+}
+
+/* As dmz_handle_discard: the block is dropped from the bitmap, mapping and weight are left alone. */
+static void dmz_sim_discard(struct dmz_sim *sim, unsigned long lba, unsigned long nr_blocks) {
+	sim->discards++;
+
+	for (unsigned long i = 0; i < nr_blocks; i++) {
+		unsigned long pba = dmz_get_map(&sim->zmd, lba + i);
+
+		if (!dmz_is_default_pba(pba))
+			dmz_clear_bit(&sim->zmd, pba);
+	}
+}
+
+static int dmz_sim_op(struct dmz_sim *sim, char op, unsigned long lba, unsigned long nr_blocks) {
+	// Traces of larger volumes are folded into the capacity.
+	lba %= sim->capacity;
+	nr_blocks = min_t(unsigned long, nr_blocks, sim->capacity - lba);
+
+	sim->ops++;
+	switch (op) {
+	case 'W':
+		return dmz_sim_write(sim, lba, nr_blocks);
+	case 'R':
+		dmz_sim_read(sim, lba, nr_blocks);
+		return 0;
+	case 'D':
+		dmz_sim_discard(sim, lba, nr_blocks);
+		return 0;
+	default:
+		// Flushes have nothing to persist here.
+		return 0;
+	}
+}
+
+/* Zones [0, nr_cache_zones) cache small writes, the last one starts as the reserved zone. */
+static int dmz_sim_init(struct dmz_sim *sim, unsigned long nr_zones, unsigned int op_ratio, unsigned int nr_reserved_zones,
+			unsigned int nr_cache_zones) {
+	struct dmz_metadata *zmd = &sim->zmd;
+	unsigned long nr_data_zones = nr_zones - nr_cache_zones;
+	unsigned long nr_spare_zones = max_t(unsigned long, nr_reserved_zones, nr_data_zones * op_ratio / 100);
+
+	// As dmz_nr_cache_zones, the cache needs sequential zones to destage to and reclaim needs two.
+	if (nr_cache_zones + 2 >= nr_zones || nr_data_zones <= nr_spare_zones || nr_zones < 2)
+		return -EINVAL;
+	sim->capacity = (nr_data_zones - nr_spare_zones) * DMZ_ZONE_NR_DATA_BLOCKS;
+
+	sim->dmz.zmd = zmd;
+	sim->devs.nr = 1;
+	zmd->devs = &sim->devs;
+	zmd->stats = &sim->stats;
+	zmd->nr_zones = nr_zones;
+	zmd->zone_nr_blocks = 1 << DMZ_ZONE_NR_BLOCKS_SHIFT;
+	zmd->nr_blocks = nr_zones << DMZ_ZONE_NR_BLOCKS_SHIFT;
+	zmd->reserved_zone = nr_zones - 1;
+	zmd->nr_cache_zones = nr_cache_zones;
+
+	zmd->zone_start = calloc(nr_zones, sizeof(struct dmz_zone));
+	zmd->bitmap_start = calloc(zmd->nr_blocks / 8, 1);
+	zmd->cache_zones = calloc(nr_cache_zones + 1, sizeof(int));
+	sim->dev_wp = calloc(nr_zones, sizeof(unsigned int));
+	sim->dev_lba = malloc(zmd->nr_blocks * sizeof(unsigned long));
+	if (!zmd->zone_start || !zmd->bitmap_start || !zmd->cache_zones || !sim->dev_wp || !sim->dev_lba)
+		return -ENOMEM;
+
+	for (unsigned long i = 0; i < nr_zones; i++) {
+		struct dmz_zone *zone = &zmd->zone_start[i];
+
+		zone->type = DMZ_ZONE_SEQ;
+		if (i < nr_cache_zones) {
+			zone->type = DMZ_ZONE_RND;
+			set_bit(DMZ_ZONE_CACHE, &zone->flags);
+			zmd->cache_zones[i] = i;
+		}
+		zone->mt = malloc(sizeof(struct dmz_map) << DMZ_ZONE_NR_BLOCKS_SHIFT);
+		zone->reverse_mt = malloc(sizeof(struct dmz_map) << DMZ_ZONE_NR_BLOCKS_SHIFT);
+		if (!zone->mt || !zone->reverse_mt)
+			return -ENOMEM;
+		memset(zone->mt, 0xff, sizeof(struct dmz_map) << DMZ_ZONE_NR_BLOCKS_SHIFT);
+		memset(zone->reverse_mt, 0xff, sizeof(struct dmz_map) << DMZ_ZONE_NR_BLOCKS_SHIFT);
+	}
+
+	return 0;
+}
+
+static void dmz_sim_exit(struct dmz_sim *sim) {
+	struct dmz_metadata *zmd = &sim->zmd;
+
+	for (unsigned long i = 0; zmd->zone_start && i < zmd->nr_zones; i++) {
+		free(zmd->zone_start[i].mt);
+		free(zmd->zone_start[i].reverse_mt);
+	}
+	free(zmd->zone_start);
+	free(zmd->bitmap_start);
+	free(zmd->cache_zones);
+	free(sim->dev_wp);
+	free(sim->dev_lba);
+}
+
+/* Mapping and reverse mapping agree on every valid block, weights match the bitmap unless discards broke them. */
+static u64 dmz_sim_check(struct dmz_sim *sim) {
+	struct dmz_metadata *zmd = &sim->zmd;
+	u64 errors = 0;
+
+	for (unsigned long lba = 0; lba < sim->capacity; lba++) {
+		unsigned long pba = dmz_get_map(zmd, lba);
+
+		if (!dmz_is_default_pba(pba) && dmz_test_bit(zmd, pba) && dmz_p2l(zmd, pba) != lba)
+			errors++;
+	}
+
+	for (int i = 0; i < zmd->nr_zones && !sim->discards; i++) {
+		unsigned int weight = 0;
+
+		for (unsigned long b = 0; b < zmd->zone_nr_blocks; b++)
+			weight += dmz_test_bit(zmd, ((unsigned long)i << DMZ_ZONE_NR_BLOCKS_SHIFT) + b);
+		if (weight != zmd->zone_start[i].weight)
+			errors++;
+	}
+
+	return errors;
+}
+
+static unsigned long long dmz_sim_waf(struct dmz_sim *sim) {
+	struct dmz_stats *s = &sim->stats;
+
+	return s->host_write_blocks ? s->dev_write_blocks * 1000 / s->host_write_blocks : 0;
+}
+
+/* Same keys as the debugfs stats file, so one script reads both. */
+static void dmz_sim_report(struct dmz_sim *sim, double secs, u64 check_errors) {
+	struct dmz_stats *s = &sim->stats;
+
+	printf("zones: %lu\ncapacity_bytes: %llu\nops: %llu\n", sim->zmd.nr_zones, (unsigned long long)sim->capacity << DMZ_BLOCK_SHIFT, (unsigned long long)sim->ops);
+	printf("host_read_bytes: %llu\nhost_write_bytes: %llu\ndev_write_bytes: %llu\n", (unsigned long long)s->host_read_blocks << DMZ_BLOCK_SHIFT,
+	       (unsigned long long)s->host_write_blocks << DMZ_BLOCK_SHIFT, (unsigned long long)s->dev_write_blocks << DMZ_BLOCK_SHIFT);
+	printf("reclaim_copy_bytes: %llu\ndestage_bytes: %llu\nreclaims: %llu\nresets: %llu\nalloc_stalls: %llu\n",
+	       (unsigned long long)s->reclaim_blocks << DMZ_BLOCK_SHIFT, (unsigned long long)s->destage_blocks << DMZ_BLOCK_SHIFT, (unsigned long long)s->reclaims, (unsigned long long)sim->resets, (unsigned long long)s->alloc_stalls);
+	printf("waf_milli: %llu\n", dmz_sim_waf(sim));
+	printf("verify_errors: %llu\ncheck_errors: %llu\n", (unsigned long long)sim->verify_errors, (unsigned long long)check_errors);
+	printf("elapsed_ms: %llu\nops_per_sec: %llu\n", (unsigned long long)(secs * 1000), secs > 0 ? (unsigned long long)(sim->ops / secs) : 0ULL);
+}
+
+static double dmz_sim_now(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Trace lines are "<R|W|D|F> <sector> <nr_sectors>" in 512B sectors, '#' starts a comment. */
+static int dmz_sim_replay(struct dmz_sim *sim, FILE *f) {
+	char line[256], op;
+	unsigned long long sector;
+	unsigned int nr_sectors;
+	int ret;
+
+	while (fgets(line, sizeof(line), f)) {
+		if (line[0] == '#' || sscanf(line, " %c %llu %u", &op, &sector, &nr_sectors) != 3 || !nr_sectors)
+			continue;
+
+		unsigned long lba = dmz_sect2blk(sector);
+		unsigned long nr_blocks = dmz_sect2blk(sector + nr_sectors - 1) - lba + 1;
+
+		if ((ret = dmz_sim_op(sim, op, lba, nr_blocks)))
+			return ret;
+	}
+
+	return 0;
+}
+
+static void dmz_sim_usage(void) {
+	fprintf(stderr, "usage: dmz-sim [-z zones] [-o op_ratio] [-r reserved_zones] [-C cache_zones] [-M cache_max_blocks]\n"
+			"               [-e reclaim_invalid_pct] [-p sweep|greedy] [-F prefill_pct]\n"
+			"               [-w uniform|seq|skew] [-n ops] [-b blocks] [-R read_pct] [-t theta] [-s seed] [-c]\n"
+			"               [-T trace|-] [-W max_waf_milli]\n");
+}
+
+int main(int argc, char **argv) {
+	struct dmz_sim sim = { 0 };
+	unsigned long nr_zones = 64, nr_ops = 1000000, nr_blocks = 1;
+	unsigned int op_ratio = 0, nr_reserved_zones = 2, nr_cache_zones = 0, prefill = 0, read_pct = 0, seed = 1;
+	unsigned long long max_waf = 0;
+	int workload = DMZ_SIM_UNIFORM, check = 0, opt, ret;
+	const char *trace = NULL;
+	double theta = 0.9;
+
+	// Defaults of dmz_ctr.
+	sim.zmd.tun.cache_max_blocks = DMZ_CACHE_MAX_BLOCKS;
+	sim.zmd.tun.destage_batch = DMZ_DESTAGE_BATCH;
+	sim.zmd.tun.ckpt_pct = DMZ_JOURNAL_CKPT_PCT;
+
+	while ((opt = getopt(argc, argv, "z:o:r:C:M:e:p:F:w:n:b:R:t:s:cT:W:h")) != -1) {
+		switch (opt) {
+		case 'z':
+			nr_zones = strtoul(optarg, NULL, 0);
+			break;
+		case 'o':
+			op_ratio = strtoul(optarg, NULL, 0);
+			break;
+		case 'r':
+			nr_reserved_zones = strtoul(optarg, NULL, 0);
+			break;
+		case 'C':
+			nr_cache_zones = strtoul(optarg, NULL, 0);
+			break;
+		case 'M':
+			sim.zmd.tun.cache_max_blocks = strtoul(optarg, NULL, 0);
+			break;
+		case 'e':
+			sim.zmd.tun.reclaim_invalid_pct = min_t(unsigned long, strtoul(optarg, NULL, 0), 100);
+			break;
+		case 'p':
+			sim.policy = !strcmp(optarg, "greedy") ? DMZ_SIM_GREEDY : DMZ_SIM_SWEEP;
+			break;
+		case 'F':
+			prefill = strtoul(optarg, NULL, 0);
+			break;
+		case 'w':
+			workload = !strcmp(optarg, "seq") ? DMZ_SIM_SEQ : !strcmp(optarg, "skew") ? DMZ_SIM_SKEW : DMZ_SIM_UNIFORM;
+			break;
+		case 'n':
+			nr_ops = strtoul(optarg, NULL, 0);
+			break;
+		case 'b':
+			nr_blocks = strtoul(optarg, NULL, 0);
+			break;
+		case 'R':
+			read_pct = strtoul(optarg, NULL, 0);
+			break;
+		case 't':
+			theta = strtod(optarg, NULL);
+			break;
+		case 's':
+			seed = strtoul(optarg, NULL, 0);
+			break;
+		case 'c':
+			check = 1;
+			break;
+		case 'T':
+			trace = optarg;
+			workload = DMZ_SIM_TRACE;
+			break;
+		case 'W':
+			max_waf = strtoull(optarg, NULL, 0);
+			break;
+		default:
+			dmz_sim_usage();
+			return 2;
+		}
+	}
+
+	if (op_ratio >= 100 || !nr_blocks || theta <= 0 || theta >= 1 || (ret = dmz_sim_init(&sim, nr_zones, op_ratio, nr_reserved_zones, nr_cache_zones))) {
+		dmz_sim_usage();
+		dmz_sim_exit(&sim);
+		return 2;
+	}
+
+	// Prefill writes sequentially and is not counted, measurements start from a volume that full.
+	ret = 0;
+	for (unsigned long lba = 0; lba < sim.capacity / 100 * min_t(unsigned int, prefill, 100) && !ret; lba += DMZ_SEG_NR_DATA_BLOCKS)
+		ret = dmz_sim_write(&sim, lba, min_t(unsigned long, DMZ_SEG_NR_DATA_BLOCKS, sim.capacity - lba));
+	memset(&sim.stats, 0, sizeof(sim.stats));
+	sim.resets = 0;
+
+	srandom(seed);
+	double start = dmz_sim_now();
+
+	if (workload == DMZ_SIM_TRACE) {
+		FILE *f = strcmp(trace, "-") ? fopen(trace, "r") : stdin;
+
+		if (!f) {
+			perror(trace);
+			dmz_sim_exit(&sim);
+			return 1;
+		}
+		ret = dmz_sim_replay(&sim, f);
+		if (f != stdin)
+			fclose(f);
+	}
+
+	for (unsigned long i = 0; workload != DMZ_SIM_TRACE && i < nr_ops && !ret; i++) {
+		unsigned long span = sim.capacity / nr_blocks, lba;
+
+		if (workload == DMZ_SIM_SEQ)
+			lba = i % span;
+		else if (workload == DMZ_SIM_SKEW)
+			// Power law over the volume, most of the ops hit its first blocks.
+			lba = (unsigned long)(span * pow((double)random() / RAND_MAX, 1 / (1 - theta))) % span;
+		else
+			lba = (unsigned long)random() % span;
+
+		ret = dmz_sim_op(&sim, (unsigned long)random() % 100 < read_pct ? 'R' : 'W', lba * nr_blocks, nr_blocks);
+	}
+
+	double secs = dmz_sim_now() - start;
+
+	if (ret)
+		pr_err("Simulation stopped after %llu ops. Errno: %d\n", (unsigned long long)sim.ops, ret);
+
+	u64 check_errors = check ? dmz_sim_check(&sim) : 0;
+	dmz_sim_report(&sim, secs, check_errors);
+
+	// A write amplification above max_waf is a regression of the policies, make check fails on it.
+	if (max_waf && dmz_sim_waf(&sim) > max_waf) {
+		pr_err("waf_milli %llu is above %llu.\n", dmz_sim_waf(&sim), max_waf);
+		ret = ret ? ret : -ERANGE;
+	}
+	dmz_sim_exit(&sim);
+
+	return ret || sim.verify_errors || check_errors ? 1 : 0;
+}